@@ -1,14 +1,165 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #define BUFFER_SIZE 4096
+#define SEGMENT_BUFFER_SIZE 65536 // receive buffer per segment connection
+#define MAX_SEGMENTS 64
+#define HEADER_SIZE 16384 // largest response header accepted
+#define DEFAULT_CONNECTIONS 4
+#define MAX_CONNECTIONS 1024
+#define MAX_PIPELINE 64
+#define RECV_BUFFER_SIZE 262144 // single stream receive buffer
+#define MAX_IOV 64
+#define DEFAULT_BENCH_THREADS 2
+#define DEFAULT_BENCH_SECONDS 10
+#define BENCH_TIMEOUT_US 2000000 // responses slower than this count as timeouts
+#define MAX_EVENTS 256
+#define HIST_SUB_BUCKETS 128 // latency histogram precision (< 1% error)
+#define HIST_BUCKETS 40 // latencies up to 2^46 us
+#define HIST_SIZE (HIST_SUB_BUCKETS + (HIST_BUCKETS - 1) * (HIST_SUB_BUCKETS / 2))
 #define OUTPUT_FILE "output.dat"
+#define VALIDATOR_FILE "output.dat.validator" // ETag/Last-Modified of a partial download
 #define DEFAULT_PORT "80"
 #define DEFAULT_PATH "/"
 
+// result of fetching one byte range
+enum { SEGMENT_OK, SEGMENT_NO_RANGES, SEGMENT_FAILED };
+
+// byte range [start, end] fetched by one segment thread
+typedef struct {
+    const char *hostname;
+    const char *ip_address;
+    const char *port;
+    const char *path;
+    int fd; // output file shared by all segments
+    long long start;
+    long long end;
+    int result;
+} segment_args;
+
+// incremental response decoder states
+enum { DECODE_HEADER, DECODE_BODY, DECODE_CHUNK_SIZE, DECODE_CHUNK_DATA, DECODE_CHUNK_END, DECODE_TRAILER, DECODE_UNTIL_CLOSE, DECODE_DONE };
+
+// called with every piece of response body, returns -1 to abort
+typedef int (*body_handler)(void *ctx, const char *data, size_t len);
+
+// response decoder, fed with whatever recv returns
+typedef struct {
+    int state;
+    int head_req; // responses to HEAD never have a body
+    char header[HEADER_SIZE];
+    size_t header_len;
+    int status;
+    long long content_length; // -1 if not given
+    int keep_alive; // connection can carry another request afterwards
+    long long remaining; // bytes left in the body or current chunk
+    char line[64]; // chunk size or trailer line
+    size_t line_len;
+    long long body_bytes;
+} http_decoder;
+
+// streaming digests of the response body
+enum { CHECKSUM_NONE, CHECKSUM_CRC32C, CHECKSUM_SHA256 };
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length; // message bytes so far
+    unsigned char block[64];
+    size_t block_len;
+} sha256_context;
+
+typedef struct {
+    int type;
+    uint32_t crc;
+    sha256_context sha;
+    const char *expected; // hex digest to verify against, NULL if none
+} checksum;
+
+// body pieces from one receive buffer, written with a single writev
+typedef struct {
+    int fd;
+    struct iovec iov[MAX_IOV];
+    int iovcnt;
+    checksum *sum; // updated with every piece as it's queued
+} body_writer;
+
+// log-linear (HDR style) histogram of latencies in microseconds
+typedef struct {
+    unsigned long long counts[HIST_SIZE];
+    unsigned long long total;
+    unsigned long long max;
+    double sum;
+} latency_histogram;
+
+// benchmark connection states
+enum { BENCH_CONNECTING, BENCH_WRITING, BENCH_READING, BENCH_WAITING };
+
+// one benchmark connection, driven by its thread's epoll loop
+typedef struct {
+    int fd;
+    int state;
+    size_t written; // bytes of the request sent so far
+    unsigned long long start_us; // when the current request was due
+    unsigned long long next_us; // constant throughput mode: next request due
+    http_decoder dec;
+} bench_connection;
+
+// settings and results of one benchmark thread
+typedef struct {
+    const char *ip_address;
+    const char *port;
+    const char *request;
+    size_t request_len;
+    int connections;
+    unsigned long long end_us;
+    unsigned long long interval_us; // per connection, 0 = as fast as possible
+    unsigned long long requests;
+    unsigned long long bytes;
+    unsigned long long errors_connect;
+    unsigned long long errors_read;
+    unsigned long long errors_write;
+    unsigned long long errors_status;
+    unsigned long long timeouts;
+    latency_histogram hist;
+} bench_thread;
+
+// one line of a batch URL list
+typedef struct {
+    char *hostname;
+    char *ip_address;
+    char *port;
+    char *path;
+    int line; // line number in the list, names the output file
+    int status; // -1 if the request failed
+    long long bytes;
+    double ms; // request sent to response complete
+} batch_url;
+
+// URLs shared by the batch connection threads, sorted by server
+typedef struct {
+    batch_url *urls;
+    int count;
+    int next; // next URL to hand out
+    int pipeline; // requests in flight per connection
+    pthread_mutex_t mutex;
+} batch_queue;
+
 void parse_server_address(const char *serv_addr, char **ip_address, char **port, char **path) {
     // Initialize outputs to default values
     *ip_address = strdup(serv_addr);
@@ -72,18 +223,13 @@ void parse_server_address(const char *serv_addr, char **ip_address, char **port,
 }
 
 
-void send_request(const char *hostname, const char *ip_address, const char *port, const char *path, int head_req) {
+int connect_server(const char *ip_address, const char *port) {
     int sockfd; // socket file descriptor
-    int resp_header = 0; // flag to exclude HTTP response headers in output.dat file write
     struct sockaddr_in addr;
-    char request[BUFFER_SIZE]; // request buffer
-    FILE *output_file = NULL; // for output.dat file
-    char buffer[BUFFER_SIZE]; // receiver buffer
-    ssize_t bytes_read;
 
     if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) { // create socket
         fprintf(stderr, "Socket creation failed\n");
-        exit(1);
+        return -1;
     }
 
     // Initialize server address structure
@@ -93,19 +239,1331 @@ void send_request(const char *hostname, const char *ip_address, const char *port
 
     if (inet_pton(AF_INET, ip_address, &addr.sin_addr) <= 0) { // convert host (IPv4/IPv6) from text to binary
         fprintf(stderr, "Invalid/Unsupported address\n");
-        exit(1);
+        close(sockfd);
+        return -1;
     }
 
     if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) { // connect to server
         fprintf(stderr, "Connection failed\n");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// read until the end of the response headers (they may span several recv
+// calls), any body bytes that came in with them stay in buffer after the
+// headers, returns the total bytes in buffer
+ssize_t read_header(int sockfd, char *buffer, size_t size, size_t *header_len) {
+    size_t total = 0;
+
+    while (total < size - 1) {
+        ssize_t bytes_read = recv(sockfd, buffer + total, size - 1 - total, 0);
+        if (bytes_read <= 0) {
+            return -1;
+        }
+        total += bytes_read;
+        buffer[total] = '\0';
+
+        char *end_header = strstr(buffer, "\r\n\r\n");
+        if (end_header != NULL) {
+            *header_len = end_header - buffer + 4;
+            return total;
+        }
+    }
+
+    return -1; // headers too large
+}
+
+// copy the value of header "name" out of the response headers
+int find_header(const char *header, const char *name, char *value, size_t size) {
+    size_t name_len = strlen(name);
+    const char *line = strstr(header, "\r\n");
+
+    while (line != NULL) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *start = line + name_len + 1;
+            while (*start == ' ' || *start == '\t') {
+                start++;
+            }
+            size_t len = strcspn(start, "\r\n");
+            if (len >= size) {
+                len = size - 1;
+            }
+            memcpy(value, start, len);
+            value[len] = '\0';
+            return 0;
+        }
+        line = strstr(line, "\r\n");
+    }
+
+    return -1;
+}
+
+void decoder_init(http_decoder *dec, int head_req) {
+    memset(dec, 0, sizeof(*dec));
+    dec->state = DECODE_HEADER;
+    dec->head_req = head_req;
+    dec->content_length = -1;
+}
+
+// headers are complete, work out how the body is framed
+int decoder_start_body(http_decoder *dec) {
+    char value[64];
+
+    if (sscanf(dec->header, "HTTP/%*d.%*d %d", &dec->status) != 1) {
+        return -1;
+    }
+
+    // HTTP/1.1 connections persist unless either side says otherwise
+    dec->keep_alive = strncmp(dec->header, "HTTP/1.1", 8) == 0;
+    if (find_header(dec->header, "Connection", value, sizeof(value)) == 0) {
+        if (strcasecmp(value, "close") == 0) {
+            dec->keep_alive = 0;
+        } else if (strcasecmp(value, "keep-alive") == 0) {
+            dec->keep_alive = 1;
+        }
+    }
+    if (find_header(dec->header, "Content-Length", value, sizeof(value)) == 0) {
+        dec->content_length = atoll(value);
+    }
+
+    if (dec->status >= 100 && dec->status < 200) { // interim response, real one follows
+        dec->header_len = 0;
+        dec->content_length = -1;
+        return 0;
+    }
+
+    if (dec->head_req || dec->status == 204 || dec->status == 304) {
+        dec->state = DECODE_DONE;
+    } else if (find_header(dec->header, "Transfer-Encoding", value, sizeof(value)) == 0 && strcasestr(value, "chunked") != NULL) {
+        dec->state = DECODE_CHUNK_SIZE;
+    } else if (dec->content_length >= 0) {
+        dec->remaining = dec->content_length;
+        dec->state = dec->remaining > 0 ? DECODE_BODY : DECODE_DONE;
+    } else { // body ends when the server closes the connection
+        dec->keep_alive = 0;
+        dec->state = DECODE_UNTIL_CLOSE;
+    }
+
+    return 0;
+}
+
+// feed received bytes, body bytes go to on_body, returns how many bytes
+// were used or -1 if the response is malformed, stops early when the
+// headers are complete and when the response is complete (the rest belongs
+// to the next response)
+ssize_t decoder_feed(http_decoder *dec, const char *data, size_t len, body_handler on_body, void *ctx) {
+    size_t used = 0;
+
+    while (used < len && dec->state != DECODE_DONE) {
+        const char *p = data + used;
+        size_t avail = len - used;
+
+        if (dec->state == DECODE_HEADER) {
+            // search again from just before the new bytes, "\r\n\r\n" may be split across reads
+            size_t old_len = dec->header_len;
+            size_t room = sizeof(dec->header) - 1 - old_len;
+            size_t n = avail < room ? avail : room;
+            memcpy(dec->header + old_len, p, n);
+            dec->header_len += n;
+            dec->header[dec->header_len] = '\0';
+
+            size_t from = old_len > 3 ? old_len - 3 : 0;
+            char *end_header = memmem(dec->header + from, dec->header_len - from, "\r\n\r\n", 4);
+            if (end_header == NULL) {
+                if (n == room) {
+                    return -1; // headers too large
+                }
+                used += n;
+                continue;
+            }
+
+            size_t header_size = end_header - dec->header + 4;
+            dec->header[header_size] = '\0';
+            used += header_size - old_len;
+            dec->header_len = header_size;
+            if (decoder_start_body(dec) == -1) {
+                return -1;
+            }
+            if (dec->state != DECODE_HEADER) {
+                break; // let the caller see the headers before any body
+            }
+        } else if (dec->state == DECODE_BODY || dec->state == DECODE_CHUNK_DATA || dec->state == DECODE_UNTIL_CLOSE) {
+            size_t n = avail;
+            if (dec->state != DECODE_UNTIL_CLOSE && (long long)n > dec->remaining) {
+                n = dec->remaining;
+            }
+            if (on_body != NULL && on_body(ctx, p, n) == -1) {
+                return -1;
+            }
+            used += n;
+            dec->body_bytes += n;
+            if (dec->state != DECODE_UNTIL_CLOSE) {
+                dec->remaining -= n;
+                if (dec->remaining == 0) {
+                    dec->state = dec->state == DECODE_BODY ? DECODE_DONE : DECODE_CHUNK_END;
+                }
+            }
+        } else { // chunk size, end of chunk data and trailer lines
+            char c = *p;
+            used++;
+            if (c != '\n') {
+                if (dec->line_len < sizeof(dec->line) - 1) {
+                    dec->line[dec->line_len++] = c;
+                }
+                continue;
+            }
+            dec->line[dec->line_len] = '\0';
+            if (dec->line_len > 0 && dec->line[dec->line_len - 1] == '\r') {
+                dec->line[--dec->line_len] = '\0';
+            }
+
+            if (dec->state == DECODE_CHUNK_SIZE) {
+                char *end;
+                dec->remaining = strtoll(dec->line, &end, 16); // chunk extensions follow ';'
+                if (end == dec->line || dec->remaining < 0) {
+                    return -1;
+                }
+                dec->state = dec->remaining > 0 ? DECODE_CHUNK_DATA : DECODE_TRAILER;
+            } else if (dec->state == DECODE_CHUNK_END) {
+                dec->state = DECODE_CHUNK_SIZE;
+            } else if (dec->line_len == 0) { // empty line ends the trailer
+                dec->state = DECODE_DONE;
+            }
+            dec->line_len = 0;
+        }
+    }
+
+    return used;
+}
+
+// the server closed the connection, returns 0 if that ends the response
+int decoder_finish(http_decoder *dec) {
+    if (dec->state == DECODE_UNTIL_CLOSE) {
+        dec->state = DECODE_DONE;
+    }
+    return dec->state == DECODE_DONE ? 0 : -1;
+}
+
+// HEAD request to learn the body size, returns -1 if unknown
+long long content_length(const char *hostname, const char *ip_address, const char *port, const char *path, int *ranges) {
+    char request[BUFFER_SIZE];
+    char header[BUFFER_SIZE];
+    char value[64];
+    size_t header_len;
+    long long length = -1;
+    int status = 0;
+
+    int sockfd = connect_server(ip_address, port);
+    if (sockfd == -1) {
+        return -1;
+    }
+
+    snprintf(request, BUFFER_SIZE, "HEAD %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", path, hostname);
+    if (send(sockfd, request, strlen(request), 0) == -1 || read_header(sockfd, header, sizeof(header), &header_len) == -1) {
+        close(sockfd);
+        return -1;
+    }
+    close(sockfd);
+
+    sscanf(header, "HTTP/%*s %d", &status);
+    if (status == 200 && find_header(header, "Content-Length", value, sizeof(value)) == 0) {
+        length = atoll(value);
+    }
+
+    // servers that support ranges usually say so, "none" means they don't
+    *ranges = !(find_header(header, "Accept-Ranges", value, sizeof(value)) == 0 && strcasecmp(value, "none") == 0);
+
+    return length;
+}
+
+void *fetch_segment(void *arg) {
+    segment_args *segment = (segment_args *)arg;
+    char request[BUFFER_SIZE];
+    char *buffer = malloc(SEGMENT_BUFFER_SIZE);
+    char value[128];
+    size_t header_len;
+    long long start = -1;
+    int status = 0;
+
+    segment->result = SEGMENT_FAILED;
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    int sockfd = connect_server(segment->ip_address, segment->port);
+    if (sockfd == -1) {
+        free(buffer);
+        return NULL;
+    }
+
+    snprintf(request, BUFFER_SIZE, "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%lld-%lld\r\nConnection: close\r\n\r\n",
+             segment->path, segment->hostname, segment->start, segment->end);
+    ssize_t bytes_read = -1;
+    if (send(sockfd, request, strlen(request), 0) != -1) {
+        bytes_read = read_header(sockfd, buffer, SEGMENT_BUFFER_SIZE, &header_len);
+    }
+    if (bytes_read == -1) {
+        close(sockfd);
+        free(buffer);
+        return NULL;
+    }
+
+    // server has to answer with exactly the range that was asked for
+    sscanf(buffer, "HTTP/%*s %d", &status);
+    if (status == 200) {
+        segment->result = SEGMENT_NO_RANGES;
+    }
+    if (status == 206 && find_header(buffer, "Content-Range", value, sizeof(value)) == 0) {
+        sscanf(value, "bytes %lld-", &start);
+    }
+    if (start != segment->start) {
+        close(sockfd);
+        free(buffer);
+        return NULL;
+    }
+
+    // write body bytes straight to their place in the output file
+    long long offset = segment->start;
+    size_t body_len = bytes_read - header_len;
+    char *body = buffer + header_len;
+    while (offset <= segment->end) {
+        if (body_len > (size_t)(segment->end - offset + 1)) {
+            body_len = segment->end - offset + 1;
+        }
+        if (body_len > 0) {
+            if (pwrite(segment->fd, body, body_len, offset) != (ssize_t)body_len) {
+                break;
+            }
+            offset += body_len;
+        }
+        if (offset > segment->end) {
+            break;
+        }
+
+        bytes_read = recv(sockfd, buffer, SEGMENT_BUFFER_SIZE, 0);
+        if (bytes_read <= 0) {
+            break;
+        }
+        body = buffer;
+        body_len = bytes_read;
+    }
+
+    if (offset > segment->end) {
+        segment->result = SEGMENT_OK;
+    }
+
+    close(sockfd);
+    free(buffer);
+    return NULL;
+}
+
+// fetch the body over several connections, one byte range each, returns -1
+// if the caller should fall back to a single stream
+int parallel_download(const char *hostname, const char *ip_address, const char *port, const char *path, int segments) {
+    int ranges;
+    long long length = content_length(hostname, ip_address, port, path, &ranges);
+    if (length <= 0 || ranges == 0) {
+        return -1;
+    }
+    if (length < segments) {
+        segments = length;
+    }
+
+    int fd = open(OUTPUT_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening output file\n");
+        exit(1);
+    }
+
+    // reserve the whole file up front so segments can land anywhere in it
+    if (fallocate(fd, 0, 0, length) == -1 && ftruncate(fd, length) == -1) {
+        fprintf(stderr, "Error allocating output file\n");
+        close(fd);
+        exit(1);
+    }
+
+    segment_args args[MAX_SEGMENTS];
+    pthread_t threads[MAX_SEGMENTS];
+    long long segment_size = length / segments;
+    for (int i = 0; i < segments; i++) {
+        args[i].hostname = hostname;
+        args[i].ip_address = ip_address;
+        args[i].port = port;
+        args[i].path = path;
+        args[i].fd = fd;
+        args[i].start = i * segment_size;
+        args[i].end = (i == segments - 1) ? length - 1 : (i + 1) * segment_size - 1;
+        args[i].result = SEGMENT_FAILED;
+        if (pthread_create(&threads[i], NULL, fetch_segment, &args[i]) != 0) {
+            fprintf(stderr, "Error creating segment thread\n");
+            exit(1);
+        }
+    }
+
+    int result = 0;
+    for (int i = 0; i < segments; i++) {
+        pthread_join(threads[i], NULL);
+        if (args[i].result == SEGMENT_NO_RANGES) {
+            result = -1; // ranges ignored, start over with one stream
+        } else if (args[i].result == SEGMENT_FAILED && result == 0) {
+            result = 1;
+        }
+    }
+    close(fd);
+
+    if (result == 1) {
+        fprintf(stderr, "Segmented download failed\n");
+        exit(1);
+    }
+
+    return result;
+}
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int write_body(void *ctx, const char *data, size_t len) {
+    int fd = *(int *)ctx;
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+int same_server(const batch_url *a, const batch_url *b) {
+    return strcmp(a->ip_address, b->ip_address) == 0 && strcmp(a->port, b->port) == 0;
+}
+
+int compare_server(const void *a, const void *b) {
+    const batch_url *url_a = (const batch_url *)a;
+    const batch_url *url_b = (const batch_url *)b;
+    int cmp = strcmp(url_a->ip_address, url_b->ip_address);
+    if (cmp == 0) {
+        cmp = strcmp(url_a->port, url_b->port);
+    }
+    if (cmp == 0) { // keep list order within a server
+        cmp = url_a->line - url_b->line;
+    }
+    return cmp;
+}
+
+int compare_line(const void *a, const void *b) {
+    return ((const batch_url *)a)->line - ((const batch_url *)b)->line;
+}
+
+// send requests for urls[0..count), pipelined on one connection
+int send_batch_requests(int sockfd, batch_url *urls, int count) {
+    char request[BUFFER_SIZE * 4];
+    size_t len = 0;
+
+    for (int i = 0; i < count; i++) {
+        int n = snprintf(request + len, sizeof(request) - len, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", urls[i].path, urls[i].hostname);
+        if (n < 0 || (size_t)n >= sizeof(request) - len) {
+            return -1;
+        }
+        len += n;
+    }
+
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(sockfd, request + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+void *batch_connection(void *arg) {
+    batch_queue *queue = (batch_queue *)arg;
+    char *buffer = malloc(SEGMENT_BUFFER_SIZE);
+    http_decoder *dec = malloc(sizeof(http_decoder));
+    batch_url *server = NULL; // server the connection is open to
+    int sockfd = -1;
+    size_t buffered = 0; // received bytes not yet decoded
+    size_t buffer_pos = 0;
+
+    if (buffer == NULL || dec == NULL) {
+        free(buffer);
+        free(dec);
+        return NULL;
+    }
+
+    while (1) {
+        // take the next few URLs for the same server
+        pthread_mutex_lock(&queue->mutex);
+        int first = queue->next;
+        int count = 0;
+        while (first + count < queue->count && count < queue->pipeline && same_server(&queue->urls[first], &queue->urls[first + count])) {
+            count++;
+        }
+        queue->next += count;
+        pthread_mutex_unlock(&queue->mutex);
+        if (count == 0) {
+            break;
+        }
+        batch_url *urls = &queue->urls[first];
+
+        int done = 0;
+        int retried = 0;
+        while (done < count) {
+            // (re)connect and send everything that is still outstanding
+            if (sockfd == -1 || !same_server(server, &urls[0])) {
+                if (sockfd != -1) {
+                    close(sockfd);
+                }
+                sockfd = connect_server(urls[0].ip_address, urls[0].port);
+                server = &urls[0];
+                buffered = 0;
+                buffer_pos = 0;
+            }
+            double sent_ms = now_ms();
+            if (sockfd == -1 || send_batch_requests(sockfd, &urls[done], count - done) == -1) {
+                break;
+            }
+
+            // responses come back in request order
+            while (done < count) {
+                batch_url *url = &urls[done];
+                char output_name[64];
+                snprintf(output_name, sizeof(output_name), "output-%d.dat", url->line);
+                int fd = open(output_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd == -1) {
+                    fprintf(stderr, "Error opening output file %s\n", output_name);
+                    break;
+                }
+
+                decoder_init(dec, 0);
+                int failed = 0;
+                while (dec->state != DECODE_DONE) {
+                    if (buffered == 0) {
+                        ssize_t bytes_read = recv(sockfd, buffer, SEGMENT_BUFFER_SIZE, 0);
+                        if (bytes_read <= 0) {
+                            failed = decoder_finish(dec);
+                            break;
+                        }
+                        buffered = bytes_read;
+                        buffer_pos = 0;
+                    }
+                    ssize_t used = decoder_feed(dec, buffer + buffer_pos, buffered, write_body, &fd);
+                    if (used == -1) {
+                        failed = -1;
+                        break;
+                    }
+                    buffer_pos += used;
+                    buffered -= used;
+                }
+                close(fd);
+
+                if (failed == -1) {
+                    break;
+                }
+                url->status = dec->status;
+                url->bytes = dec->body_bytes;
+                url->ms = now_ms() - sent_ms;
+                done++;
+
+                if (!dec->keep_alive) { // server won't take more requests on this connection
+                    close(sockfd);
+                    sockfd = -1;
+                    break;
+                }
+            }
+
+            if (done < count && sockfd != -1) { // connection broke mid-pipeline
+                close(sockfd);
+                sockfd = -1;
+            }
+            if (done < count && sockfd == -1 && retried++ > count) {
+                break;
+            }
+        }
+
+        for (int i = done; i < count; i++) {
+            urls[i].status = -1;
+        }
+    }
+
+    if (sockfd != -1) {
+        close(sockfd);
+    }
+    free(buffer);
+    free(dec);
+    return NULL;
+}
+
+// fetch every "hostname ip:port/path" line of list_file over a pool of
+// persistent connections, results go to output-<line>.dat
+void batch_download(const char *list_file, int connections, int pipeline) {
+    FILE *list = fopen(list_file, "r");
+    if (list == NULL) {
+        fprintf(stderr, "Error opening URL list file\n");
         exit(1);
     }
 
-    // format GET or HEAD HTTP requests
+    batch_queue queue;
+    int capacity = 64;
+    queue.urls = malloc(capacity * sizeof(batch_url));
+    queue.count = 0;
+    queue.next = 0;
+    queue.pipeline = pipeline;
+    pthread_mutex_init(&queue.mutex, NULL);
+
+    char line[BUFFER_SIZE];
+    char line_host[BUFFER_SIZE];
+    char line_addr[BUFFER_SIZE];
+    int line_num = 0;
+    while (fgets(line, sizeof(line), list) != NULL) {
+        line_num++;
+        if (sscanf(line, "%s %s", line_host, line_addr) != 2) {
+            continue; // blank or malformed line
+        }
+        if (queue.count == capacity) {
+            capacity *= 2;
+            queue.urls = realloc(queue.urls, capacity * sizeof(batch_url));
+        }
+        if (queue.urls == NULL) {
+            fprintf(stderr, "Error allocating URL list\n");
+            exit(1);
+        }
+        batch_url *url = &queue.urls[queue.count++];
+        url->hostname = strdup(line_host);
+        parse_server_address(line_addr, &url->ip_address, &url->port, &url->path);
+        url->line = line_num;
+        url->status = -1;
+        url->bytes = 0;
+        url->ms = 0;
+    }
+    fclose(list);
+
+    // URLs for the same server next to each other so connections get reused
+    qsort(queue.urls, queue.count, sizeof(batch_url), compare_server);
+
+    if (connections > queue.count) {
+        connections = queue.count;
+    }
+    pthread_t threads[MAX_CONNECTIONS];
+    double start_ms = now_ms();
+    for (int i = 0; i < connections; i++) {
+        if (pthread_create(&threads[i], NULL, batch_connection, &queue) != 0) {
+            fprintf(stderr, "Error creating connection thread\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed_ms = now_ms() - start_ms;
+
+    // per-request results in list order, then totals
+    qsort(queue.urls, queue.count, sizeof(batch_url), compare_line);
+    long long total_bytes = 0;
+    int failed = 0;
+    for (int i = 0; i < queue.count; i++) {
+        batch_url *url = &queue.urls[i];
+        printf("%d, %s, %s:%s%s, %d, %lld, %.3f ms\n", url->line, url->hostname, url->ip_address, url->port, url->path, url->status, url->bytes, url->ms);
+        if (url->status == -1) {
+            failed++;
+        }
+        total_bytes += url->bytes;
+        free(url->hostname);
+        free(url->ip_address);
+        free(url->port);
+        free(url->path);
+    }
+    double seconds = elapsed_ms / 1000.0;
+    printf("%d requests (%d failed), %lld bytes in %.3f s, %.1f requests/s, %.3f MB/s\n", queue.count, failed, total_bytes, seconds,
+           seconds > 0 ? queue.count / seconds : 0, seconds > 0 ? total_bytes / seconds / 1000000.0 : 0);
+
+    pthread_mutex_destroy(&queue.mutex);
+    free(queue.urls);
+}
+
+uint32_t crc32c_table[256];
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_block(sha256_context *ctx, const unsigned char *block) {
+    uint32_t w[64];
+    uint32_t s[8];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    memcpy(s, ctx->state, sizeof(s));
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = s[7] + (ROTR(s[4], 6) ^ ROTR(s[4], 11) ^ ROTR(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(s[0], 2) ^ ROTR(s[0], 13) ^ ROTR(s[0], 22)) + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        memmove(s + 1, s, 7 * sizeof(uint32_t));
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++) {
+        ctx->state[i] += s[i];
+    }
+}
+
+void checksum_init(checksum *sum, int type, const char *expected) {
+    static const uint32_t sha256_init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+    memset(sum, 0, sizeof(*sum));
+    sum->type = type;
+    sum->expected = expected;
+    sum->crc = 0xffffffff;
+    memcpy(sum->sha.state, sha256_init, sizeof(sha256_init));
+
+    // reflected Castagnoli polynomial
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+void checksum_update(checksum *sum, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+
+    if (sum->type == CHECKSUM_CRC32C) {
+        uint32_t crc = sum->crc;
+        for (size_t i = 0; i < len; i++) {
+            crc = crc32c_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+        }
+        sum->crc = crc;
+    } else if (sum->type == CHECKSUM_SHA256) {
+        sha256_context *ctx = &sum->sha;
+        ctx->length += len;
+        if (ctx->block_len > 0) { // top up a partial block first
+            size_t take = 64 - ctx->block_len < len ? 64 - ctx->block_len : len;
+            memcpy(ctx->block + ctx->block_len, bytes, take);
+            ctx->block_len += take;
+            bytes += take;
+            len -= take;
+            if (ctx->block_len < 64) {
+                return;
+            }
+            sha256_block(ctx, ctx->block);
+            ctx->block_len = 0;
+        }
+        for (; len >= 64; bytes += 64, len -= 64) {
+            sha256_block(ctx, bytes);
+        }
+        memcpy(ctx->block, bytes, len);
+        ctx->block_len = len;
+    }
+}
+
+// finish the digest and format it as lowercase hex
+void checksum_final(checksum *sum, char *hex) {
+    if (sum->type == CHECKSUM_CRC32C) {
+        sprintf(hex, "%08x", sum->crc ^ 0xffffffff);
+        return;
+    }
+
+    sha256_context *ctx = &sum->sha;
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad[72] = {0x80};
+    size_t pad_len = (ctx->block_len < 56 ? 56 : 120) - ctx->block_len;
+    for (int i = 0; i < 8; i++) {
+        pad[pad_len + i] = bits >> (56 - i * 8);
+    }
+    checksum_update(sum, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        sprintf(hex + i * 8, "%08x", ctx->state[i]);
+    }
+}
+
+// digest the first length bytes already in the output file
+int checksum_file(checksum *sum, long long length) {
+    char *buffer = malloc(RECV_BUFFER_SIZE);
+    int fd = open(OUTPUT_FILE, O_RDONLY);
+    if (buffer == NULL || fd == -1) {
+        free(buffer);
+        return -1;
+    }
+
+    while (length > 0) {
+        ssize_t bytes_read = read(fd, buffer, length < RECV_BUFFER_SIZE ? length : RECV_BUFFER_SIZE);
+        if (bytes_read <= 0) {
+            break;
+        }
+        checksum_update(sum, buffer, bytes_read);
+        length -= bytes_read;
+    }
+
+    close(fd);
+    free(buffer);
+    return length == 0 ? 0 : -1;
+}
+
+// print the digest of the finished download, exit if it doesn't match
+void checksum_verify(checksum *sum) {
+    char hex[65];
+
+    if (sum->type == CHECKSUM_NONE) {
+        return;
+    }
+    checksum_final(sum, hex);
+    printf("%s  %s\n", hex, OUTPUT_FILE);
+    if (sum->expected != NULL && strcasecmp(hex, sum->expected) != 0) {
+        fprintf(stderr, "Checksum mismatch, expected %s\n", sum->expected);
+        exit(1);
+    }
+}
+
+// strong ETag or Last-Modified of a response, empty if it has neither
+void response_validator(const char *header, char *validator, size_t size) {
+    // weak ETags can't be used with If-Range
+    if (find_header(header, "ETag", validator, size) == 0 && strncmp(validator, "W/", 2) != 0) {
+        return;
+    }
+    if (find_header(header, "Last-Modified", validator, size) != 0) {
+        validator[0] = '\0';
+    }
+}
+
+// size of a partial download that can be resumed, 0 if there is none
+long long partial_length(char *validator, size_t size) {
+    struct stat st;
+
+    validator[0] = '\0';
+    if (stat(OUTPUT_FILE, &st) == -1 || st.st_size == 0) {
+        return 0;
+    }
+
+    FILE *file = fopen(VALIDATOR_FILE, "r");
+    if (file != NULL) {
+        if (fgets(validator, size, file) == NULL) {
+            validator[0] = '\0';
+        }
+        validator[strcspn(validator, "\r\n")] = '\0';
+        fclose(file);
+    }
+    if (validator[0] == '\0') { // without a validator a changed file can't be detected
+        fprintf(stderr, "No validator for the partial download, starting over\n");
+        return 0;
+    }
+
+    return st.st_size;
+}
+
+int flush_body(body_writer *writer) {
+    struct iovec *iov = writer->iov;
+    int iovcnt = writer->iovcnt;
+
+    while (iovcnt > 0) {
+        ssize_t written = writev(writer->fd, iov, iovcnt);
+        if (written <= 0) {
+            return -1;
+        }
+        // skip what made it out, a short write can end mid-iovec
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    writer->iovcnt = 0;
+    return 0;
+}
+
+int queue_body(void *ctx, const char *data, size_t len) {
+    body_writer *writer = (body_writer *)ctx;
+    if (writer->iovcnt == MAX_IOV && flush_body(writer) == -1) {
+        return -1;
+    }
+    if (writer->sum != NULL) {
+        checksum_update(writer->sum, data, len);
+    }
+    writer->iov[writer->iovcnt].iov_base = (void *)data;
+    writer->iov[writer->iovcnt].iov_len = len;
+    writer->iovcnt++;
+    return 0;
+}
+
+// body of known length, received straight into the mapped output file
+int receive_mapped(int sockfd, const char *body, size_t body_len, long long length, checksum *sum) {
+    int fd = open(OUTPUT_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening output file\n");
+        exit(1);
+    }
+    if (fallocate(fd, 0, 0, length) == -1 && ftruncate(fd, length) == -1) {
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, length, PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    // body bytes that came in with the headers, then the rest
+    long long received = (long long)body_len < length ? (long long)body_len : length;
+    memcpy(map, body, received);
+    checksum_update(sum, map, received);
+    while (received < length) {
+        ssize_t bytes_read = recv(sockfd, map + received, length - received, 0);
+        if (bytes_read <= 0) {
+            break;
+        }
+        checksum_update(sum, map + received, bytes_read); // still hot in cache
+        received += bytes_read;
+    }
+
+    munmap(map, length);
+    if (received < length) { // don't leave a zero-filled tail behind
+        if (ftruncate(fd, received) == -1) {
+            fprintf(stderr, "Error truncating output file\n");
+        }
+        fprintf(stderr, "Connection closed before the full response was received\n");
+        close(fd);
+        exit(1);
+    }
+    close(fd);
+
+    return 0;
+}
+
+unsigned long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+int hist_index(unsigned long long value) {
+    if (value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+    // bucket b covers [64 << b, 128 << b) with 64 sub-buckets
+    int bucket = 63 - __builtin_clzll(value) - 6;
+    if (bucket >= HIST_BUCKETS) {
+        return HIST_SIZE - 1;
+    }
+    int sub = (value >> bucket) - HIST_SUB_BUCKETS / 2;
+    return HIST_SUB_BUCKETS + (bucket - 1) * (HIST_SUB_BUCKETS / 2) + sub;
+}
+
+// middle of the range of values that land in index
+unsigned long long hist_value(int index) {
+    if (index < HIST_SUB_BUCKETS) {
+        return index;
+    }
+    int bucket = (index - HIST_SUB_BUCKETS) / (HIST_SUB_BUCKETS / 2) + 1;
+    int sub = (index - HIST_SUB_BUCKETS) % (HIST_SUB_BUCKETS / 2) + HIST_SUB_BUCKETS / 2;
+    return ((unsigned long long)sub << bucket) + (1ULL << (bucket - 1));
+}
+
+void hist_record(latency_histogram *hist, unsigned long long value) {
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    hist->sum += value;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+void hist_merge(latency_histogram *into, const latency_histogram *from) {
+    for (int i = 0; i < HIST_SIZE; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+unsigned long long hist_percentile(const latency_histogram *hist, double percentile) {
+    unsigned long long target = (unsigned long long)(hist->total * percentile / 100.0 + 0.5);
+    unsigned long long seen = 0;
+    if (target == 0) {
+        target = 1;
+    }
+    for (int i = 0; i < HIST_SIZE; i++) {
+        seen += hist->counts[i];
+        if (seen >= target) {
+            unsigned long long value = hist_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void print_latency(const char *label, unsigned long long us) {
+    if (us >= 1000000) {
+        printf("%10s %10.2fs\n", label, us / 1000000.0);
+    } else if (us >= 1000) {
+        printf("%10s %10.2fms\n", label, us / 1000.0);
+    } else {
+        printf("%10s %10lluus\n", label, us);
+    }
+}
+
+void bench_close(int epfd, bench_connection *conn) {
+    if (conn->fd != -1) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+void bench_connect(bench_thread *bench, int epfd, bench_connection *conn) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(bench->port));
+    inet_pton(AF_INET, bench->ip_address, &addr.sin_addr);
+
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (conn->fd == -1) {
+        bench->errors_connect++;
+        return;
+    }
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+        bench->errors_connect++;
+        close(conn->fd);
+        conn->fd = -1;
+        return;
+    }
+
+    conn->state = BENCH_CONNECTING;
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = conn;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+}
+
+void bench_set_events(int epfd, bench_connection *conn, unsigned int events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+void bench_write(bench_thread *bench, int epfd, bench_connection *conn) {
+    while (conn->written < bench->request_len) {
+        ssize_t n = send(conn->fd, bench->request + conn->written, bench->request_len - conn->written, MSG_NOSIGNAL);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            bench_set_events(epfd, conn, EPOLLOUT);
+            return;
+        }
+        if (n <= 0) {
+            bench->errors_write++;
+            bench_close(epfd, conn);
+            return;
+        }
+        conn->written += n;
+    }
+
+    conn->state = BENCH_READING;
+    decoder_init(&conn->dec, 0);
+    bench_set_events(epfd, conn, EPOLLIN);
+}
+
+// start the next request now, or park the connection until it is due
+void bench_next(bench_thread *bench, int epfd, bench_connection *conn) {
+    unsigned long long now = now_us();
+
+    if (bench->interval_us == 0) {
+        conn->start_us = now;
+    } else {
+        if (conn->next_us > now) {
+            conn->state = BENCH_WAITING;
+            bench_set_events(epfd, conn, 0);
+            return;
+        }
+        // latency counts from when the request was due, not when it went
+        // out, so a stalled server can't hide its queueing delay
+        conn->start_us = conn->next_us;
+        conn->next_us += bench->interval_us;
+    }
+
+    conn->state = BENCH_WRITING;
+    conn->written = 0;
+    bench_write(bench, epfd, conn);
+}
+
+void bench_read(bench_thread *bench, int epfd, bench_connection *conn, char *buffer) {
+    while (1) {
+        ssize_t bytes_read = recv(conn->fd, buffer, SEGMENT_BUFFER_SIZE, 0);
+        if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (bytes_read <= 0) {
+            if (bytes_read == 0 && decoder_finish(&conn->dec) == 0) {
+                break; // close-delimited response
+            }
+            bench->errors_read++;
+            bench_close(epfd, conn);
+            return;
+        }
+        bench->bytes += bytes_read;
+
+        ssize_t used = 0;
+        while (used < bytes_read && conn->dec.state != DECODE_DONE) {
+            ssize_t n = decoder_feed(&conn->dec, buffer + used, bytes_read - used, NULL, NULL);
+            if (n == -1) {
+                bench->errors_read++;
+                bench_close(epfd, conn);
+                return;
+            }
+            used += n;
+        }
+        if (conn->dec.state == DECODE_DONE) {
+            break;
+        }
+    }
+
+    unsigned long long latency = now_us() - conn->start_us;
+    hist_record(&bench->hist, latency);
+    bench->requests++;
+    if (latency > BENCH_TIMEOUT_US) {
+        bench->timeouts++;
+    }
+    if (conn->dec.status < 200 || conn->dec.status > 399) {
+        bench->errors_status++;
+    }
+
+    if (!conn->dec.keep_alive) {
+        bench_close(epfd, conn);
+        return;
+    }
+    bench_next(bench, epfd, conn);
+}
+
+void *bench_loop(void *arg) {
+    bench_thread *bench = (bench_thread *)arg;
+    bench_connection *conns = calloc(bench->connections, sizeof(bench_connection));
+    struct epoll_event events[MAX_EVENTS];
+    char *buffer = malloc(SEGMENT_BUFFER_SIZE);
+    int epfd = epoll_create1(0);
+
+    if (conns == NULL || buffer == NULL || epfd == -1) {
+        fprintf(stderr, "Error setting up benchmark thread\n");
+        exit(1);
+    }
+
+    // spread the connections' schedules over one interval
+    unsigned long long start = now_us();
+    for (int i = 0; i < bench->connections; i++) {
+        conns[i].next_us = start + bench->interval_us * i / bench->connections;
+        bench_connect(bench, epfd, &conns[i]);
+    }
+
+    while (1) {
+        unsigned long long now = now_us();
+        if (now >= bench->end_us) {
+            break;
+        }
+
+        // reconnect closed connections, start requests that became due
+        unsigned long long wake = bench->end_us;
+        for (int i = 0; i < bench->connections; i++) {
+            bench_connection *conn = &conns[i];
+            if (conn->fd == -1) {
+                bench_connect(bench, epfd, conn);
+                if (conn->fd == -1) {
+                    continue;
+                }
+            }
+            if (conn->state == BENCH_WAITING) {
+                if (conn->next_us <= now) {
+                    bench_next(bench, epfd, conn);
+                } else if (conn->next_us < wake) {
+                    wake = conn->next_us;
+                }
+            }
+        }
+
+        int timeout_ms = (wake - now + 999) / 1000;
+        int ready = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+        for (int i = 0; i < ready; i++) {
+            bench_connection *conn = (bench_connection *)events[i].data.ptr;
+            if (conn->fd == -1) {
+                continue;
+            }
+            if (conn->state == BENCH_CONNECTING) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    bench->errors_connect++;
+                    bench_close(epfd, conn);
+                    continue;
+                }
+                bench_next(bench, epfd, conn);
+            } else if (conn->state == BENCH_WRITING) {
+                bench_write(bench, epfd, conn);
+            } else if (conn->state == BENCH_READING) {
+                bench_read(bench, epfd, conn, buffer);
+            }
+        }
+    }
+
+    for (int i = 0; i < bench->connections; i++) {
+        bench_close(epfd, &conns[i]);
+    }
+    close(epfd);
+    free(buffer);
+    free(conns);
+    return NULL;
+}
+
+// keep connections busy for seconds with requests for path (rate requests/s
+// in total when rate > 0) and report throughput and latency percentiles
+void benchmark(const char *hostname, const char *ip_address, const char *port, const char *path, int connections, int threads,
+               int seconds, int rate) {
+    char request[BUFFER_SIZE];
+    snprintf(request, BUFFER_SIZE, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, hostname);
+
+    if (threads > connections) {
+        threads = connections;
+    }
+    bench_thread *benches = calloc(threads, sizeof(bench_thread));
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    if (benches == NULL || tids == NULL) {
+        fprintf(stderr, "Error allocating benchmark threads\n");
+        exit(1);
+    }
+
+    printf("Running %ds test @ %s:%s%s\n", seconds, ip_address, port, path);
+    printf("  %d threads and %d connections%s\n", threads, connections, rate > 0 ? "" : ", as fast as possible");
+    if (rate > 0) {
+        printf("  constant throughput of %d requests/s\n", rate);
+    }
+
+    unsigned long long start = now_us();
+    for (int i = 0; i < threads; i++) {
+        bench_thread *bench = &benches[i];
+        bench->ip_address = ip_address;
+        bench->port = port;
+        bench->request = request;
+        bench->request_len = strlen(request);
+        bench->connections = connections / threads + (i < connections % threads);
+        bench->end_us = start + seconds * 1000000ULL;
+        if (rate > 0) {
+            bench->interval_us = 1000000ULL * connections / rate;
+            if (bench->interval_us == 0) {
+                bench->interval_us = 1;
+            }
+        }
+        if (pthread_create(&tids[i], NULL, bench_loop, bench) != 0) {
+            fprintf(stderr, "Error creating benchmark thread\n");
+            exit(1);
+        }
+    }
+
+    bench_thread total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        total.requests += benches[i].requests;
+        total.bytes += benches[i].bytes;
+        total.errors_connect += benches[i].errors_connect;
+        total.errors_read += benches[i].errors_read;
+        total.errors_write += benches[i].errors_write;
+        total.errors_status += benches[i].errors_status;
+        total.timeouts += benches[i].timeouts;
+        hist_merge(&total.hist, &benches[i].hist);
+    }
+    double elapsed = (now_us() - start) / 1000000.0;
+
+    printf("  Latency distribution\n");
+    print_latency("mean", total.hist.total > 0 ? (unsigned long long)(total.hist.sum / total.hist.total) : 0);
+    print_latency("50%", hist_percentile(&total.hist, 50));
+    print_latency("90%", hist_percentile(&total.hist, 90));
+    print_latency("99%", hist_percentile(&total.hist, 99));
+    print_latency("99.9%", hist_percentile(&total.hist, 99.9));
+    print_latency("max", total.hist.max);
+    printf("  %llu requests in %.2fs, %.2f MB read\n", total.requests, elapsed, total.bytes / 1000000.0);
+    if (total.errors_connect + total.errors_read + total.errors_write + total.timeouts > 0) {
+        printf("  Socket errors: connect %llu, read %llu, write %llu, timeout %llu\n", total.errors_connect, total.errors_read,
+               total.errors_write, total.timeouts);
+    }
+    if (total.errors_status > 0) {
+        printf("  Non-2xx or 3xx responses: %llu\n", total.errors_status);
+    }
+    printf("Requests/sec: %10.2f\n", total.requests / elapsed);
+    printf("Transfer/sec: %10.2f MB\n", total.bytes / elapsed / 1000000.0);
+
+    free(benches);
+    free(tids);
+}
+
+void send_request(const char *hostname, const char *ip_address, const char *port, const char *path, int head_req, int resume, checksum *sum) {
+    char request[BUFFER_SIZE]; // request buffer
+    char *buffer = malloc(RECV_BUFFER_SIZE); // receiver buffer
+    http_decoder *dec = malloc(sizeof(http_decoder)); // incremental response decoder
+    char validator[256];
+    char value[128];
+    ssize_t bytes_read;
+    ssize_t used = 0;
+    long long offset = 0; // where the body goes in the output file
+
+    if (buffer == NULL || dec == NULL) {
+        fprintf(stderr, "Error allocating receive buffer\n");
+        exit(1);
+    }
+
+    // pick up a partial download where it stopped
+    long long resume_from = 0;
+    if (resume == 1 && head_req == 0) {
+        resume_from = partial_length(validator, sizeof(validator));
+    }
+
+    int sockfd = connect_server(ip_address, port); // socket file descriptor
+    if (sockfd == -1) {
+        exit(1);
+    }
+
+    // format GET or HEAD HTTP requests, a resumed GET only asks for the rest
+    // if the file hasn't changed since the partial download
     if (head_req == 1) {
-        snprintf(request, BUFFER_SIZE, "HEAD %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, hostname);
+        snprintf(request, BUFFER_SIZE, "HEAD %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", path, hostname);
+    } else if (resume_from > 0) {
+        snprintf(request, BUFFER_SIZE, "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%lld-\r\nIf-Range: %s\r\nConnection: close\r\n\r\n",
+                 path, hostname, resume_from, validator);
     } else {
-        snprintf(request, BUFFER_SIZE, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, hostname);
+        snprintf(request, BUFFER_SIZE, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", path, hostname);
     }
 
     if (send(sockfd, request, strlen(request), 0) == -1) { // send HTTP request
@@ -113,55 +1571,252 @@ void send_request(const char *hostname, const char *ip_address, const char *port
         exit(1);
     }
 
-    // client receives and prints according to GET or HEAD
-    if (head_req == 0) { // if GET, open output file in write bytes mode
-        output_file = fopen(OUTPUT_FILE, "wb");
+    // decode headers, they may span several reads
+    decoder_init(dec, head_req);
+    bytes_read = 0;
+    while (dec->state == DECODE_HEADER) {
+        bytes_read = recv(sockfd, buffer, RECV_BUFFER_SIZE, 0);
+        if (bytes_read <= 0) {
+            fprintf(stderr, "Connection closed before the response headers were received\n");
+            exit(1);
+        }
+        used = decoder_feed(dec, buffer, bytes_read, NULL, NULL);
+        if (used == -1) {
+            fprintf(stderr, "Malformed response\n");
+            exit(1);
+        }
     }
 
-    while ((bytes_read = recv(sockfd, buffer, BUFFER_SIZE - 1, 0)) > 0) {
-        buffer[bytes_read] = '\0'; // null terminate string
+    if (head_req == 1) { // if HEAD, print headers to stdout
+        printf("%s", dec->header);
+        close(sockfd);
+        free(buffer);
+        free(dec);
+        return;
+    }
 
-        if (head_req == 1) { // if HEAD, print contents to stdout
-            printf("%s", buffer);
-        } else { // otherwise write contents to output file
+    if (resume_from > 0) {
+        long long start = -1;
+        long long total = -1;
+        if (dec->status == 206 && find_header(dec->header, "Content-Range", value, sizeof(value)) == 0) {
+            sscanf(value, "bytes %lld-", &start);
+        }
+        if (dec->status == 416 && find_header(dec->header, "Content-Range", value, sizeof(value)) == 0) {
+            sscanf(value, "bytes */%lld", &total);
+        }
 
-            if (resp_header == 0) {
-                char *end_header = strstr(buffer, "\r\n\r\n"); // check if buffer contains headers
-                if (end_header != NULL) {
-                    int offset = end_header - buffer + 4; // calculate offset relative to start of buffer and add 4 to account for "\r\n\r\n"
-                    //printf("%ld\n", end_header - buffer);
-                    fwrite(buffer + offset, 1, bytes_read - offset, output_file);
-                }
-                resp_header = 1;
-            } else {
-                fwrite(buffer, 1, bytes_read, output_file);
+        if (start == resume_from || total == resume_from) {
+            // the prefix is only read back when it's kept
+            if (sum->type != CHECKSUM_NONE && checksum_file(sum, resume_from) == -1) {
+                fprintf(stderr, "Error reading partial output file\n");
+                exit(1);
             }
+            offset = resume_from;
+        } else if (dec->status == 206 || dec->status == 416) {
+            fprintf(stderr, "Server didn't resume at byte %lld, remove %s to start over\n", resume_from, OUTPUT_FILE);
+            exit(1);
+        } else if (dec->status == 200) { // If-Range didn't match
+            fprintf(stderr, "%s changed on the server, starting over\n", path);
+        } else { // keep the partial download for a later -r
+            fprintf(stderr, "Server answered %d, %s kept for resuming\n", dec->status, OUTPUT_FILE);
+            exit(1);
+        }
+
+        // a file with a validator is only as long as what was received
+        // (see below), so a 416 at its length means nothing is missing
+        if (total == resume_from) {
+            unlink(VALIDATOR_FILE);
+            checksum_verify(sum);
+            close(sockfd);
+            free(buffer);
+            free(dec);
+            return;
+        }
+    }
+
+    // remember what the body belongs to until it's complete
+    int resumable = 0;
+    if (dec->status == 200 || dec->status == 206) {
+        response_validator(dec->header, validator, sizeof(validator));
+        FILE *file = validator[0] != '\0' ? fopen(VALIDATOR_FILE, "w") : NULL;
+        if (file != NULL) {
+            fprintf(file, "%s\n", validator);
+            fclose(file);
+            resumable = 1;
         }
     }
+    if (resumable == 0) { // a stale one would vouch for bytes never received
+        unlink(VALIDATOR_FILE);
+    }
 
-    if (head_req == 0) { // if GET, close output file
-        fclose(output_file);
+    // known length goes straight into a mapped file, the rest via writev;
+    // the mapped file is preallocated, so a body that may be resumed is
+    // written in order instead and the file never outgrows what was received
+    if (offset == 0 && resumable == 0 && dec->state == DECODE_BODY &&
+        receive_mapped(sockfd, buffer + used, bytes_read - used, dec->content_length, sum) == 0) {
+        unlink(VALIDATOR_FILE);
+        checksum_verify(sum);
+        close(sockfd);
+        free(buffer);
+        free(dec);
+        return;
     }
 
+    body_writer writer;
+    writer.iovcnt = 0;
+    writer.sum = sum;
+    writer.fd = open(OUTPUT_FILE, offset > 0 ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer.fd == -1 || lseek(writer.fd, offset, SEEK_SET) == -1) {
+        fprintf(stderr, "Error opening output file\n");
+        exit(1);
+    }
+
+    char *data = buffer + used; // body bytes that came in with the headers
+    size_t len = bytes_read - used;
+    while (dec->state != DECODE_DONE) {
+        if (len > 0 && (decoder_feed(dec, data, len, queue_body, &writer) == -1 || flush_body(&writer) == -1)) {
+            fprintf(stderr, "Error writing response body\n");
+            exit(1);
+        }
+        if (dec->state == DECODE_DONE) {
+            break;
+        }
+
+        bytes_read = recv(sockfd, buffer, RECV_BUFFER_SIZE, 0);
+        if (bytes_read <= 0) {
+            if (decoder_finish(dec) == -1) {
+                fprintf(stderr, "Connection closed before the full response was received\n");
+                exit(1);
+            }
+            break;
+        }
+        data = buffer;
+        len = bytes_read;
+    }
+
+    close(writer.fd);
+    unlink(VALIDATOR_FILE);
+    checksum_verify(sum);
     close(sockfd); // close socket
+    free(buffer);
+    free(dec);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 3 || argc > 4) {
-        fprintf(stderr, "Usage: %s <Hostname> <Server Address> [-h]\n", argv[0]);
+    int head_req = 0;
+    int segments = 1;
+    const char *list_file = NULL;
+    int connections = DEFAULT_CONNECTIONS;
+    int pipeline = 1;
+    int bench = 0;
+    int threads = DEFAULT_BENCH_THREADS;
+    int seconds = DEFAULT_BENCH_SECONDS;
+    int rate = 0;
+    int resume = 0;
+    char *digest = NULL;
+    int opt;
+    struct option long_options[] = {{"bench", no_argument, NULL, 'B'}, {0, 0, 0, 0}};
+
+    // -h for HEAD, -j N to download over N parallel connections,
+    // -b list to fetch a list of URLs over -c connections with -p requests
+    // pipelined on each, --bench to load test with -c connections on -t
+    // threads for -d seconds (at -R requests/s in total if given), -r to
+    // resume a partial download, -s crc32c|sha256[=hex] to checksum the body
+    while ((opt = getopt_long(argc, argv, "hj:b:c:p:t:d:R:rs:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'r':
+            resume = 1;
+            break;
+        case 's':
+            digest = optarg;
+            break;
+        case 'B':
+            bench = 1;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'R':
+            rate = atoi(optarg);
+            break;
+        case 'h':
+            head_req = 1;
+            break;
+        case 'j':
+            segments = atoi(optarg);
+            break;
+        case 'b':
+            list_file = optarg;
+            break;
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 'p':
+            pipeline = atoi(optarg);
+            break;
+        default:
+            argc = 0; // print usage
+            break;
+        }
+    }
+
+    if ((list_file == NULL && argc - optind != 2) || (list_file != NULL && argc - optind != 0)) {
+        fprintf(stderr, "Usage: %s <Hostname> <Server Address> [-h] [-j Connections] [-r] [-s crc32c|sha256[=Digest]]\n", argv[0]);
+        fprintf(stderr, "       %s -b <URL List File> [-c Connections] [-p Pipeline Depth]\n", argv[0]);
+        fprintf(stderr, "       %s --bench <Hostname> <Server Address> [-c Connections] [-t Threads] [-d Seconds] [-R Requests/s]\n", argv[0]);
+        exit(1);
+    }
+    if (threads < 1 || seconds < 1 || rate < 0) {
+        fprintf(stderr, "Threads and duration must be at least 1, rate at least 0\n");
+        exit(1);
+    }
+    if (segments < 1 || segments > MAX_SEGMENTS) {
+        fprintf(stderr, "Number of connections must be within: 1-%d\n", MAX_SEGMENTS);
+        exit(1);
+    }
+    if (connections < 1 || connections > MAX_CONNECTIONS) {
+        fprintf(stderr, "Number of connections must be within: 1-%d\n", MAX_CONNECTIONS);
+        exit(1);
+    }
+    if (pipeline < 1 || pipeline > MAX_PIPELINE) {
+        fprintf(stderr, "Pipeline depth must be within: 1-%d\n", MAX_PIPELINE);
         exit(1);
     }
 
-    const char *hostname = argv[1];
-    const char *serv_addr = argv[2];
-    int head_req;
+    // -s algorithm[=expected digest]
+    checksum sum;
+    checksum_init(&sum, CHECKSUM_NONE, NULL);
+    if (digest != NULL) {
+        char *expected = strchr(digest, '=');
+        if (expected != NULL) {
+            *expected++ = '\0';
+        }
+        if (strcmp(digest, "crc32c") == 0) {
+            checksum_init(&sum, CHECKSUM_CRC32C, expected);
+        } else if (strcmp(digest, "sha256") == 0) {
+            checksum_init(&sum, CHECKSUM_SHA256, expected);
+        } else {
+            fprintf(stderr, "Checksum must be crc32c or sha256\n");
+            exit(1);
+        }
+    }
+    // segments arrive out of order, so resuming and checksums need one stream
+    if (segments > 1 && (resume == 1 || digest != NULL)) {
+        fprintf(stderr, "-r and -s can't be combined with -j\n");
+        exit(1);
+    }
 
-    if (argc == 4 && strcmp(argv[3], "-h") == 0) {
-        head_req = 1;
-    } else {
-        head_req = 0;
+    if (list_file != NULL) {
+        batch_download(list_file, connections, pipeline);
+        return 0;
     }
 
+    const char *hostname = argv[optind];
+    const char *serv_addr = argv[optind + 1];
+
     // parse server address as IP, port, and path
     char *ip_address, *port, *path;
     parse_server_address(serv_addr, &ip_address, &port, &path);
@@ -171,7 +1826,19 @@ int main(int argc, char *argv[]) {
     printf("port: %s\n", port);
     printf("path: %s\n", path);
 
-    send_request(hostname, ip_address, port, path, head_req);
+    if (bench == 1) {
+        benchmark(hostname, ip_address, port, path, connections, threads, seconds, rate);
+        free(ip_address);
+        free(port);
+        free(path);
+        return 0;
+    }
+
+    // segmented download falls back to one stream if ranges aren't supported
+    if (head_req == 1 || segments == 1 || parallel_download(hostname, ip_address, port, path, segments) == -1) {
+        send_request(hostname, ip_address, port, path, head_req, resume, &sum);
+    }
+
     free(ip_address); // free dynamically allocated memory
     free(port);
     free(path);
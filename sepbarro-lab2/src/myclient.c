@@ -1,10 +1,65 @@
 #include <arpa/inet.h>
+#include <getopt.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#define MAX_WINDOW 65536
+#define MAX_ECHO_SIZE 4096 // the server's receive buffer, it truncates beyond
+#define RETRANSMIT_MS 1000 // resend timeout until RTTs have been measured
+#define MIN_RETRANSMIT_US 1000
+#define LOSS_TIMEOUT_MS 10000 // give up when nothing is echoed for this long
+#define RTT_BUCKETS 32 // log2 buckets of microseconds
+#define PROBE_MAGIC 0x70726f62
+#define PROBE_TIMEOUT_MS 1000 // a probe not echoed by then counts as lost
+#define PROBE_TX_WAIT_MS 10 // how long to wait for the transmit timestamp
+#define PROBE_INTERVAL_US 1000
+
+// prefix of every datagram in windowed mode, echoed back unchanged
+typedef struct {
+  uint32_t seq;
+  uint32_t len; // payload bytes after the header
+  uint64_t sent_ns;
+} packet_header;
+
+// latency probe, the server fills in its timestamps before echoing it
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t flags; // PROBE_SERVER_KERNEL if server_kernel_rx is set
+  uint32_t reserved;
+  uint64_t client_app_tx;
+  uint64_t server_kernel_rx;
+  uint64_t server_app_rx;
+  uint64_t server_app_tx;
+} probe_packet;
+
+enum { PROBE_SERVER_KERNEL = 1 };
+
+// one datagram of the window, kept until its echo arrives
+typedef struct {
+  char *data; // header followed by the payload
+  uint32_t seq;
+  size_t len;
+  uint64_t sent_ns;
+  int echoed;
+} window_slot;
+
+// round trip times, bucket i counts RTTs in [2^i, 2^(i+1)) microseconds
+typedef struct {
+  unsigned long long counts[RTT_BUCKETS];
+  unsigned long long total;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  double sum_ns;
+} rtt_histogram;
+
 void validport(int port) {
   if (0 <= port && port <= 1023) {
     fprintf(stderr, "Port number cannot be well-known: 0-1023\n");
@@ -110,30 +165,550 @@ void send_file(const char *server_ip, int server_port, int mtu,
   close(sockfd);
 }
 
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void rtt_record(rtt_histogram *hist, uint64_t rtt_ns) {
+  uint64_t us = rtt_ns / 1000;
+  int bucket = us == 0 ? 0 : 63 - __builtin_clzll(us);
+  if (bucket >= RTT_BUCKETS) {
+    bucket = RTT_BUCKETS - 1;
+  }
+  hist->counts[bucket]++;
+  if (hist->total == 0 || rtt_ns < hist->min_ns) {
+    hist->min_ns = rtt_ns;
+  }
+  if (rtt_ns > hist->max_ns) {
+    hist->max_ns = rtt_ns;
+  }
+  hist->total++;
+  hist->sum_ns += rtt_ns;
+}
+
+// upper edge of the bucket holding the given percentile, in microseconds
+unsigned long long rtt_percentile(const rtt_histogram *hist,
+                                  double percentile) {
+  unsigned long long target = hist->total * percentile / 100.0;
+  unsigned long long seen = 0;
+  for (int i = 0; i < RTT_BUCKETS; i++) {
+    seen += hist->counts[i];
+    if (seen > target) {
+      return 2ULL << i;
+    }
+  }
+  return 2ULL << (RTT_BUCKETS - 1);
+}
+
+void rtt_print(const char *label, const rtt_histogram *hist) {
+  if (hist->total == 0) {
+    return;
+  }
+  printf("%s min %.1f us, avg %.1f us, max %.1f us, p50 < %llu us, "
+         "p99 < %llu us over %llu datagrams\n",
+         label, hist->min_ns / 1000.0, hist->sum_ns / hist->total / 1000.0,
+         hist->max_ns / 1000.0, rtt_percentile(hist, 50),
+         rtt_percentile(hist, 99), hist->total);
+
+  unsigned long long most = 0;
+  for (int i = 0; i < RTT_BUCKETS; i++) {
+    if (hist->counts[i] > most) {
+      most = hist->counts[i];
+    }
+  }
+  for (int i = 0; i < RTT_BUCKETS; i++) {
+    if (hist->counts[i] == 0) {
+      continue;
+    }
+    int width = hist->counts[i] * 50 / most;
+    printf("%10llu - %-10llu us %10llu |%.*s\n", i == 0 ? 0 : 1ULL << i,
+           2ULL << i, hist->counts[i], width > 0 ? width : 1,
+           "##################################################");
+  }
+}
+
+void send_slot(int sockfd, struct sockaddr_in *server_addr, window_slot *slot) {
+  packet_header header;
+  slot->sent_ns = now_ns();
+  header.seq = slot->seq;
+  header.len = slot->len - sizeof(header);
+  header.sent_ns = slot->sent_ns;
+  memcpy(slot->data, &header, sizeof(header));
+
+  // a full socket buffer just delays the datagram until its retransmission
+  sendto(sockfd, slot->data, slot->len, MSG_DONTWAIT,
+         (struct sockaddr *)server_addr, sizeof(*server_addr));
+}
+
+// keep up to window datagrams in flight, each tagged with a sequence number
+// and send time, write echoes to outfile in order as the gaps close
+void send_file_windowed(const char *server_ip, int server_port, int mtu,
+                        const char *infile_path, const char *outfile_path,
+                        int window) {
+  size_t payload_size = mtu - sizeof(packet_header);
+  char *buffer = malloc(mtu);
+  window_slot *slots = calloc(window, sizeof(window_slot));
+  rtt_histogram hist;
+  memset(&hist, 0, sizeof(hist));
+  if (buffer == NULL || slots == NULL) {
+    fprintf(stderr, "Error allocating window\n");
+    exit(1);
+  }
+  for (int i = 0; i < window; i++) {
+    slots[i].data = malloc(mtu);
+    if (slots[i].data == NULL) {
+      fprintf(stderr, "Error allocating window\n");
+      exit(1);
+    }
+  }
+
+  FILE *infile = fopen(infile_path, "rb");
+  if (infile == NULL) {
+    fprintf(stderr, "Error opening input filepath\n");
+    exit(1);
+  }
+  FILE *outfile = fopen(outfile_path, "wb");
+  if (outfile == NULL) {
+    fprintf(stderr, "Error opening output filepath\n");
+    fclose(infile);
+    exit(1);
+  }
+  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sockfd == -1) {
+    fprintf(stderr, "Socket creation failed\n");
+    fclose(infile);
+    fclose(outfile);
+    exit(1);
+  }
+
+  // room for a whole window of echoes, or they're dropped while we send
+  int buffer_size = window * (mtu + 512);
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+  struct sockaddr_in server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = inet_addr(server_ip);
+  server_addr.sin_port = htons(server_port);
+
+  uint32_t base = 0; // oldest datagram not yet written to outfile
+  uint32_t next = 0; // next sequence number to read from infile
+  int eof = 0;
+  unsigned long long retransmits = 0;
+  uint64_t srtt_ns = 0, rttvar_ns = 0; // smoothed RTT and its variation
+  uint64_t rto_ns = RETRANSMIT_MS * 1000000ULL;
+  uint64_t start_ns = now_ns();
+  uint64_t last_echo_ns = start_ns;
+  size_t total_bytes = 0;
+
+  while (!eof || base != next) {
+    // fill the window from infile
+    while (!eof && next - base < (uint32_t)window) {
+      window_slot *slot = &slots[next % window];
+      size_t bytes_read =
+          fread(slot->data + sizeof(packet_header), 1, payload_size, infile);
+      if (bytes_read == 0) {
+        eof = 1;
+        break;
+      }
+      slot->seq = next++;
+      slot->len = sizeof(packet_header) + bytes_read;
+      slot->echoed = 0;
+      send_slot(sockfd, &server_addr, slot);
+    }
+    if (base == next) {
+      break;
+    }
+
+    // wait for echoes until the oldest datagram is due for retransmission
+    uint64_t current_ns = now_ns();
+    uint64_t due_ns = slots[base % window].sent_ns + rto_ns;
+    int wait_ms = due_ns > current_ns ? (due_ns - current_ns) / 1000000 + 1 : 0;
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    if (poll(&pfd, 1, wait_ms) > 0) {
+      ssize_t bytes_received;
+      while ((bytes_received = recv(sockfd, buffer, mtu, MSG_DONTWAIT)) >=
+             (ssize_t)sizeof(packet_header)) {
+        packet_header header;
+        memcpy(&header, buffer, sizeof(header));
+        current_ns = now_ns();
+
+        // echoes can arrive in any order, and duplicates after a resend
+        window_slot *slot = &slots[header.seq % window];
+        if (header.seq - base >= next - base || slot->seq != header.seq ||
+            slot->echoed || bytes_received != (ssize_t)slot->len) {
+          continue;
+        }
+        // the echoed send time belongs to this very transmission, so
+        // resent datagrams give valid samples too
+        uint64_t rtt_ns = current_ns - header.sent_ns;
+        rtt_record(&hist, rtt_ns);
+        if (srtt_ns == 0) {
+          srtt_ns = rtt_ns;
+          rttvar_ns = rtt_ns / 2;
+        } else {
+          uint64_t diff =
+              srtt_ns > rtt_ns ? srtt_ns - rtt_ns : rtt_ns - srtt_ns;
+          rttvar_ns = (3 * rttvar_ns + diff) / 4;
+          srtt_ns = (7 * srtt_ns + rtt_ns) / 8;
+        }
+        rto_ns = srtt_ns + 4 * rttvar_ns;
+        if (rto_ns < MIN_RETRANSMIT_US * 1000ULL) {
+          rto_ns = MIN_RETRANSMIT_US * 1000ULL;
+        }
+        memcpy(slot->data, buffer, bytes_received);
+        slot->echoed = 1;
+        last_echo_ns = current_ns; // only whole echoes count as progress
+      }
+    }
+
+    // write everything that is now contiguous
+    while (base != next && slots[base % window].echoed) {
+      window_slot *slot = &slots[base % window];
+      fwrite(slot->data + sizeof(packet_header), 1,
+             slot->len - sizeof(packet_header), outfile);
+      total_bytes += slot->len - sizeof(packet_header);
+      base++;
+    }
+
+    current_ns = now_ns();
+    if (current_ns - last_echo_ns >= LOSS_TIMEOUT_MS * 1000000ULL) {
+      fprintf(stderr, "Cannot detect server\n");
+      fclose(infile);
+      fclose(outfile);
+      close(sockfd);
+      exit(1);
+    }
+
+    // resend whatever has been outstanding too long
+    for (uint32_t seq = base; seq != next; seq++) {
+      window_slot *slot = &slots[seq % window];
+      if (!slot->echoed &&
+          current_ns - slot->sent_ns >= rto_ns) {
+        send_slot(sockfd, &server_addr, slot);
+        retransmits++;
+      }
+    }
+  }
+
+  double seconds = (now_ns() - start_ns) / 1e9;
+  printf("%zu bytes in %.3f s (%.1f Mbit/s), %llu retransmitted\n",
+         total_bytes, seconds, total_bytes * 8 / seconds / 1e6, retransmits);
+  rtt_print("RTT", &hist);
+
+  for (int i = 0; i < window; i++) {
+    free(slots[i].data);
+  }
+  free(slots);
+  free(buffer);
+  fclose(infile);
+  fclose(outfile);
+  close(sockfd);
+}
+
+// wall clock when the kernel timestamps too (they use it), otherwise the
+// monotonic clock
+uint64_t probe_clock(int kernel) {
+  struct timespec ts;
+  clock_gettime(kernel ? CLOCK_REALTIME : CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// software timestamp from a SCM_TIMESTAMPING control message, 0 if none
+uint64_t kernel_timestamp(struct msghdr *msg) {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      struct scm_timestamping stamps;
+      memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+      return stamps.ts[0].tv_sec * 1000000000ULL + stamps.ts[0].tv_nsec;
+    }
+  }
+  return 0;
+}
+
+// the kernel reports when a datagram left through the socket's error queue
+uint64_t tx_timestamp(int sockfd) {
+  char control[256];
+  struct msghdr msg;
+  struct pollfd pfd = {sockfd, 0, 0}; // POLLERR is always reported
+
+  if (poll(&pfd, 1, PROBE_TX_WAIT_MS) <= 0) {
+    return 0;
+  }
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(sockfd, &msg, MSG_ERRQUEUE) == -1) {
+    return 0;
+  }
+  return kernel_timestamp(&msg);
+}
+
+void latency_print(const char *label, const rtt_histogram *hist) {
+  if (hist->total > 0) {
+    printf("%-22s min %10.1f us, avg %10.1f us, max %10.1f us\n", label,
+           hist->min_ns / 1000.0, hist->sum_ns / hist->total / 1000.0,
+           hist->max_ns / 1000.0);
+  }
+}
+
+// send count probes one at a time, each stamped by the client and the
+// server on the way, and split the round trip into where the time went
+void probe_latency(const char *server_ip, int server_port, int size,
+                   const char *csv_path, int count) {
+  char *buffer = malloc(size);
+  rtt_histogram rtt_app, rtt_network, client_tx_stack, client_rx_stack,
+      server_rx_stack, server_app, one_way_out, one_way_back;
+  memset(&rtt_app, 0, sizeof(rtt_app));
+  rtt_network = client_tx_stack = client_rx_stack = server_rx_stack =
+      server_app = one_way_out = one_way_back = rtt_app;
+  if (buffer == NULL) {
+    fprintf(stderr, "Error allocating probe buffer\n");
+    exit(1);
+  }
+  memset(buffer, 0, size);
+
+  FILE *csv = fopen(csv_path, "w");
+  if (csv == NULL) {
+    fprintf(stderr, "Error opening CSV filepath\n");
+    exit(1);
+  }
+  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sockfd == -1) {
+    fprintf(stderr, "Socket creation failed\n");
+    fclose(csv);
+    exit(1);
+  }
+
+  // software timestamps when datagrams leave and arrive in the kernel
+  int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+              SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+  int kernel = setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                          sizeof(flags)) == 0;
+  if (!kernel) {
+    fprintf(stderr, "SO_TIMESTAMPING not supported, using CLOCK_MONOTONIC\n");
+  }
+
+  struct sockaddr_in server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = inet_addr(server_ip);
+  server_addr.sin_port = htons(server_port);
+
+  fprintf(csv, "seq,client_app_tx,client_kernel_tx,server_kernel_rx,"
+               "server_app_rx,server_app_tx,client_kernel_rx,client_app_rx,"
+               "rtt_app_ns,rtt_network_ns\n");
+
+  int lost = 0;
+  for (int seq = 0; seq < count; seq++) {
+    probe_packet probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.magic = PROBE_MAGIC;
+    probe.seq = seq;
+
+    // drop timestamps of earlier probes that never got read
+    char control[256];
+    struct msghdr msg;
+    do {
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+    } while (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0);
+
+    probe.client_app_tx = probe_clock(kernel);
+    memcpy(buffer, &probe, sizeof(probe));
+    if (sendto(sockfd, buffer, size, 0, (struct sockaddr *)&server_addr,
+               sizeof(server_addr)) == -1) {
+      fprintf(stderr, "sendto() failed\n");
+      exit(1);
+    }
+    uint64_t client_kernel_tx = kernel ? tx_timestamp(sockfd) : 0;
+
+    // wait for this probe's echo, late echoes of lost probes are skipped
+    probe_packet echo;
+    uint64_t client_kernel_rx = 0;
+    uint64_t client_app_rx = 0;
+    uint64_t deadline_ns = now_ns() + PROBE_TIMEOUT_MS * 1000000ULL;
+    while (client_app_rx == 0) {
+      uint64_t current_ns = now_ns();
+      struct pollfd pfd = {sockfd, POLLIN, 0};
+      if (current_ns >= deadline_ns ||
+          poll(&pfd, 1, (deadline_ns - current_ns) / 1000000 + 1) <= 0) {
+        break;
+      }
+      if (!(pfd.revents & POLLIN)) {
+        // only a late transmit timestamp, throw it away
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        continue;
+      }
+
+      struct iovec iov = {buffer, size};
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      ssize_t bytes_received = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+      uint64_t app_rx = probe_clock(kernel);
+      if (bytes_received < (ssize_t)sizeof(echo)) {
+        continue;
+      }
+      memcpy(&echo, buffer, sizeof(echo));
+      if (echo.magic == PROBE_MAGIC && echo.seq == (uint32_t)seq) {
+        client_kernel_rx = kernel_timestamp(&msg);
+        client_app_rx = app_rx;
+      }
+    }
+    if (client_app_rx == 0) {
+      lost++;
+      continue;
+    }
+
+    // the server only stamps probes if it runs with -t
+    int server = echo.server_app_tx != 0;
+    int both_kernel = client_kernel_tx != 0 && client_kernel_rx != 0 &&
+                      (echo.flags & PROBE_SERVER_KERNEL);
+    uint64_t app_ns = client_app_rx - probe.client_app_tx;
+    uint64_t network_ns = 0;
+    rtt_record(&rtt_app, app_ns);
+    if (both_kernel) {
+      // time on the wire and in the stacks, without the server's turnaround
+      network_ns = (client_kernel_rx - client_kernel_tx) -
+                   (echo.server_app_tx - echo.server_kernel_rx);
+      rtt_record(&rtt_network, network_ns);
+      rtt_record(&client_tx_stack, client_kernel_tx - probe.client_app_tx);
+      rtt_record(&client_rx_stack, client_app_rx - client_kernel_rx);
+      rtt_record(&server_rx_stack, echo.server_app_rx - echo.server_kernel_rx);
+      // only meaningful when both clocks are synchronized (or on loopback)
+      if (echo.server_kernel_rx > client_kernel_tx &&
+          client_kernel_rx > echo.server_app_tx) {
+        rtt_record(&one_way_out, echo.server_kernel_rx - client_kernel_tx);
+        rtt_record(&one_way_back, client_kernel_rx - echo.server_app_tx);
+      }
+    }
+    if (server) {
+      rtt_record(&server_app, echo.server_app_tx - echo.server_app_rx);
+    }
+
+    fprintf(csv, "%d,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n", seq,
+            (unsigned long long)probe.client_app_tx,
+            (unsigned long long)client_kernel_tx,
+            (unsigned long long)echo.server_kernel_rx,
+            (unsigned long long)echo.server_app_rx,
+            (unsigned long long)echo.server_app_tx,
+            (unsigned long long)client_kernel_rx,
+            (unsigned long long)client_app_rx, (unsigned long long)app_ns,
+            (unsigned long long)network_ns);
+
+    usleep(PROBE_INTERVAL_US);
+  }
+
+  printf("%d probes, %d lost, %s timestamps\n", count, lost,
+         rtt_network.total > 0 ? "kernel" : "application");
+  latency_print("client send stack", &client_tx_stack);
+  latency_print("client receive stack", &client_rx_stack);
+  latency_print("server receive stack", &server_rx_stack);
+  latency_print("server turnaround", &server_app);
+  latency_print("one way out", &one_way_out);
+  latency_print("one way back", &one_way_back);
+  rtt_print("RTT", &rtt_app);
+  rtt_print("Network RTT", &rtt_network);
+
+  fclose(csv);
+  close(sockfd);
+  free(buffer);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 6) {
+  int window = 0;
+  int probes = 0;
+  int opt;
+
+  // -w W to keep W datagrams in flight instead of waiting for every echo,
+  // -L N to measure latency with N timestamped probes instead of echoing
+  // a file
+  while ((opt = getopt(argc, argv, "w:L:")) != -1) {
+    switch (opt) {
+    case 'w':
+      window = atoi(optarg);
+      break;
+    case 'L':
+      probes = atoi(optarg);
+      if (probes < 1) {
+        fprintf(stderr, "Number of probes must be at least 1\n");
+        exit(1);
+      }
+      break;
+    default:
+      argc = 0; // print usage
+      break;
+    }
+  }
+
+  if (probes > 0 && argc - optind == 4) {
+    int server_port = atoi(argv[optind + 1]);
+    int size = atoi(argv[optind + 2]);
+    validport(server_port);
+    if (size < (int)sizeof(probe_packet)) {
+      fprintf(stderr, "Probe size must be at least %zu bytes\n",
+              sizeof(probe_packet));
+      exit(1);
+    }
+    probe_latency(argv[optind], server_port, size, argv[optind + 3], probes);
+    return 0;
+  }
+
+  if (probes > 0 || argc - optind != 5) {
     fprintf(stderr,
             "Usage: %s <Server IP> <Port Number> <MTU> <Infile Path> <Outfile "
-            "Path>\n",
+            "Path> [-w Window]\n",
+            argv[0]);
+    fprintf(stderr,
+            "       %s -L <Probes> <Server IP> <Port Number> <Probe Size> "
+            "<CSV Path>\n",
             argv[0]);
     exit(1);
   }
 
   // get CLI input
-  const char *server_ip = argv[1];
-  int server_port = atoi(argv[2]);
-  int mtu = atoi(argv[3]);
-  const char *infile_path = argv[4];
-  const char *outfile_path = argv[5];
+  const char *server_ip = argv[optind];
+  int server_port = atoi(argv[optind + 1]);
+  int mtu = atoi(argv[optind + 2]);
+  const char *infile_path = argv[optind + 3];
+  const char *outfile_path = argv[optind + 4];
 
   validport(server_port);
   if (mtu < 1) {
     fprintf(stderr, "MTU must at least be 1\n");
     exit(1);
   }
+  if (window < 0 || window > MAX_WINDOW) {
+    fprintf(stderr, "Window must be within: 1-%d\n", MAX_WINDOW);
+    exit(1);
+  }
+  if (window > 0 && mtu <= (int)sizeof(packet_header)) {
+    fprintf(stderr, "MTU must be larger than the %zu byte header\n",
+            sizeof(packet_header));
+    exit(1);
+  }
+  if (window > 0 && mtu > MAX_ECHO_SIZE) {
+    fprintf(stderr, "MTU must be at most %d with -w\n", MAX_ECHO_SIZE);
+    exit(1);
+  }
 
   // send file to server in packets
-  send_file(server_ip, server_port, mtu, infile_path, outfile_path);
+  if (window > 0) {
+    send_file_windowed(server_ip, server_port, mtu, infile_path, outfile_path,
+                       window);
+  } else {
+    send_file(server_ip, server_port, mtu, infile_path, outfile_path);
+  }
 
   return 0;
 }
@@ -1,10 +1,52 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <getopt.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BUFFER_SIZE 4096 // buffer size KiB
+#define MAX_BATCH 1024   // most datagrams one recvmmsg/sendmmsg can carry
+#define STATS_INTERVAL_MS 1000
+#define MAX_WORKERS 256
+#define PROBE_MAGIC 0x70726f62
+
+// latency probe from the client, stamped here before it is echoed
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t flags; // PROBE_SERVER_KERNEL if server_kernel_rx is set
+  uint32_t reserved;
+  uint64_t client_app_tx;
+  uint64_t server_kernel_rx;
+  uint64_t server_app_rx;
+  uint64_t server_app_tx;
+} probe_packet;
+
+enum { PROBE_SERVER_KERNEL = 1 };
+
+// one echo loop with its own socket, pinned to one CPU
+typedef struct {
+  int sockfd;
+  int batch; // 0 for one datagram per system call
+  int cpu;
+  pthread_t thread;
+  // batch mode counters, only written by the worker's own thread
+  unsigned long long rx_packets;
+  unsigned long long tx_packets;
+  unsigned long long rx_bytes;
+  unsigned long long drops;
+  unsigned long long calls;
+} __attribute__((aligned(64))) worker;
 
 void validport(int port) {
   if (0 <= port && port <= 1023) {
@@ -44,22 +86,229 @@ void handle_client(int sockfd, struct sockaddr_in *client_addr,
   }
 }
 
-int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <Port Number>\n", argv[0]);
+double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// wall clock when the kernel timestamps too (they use it), otherwise the
+// monotonic clock
+uint64_t probe_clock(int kernel) {
+  struct timespec ts;
+  clock_gettime(kernel ? CLOCK_REALTIME : CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// echo like handle_client, but stamp latency probes with when they reached
+// the kernel and the server and when the echo is sent
+void handle_probes(int sockfd) {
+  char buffer[BUFFER_SIZE];
+  char control[256];
+  struct sockaddr_in client_addr;
+
+  int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  int kernel = setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                          sizeof(flags)) == 0;
+  if (!kernel) {
+    fprintf(stderr, "SO_TIMESTAMPING not supported, using CLOCK_MONOTONIC\n");
+  }
+
+  while (1) {
+    struct iovec iov = {buffer, BUFFER_SIZE};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &client_addr;
+    msg.msg_namelen = sizeof(client_addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t bytes_received = recvmsg(sockfd, &msg, 0);
+    uint64_t app_rx = probe_clock(kernel);
+    if (bytes_received == -1) {
+      fprintf(stderr, "Receive failed\n");
+      continue;
+    }
+
+    probe_packet probe;
+    if (bytes_received >= (ssize_t)sizeof(probe)) {
+      memcpy(&probe, buffer, sizeof(probe));
+    }
+    if (bytes_received >= (ssize_t)sizeof(probe) &&
+        probe.magic == PROBE_MAGIC) {
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+           cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_TIMESTAMPING) {
+          struct scm_timestamping stamps;
+          memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+          probe.server_kernel_rx =
+              stamps.ts[0].tv_sec * 1000000000ULL + stamps.ts[0].tv_nsec;
+          probe.flags |= PROBE_SERVER_KERNEL;
+        }
+      }
+      probe.server_app_rx = app_rx;
+      probe.server_app_tx = probe_clock(kernel);
+      memcpy(buffer, &probe, sizeof(probe));
+    }
+
+    // echo bytes back to client
+    sendto(sockfd, buffer, bytes_received, 0, (struct sockaddr *)&client_addr,
+           msg.msg_namelen);
+  }
+}
+
+void count(unsigned long long *counter, unsigned long long n) {
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+unsigned long long take(unsigned long long *counter, unsigned long long *last) {
+  unsigned long long value = __atomic_load_n(counter, __ATOMIC_RELAXED);
+  unsigned long long delta = value - *last;
+  *last = value;
+  return delta;
+}
+
+// echo up to batch datagrams per recvmmsg with a single sendmmsg
+void handle_batch(worker *w) {
+  int batch = w->batch;
+  char *buffers = malloc((size_t)batch * BUFFER_SIZE);
+  struct mmsghdr *msgs = calloc(batch, sizeof(struct mmsghdr));
+  struct iovec *iovs = calloc(batch, sizeof(struct iovec));
+  struct sockaddr_in *addrs = calloc(batch, sizeof(struct sockaddr_in));
+  if (buffers == NULL || msgs == NULL || iovs == NULL || addrs == NULL) {
+    fprintf(stderr, "Error allocating batch buffers\n");
     exit(1);
   }
 
-  int port = atoi(argv[1]);
-  validport(port);
+  // every datagram keeps its own buffer and sender address, so the same
+  // headers are reused to echo it back
+  for (int i = 0; i < batch; i++) {
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+  }
+
+  while (1) {
+    for (int i = 0; i < batch; i++) {
+      iovs[i].iov_base = buffers + (size_t)i * BUFFER_SIZE;
+      iovs[i].iov_len = BUFFER_SIZE;
+      msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    // block for the first datagram, then take whatever else is queued
+    int received = recvmmsg(w->sockfd, msgs, batch, MSG_WAITFORONE, NULL);
+    if (received <= 0) {
+      continue;
+    }
+    unsigned long long bytes = 0;
+    for (int i = 0; i < received; i++) {
+      iovs[i].iov_len = msgs[i].msg_len; // echo exactly what came in
+      bytes += msgs[i].msg_len;
+    }
+
+    // sendmmsg can stop early, resend from where it stopped; it only fails
+    // on the first message, which is skipped as sendto would drop it
+    int sent = 0;
+    int failed = 0;
+    while (sent < received) {
+      int result = sendmmsg(w->sockfd, msgs + sent, received - sent, 0);
+      if (result <= 0) {
+        sent += 1; // echo is best effort, like sendto
+        failed += 1;
+        continue;
+      }
+      sent += result;
+    }
+
+    count(&w->calls, 1);
+    count(&w->rx_packets, received);
+    count(&w->rx_bytes, bytes);
+    count(&w->tx_packets, sent - failed);
+    count(&w->drops, failed);
+  }
+}
+
+void *worker_loop(void *arg) {
+  worker *w = (worker *)arg;
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(w->cpu, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+    fprintf(stderr, "Could not pin worker to CPU %d\n", w->cpu);
+  }
+
+  if (w->batch > 0) {
+    handle_batch(w);
+  }
+  while (1) {
+    struct sockaddr_in client_addr;
+    handle_client(w->sockfd, &client_addr, sizeof(client_addr));
+  }
+  return NULL;
+}
+
+// print packet rates summed over all workers every STATS_INTERVAL_MS
+void print_stats(worker *workers, int count_workers) {
+  unsigned long long last[MAX_WORKERS][5];
+  memset(last, 0, sizeof(last));
+  double last_ms = now_ms();
+
+  while (1) {
+    usleep(STATS_INTERVAL_MS * 1000);
+    double current_ms = now_ms();
+    double seconds = (current_ms - last_ms) / 1000.0;
+    last_ms = current_ms;
+
+    unsigned long long rx = 0, tx = 0, bytes = 0, drops = 0, calls = 0;
+    char per_worker[MAX_WORKERS * 24] = "";
+    size_t len = 0;
+    for (int i = 0; i < count_workers; i++) {
+      worker *w = &workers[i];
+      unsigned long long worker_rx = take(&w->rx_packets, &last[i][0]);
+      rx += worker_rx;
+      tx += take(&w->tx_packets, &last[i][1]);
+      bytes += take(&w->rx_bytes, &last[i][2]);
+      drops += take(&w->drops, &last[i][3]);
+      calls += take(&w->calls, &last[i][4]);
+      len += snprintf(per_worker + len, sizeof(per_worker) - len, " %.0f",
+                      worker_rx / seconds);
+    }
+    if (rx == 0) {
+      continue;
+    }
 
-  // create socket
+    printf("rx %.0f pkt/s, tx %.0f pkt/s, %.1f Mbit/s, %.1f pkt/batch, "
+           "%llu dropped",
+           rx / seconds, tx / seconds, bytes * 8 / seconds / 1e6,
+           (double)rx / calls, drops);
+    if (count_workers > 1) {
+      printf(", per worker:%s", per_worker);
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+}
+
+// every worker binds its own socket to the port, the kernel spreads flows
+// across them by hashing the addresses
+int create_socket(int port, int reuseport) {
   int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   if (sockfd == -1) {
     fprintf(stderr, "Socket creation failed\n");
     exit(1);
   }
 
+  int on = 1;
+  if (reuseport &&
+      setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+    fprintf(stderr, "SO_REUSEPORT not supported\n");
+    exit(1);
+  }
+
   // initialize server address structure & bind socket
   struct sockaddr_in server_addr;
   memset(&server_addr, 0, sizeof(server_addr));
@@ -73,15 +322,162 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
-  printf("Server listening on port: %d\n", port);
+  return sockfd;
+}
 
-  // receive packet and echo back to client
-  while (1) {
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    handle_client(sockfd, &client_addr, addr_len);
+// hand each datagram to the socket of the CPU that received it, so a flow
+// stays on the core (and in the cache) its packets arrive on
+void steer_by_cpu(worker *workers, int count_workers) {
+  // workers sit on the allowed CPUs, which needn't be 0..N-1, so look the
+  // CPU up in a jump table, CPUs without a worker are spread by modulo
+  int count = 2 * count_workers + 3;
+  struct sock_filter *code = malloc(count * sizeof(struct sock_filter));
+  if (code == NULL) {
+    fprintf(stderr, "Error allocating steering program\n");
+    exit(1);
+  }
+  code[0] = (struct sock_filter){BPF_LD | BPF_W | BPF_ABS, 0, 0,
+                                 SKF_AD_OFF + SKF_AD_CPU};
+  for (int i = 0; i < count_workers; i++) {
+    code[1 + 2 * i] =
+        (struct sock_filter){BPF_JMP | BPF_JEQ | BPF_K, 0, 1, workers[i].cpu};
+    code[2 + 2 * i] = (struct sock_filter){BPF_RET | BPF_K, 0, 0, i};
+  }
+  code[count - 2] =
+      (struct sock_filter){BPF_ALU | BPF_MOD | BPF_K, 0, 0, count_workers};
+  code[count - 1] = (struct sock_filter){BPF_RET | BPF_A, 0, 0, 0};
+  struct sock_fprog prog = {count, code};
+
+  // the program returns an index into the group, in the order the sockets
+  // were bound, which is also the order of the workers and their CPUs
+  if (setsockopt(workers[0].sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                 &prog, sizeof(prog)) == -1) {
+    fprintf(stderr, "Reuseport CPU steering not supported, falling back to "
+                    "SO_INCOMING_CPU\n");
+  }
+  for (int i = 0; i < count_workers; i++) {
+    setsockopt(workers[i].sockfd, SOL_SOCKET, SO_INCOMING_CPU,
+               &workers[i].cpu, sizeof(int));
+  }
+  free(code);
+}
+
+int main(int argc, char *argv[]) {
+  int batch = 0;
+  int count_workers = 1;
+  int steer = 0;
+  int timestamps = 0;
+  int opt;
+
+  // -b N to echo in batches of up to N datagrams per system call, -w N to
+  // run N workers on their own SO_REUSEPORT sockets, -s to keep each flow
+  // on the CPU it arrives on, -t to timestamp latency probes
+  while ((opt = getopt(argc, argv, "b:w:st")) != -1) {
+    switch (opt) {
+    case 't':
+      timestamps = 1;
+      break;
+    case 'b':
+      batch = atoi(optarg);
+      break;
+    case 'w':
+      count_workers = atoi(optarg);
+      break;
+    case 's':
+      steer = 1;
+      break;
+    default:
+      argc = 0; // print usage
+      break;
+    }
+  }
+
+  if (argc - optind != 1) {
+    fprintf(stderr,
+            "Usage: %s <Port Number> [-b Batch Size] [-w Workers] [-s] [-t]\n",
+            argv[0]);
+    exit(1);
+  }
+  if (batch < 0 || batch > MAX_BATCH) {
+    fprintf(stderr, "Batch size must be within: 1-%d\n", MAX_BATCH);
+    exit(1);
+  }
+  if (count_workers < 1 || count_workers > MAX_WORKERS) {
+    fprintf(stderr, "Number of workers must be within: 1-%d\n", MAX_WORKERS);
+    exit(1);
+  }
+
+  if (timestamps && (batch > 0 || count_workers > 1)) {
+    fprintf(stderr, "-t can't be combined with -b or -w\n");
+    exit(1);
+  }
+
+  int port = atoi(argv[optind]);
+  validport(port);
+
+  if (batch == 0 && count_workers == 1) {
+    int sockfd = create_socket(port, 0);
+    printf("Server listening on port: %d\n", port);
+
+    if (timestamps) {
+      fflush(stdout);
+      handle_probes(sockfd);
+    }
+
+    // receive packet and echo back to client
+    while (1) {
+      struct sockaddr_in client_addr;
+      socklen_t addr_len = sizeof(client_addr);
+      handle_client(sockfd, &client_addr, addr_len);
+    }
+
+    close(sockfd);
+    return 0;
+  }
+
+  // workers go round the CPUs this process may run on
+  cpu_set_t allowed;
+  int cpus[CPU_SETSIZE];
+  int count_cpus = 0;
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      cpus[count_cpus++] = cpu;
+    }
+  }
+
+  // a cache line per worker, so counter updates don't bounce between cores
+  worker *workers = aligned_alloc(64, count_workers * sizeof(worker));
+  if (workers == NULL) {
+    fprintf(stderr, "Error allocating workers\n");
+    exit(1);
+  }
+  memset(workers, 0, count_workers * sizeof(worker));
+  for (int i = 0; i < count_workers; i++) {
+    workers[i].sockfd = create_socket(port, count_workers > 1);
+    workers[i].batch = batch;
+    workers[i].cpu = cpus[i % count_cpus];
+  }
+  if (steer && count_workers > 1) {
+    steer_by_cpu(workers, count_workers);
+  }
+  for (int i = 0; i < count_workers; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) !=
+        0) {
+      fprintf(stderr, "Error creating worker thread\n");
+      exit(1);
+    }
+  }
+
+  printf("Server listening on port: %d (%d workers)\n", port, count_workers);
+  fflush(stdout);
+
+  if (batch > 0) {
+    print_stats(workers, count_workers);
+  }
+  for (int i = 0; i < count_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
   }
 
-  close(sockfd);
   return 0;
 }
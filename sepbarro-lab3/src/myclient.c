@@ -1,17 +1,115 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-#define RECV_TIMEOUT_SECONDS 10
-#define MAX_RETRANSMISSIONS 5
-#define RETRANSMISSION_TIMEOUT_SECONDS 10
-#define BUFFER_SIZE 1024
+#define MAX_RETRANSMISSIONS 5 // per packet, and then only
+#define GIVE_UP_US 10000000 // if nothing was acknowledged for this long
+#define RTO_INITIAL_US 1000000 // until the first RTT sample (RFC 6298)
+#define RTO_MIN_US 1000 // RFC 6298 says 1 s, far too long for a LAN
+#define RTO_MAX_US 60000000
+#define RTO_GRANULARITY_US 100 // clock granularity G of RFC 6298
+#define CC_INITIAL_WINDOW 10 // packets, as TCP's IW10 (RFC 6928)
+#define CC_MIN_WINDOW 2
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+#define PACE_GAIN_SLOW_START 2.0 // pacing rate over cwnd / srtt, as Linux
+#define PACE_GAIN 1.2
+#define PACE_BURST_US 1000 // tokens the bucket holds, in time at the rate
+#define PACE_MIN_BURST 2   // packets
+#define GSO_MAX_SEGMENTS 64 // most segments the kernel takes in one send
+#define GSO_MAX_BYTES 65000 // UDP payload limit, with room for headers
+#define PMTU_MIN 548  // UDP payload every IPv4 path carries (576 - 28)
+#define PMTU_MAX 8972 // UDP payload of a 9000 byte jumbo frame
+#define PMTU_PROBE_TRIES 3
+#define PMTU_PROBE_TIMEOUT_US 200000
+#define PMTU_REPROBE_RETRANSMISSIONS 3 // of a full size packet
+#define PMTU_REPROBE_FLOOR_PC 75       // percent of the MTU searched down to
+#define PMTU_REPROBE_TRIES 1
+
+// packet types
+#define FLAG_NAME 0x1 // seq 0, payload is the outfile path
+#define FLAG_DATA 0x2
+#define FLAG_FIN 0x4 // last seq, payload is the CRC32C of the whole file
+#define FLAG_ACK 0x8 // from the server, seq is the next one expected
+#define FLAG_MISMATCH 0x10 // on the ACK of FIN, the digest didn't match
+#define FLAG_PROBE 0x20 // MTU probe, seq is its size, echoed with FLAG_ACK
+#define MAX_SACK_BLOCKS 4 // runs of packets past the cumulative ACK
+
+// starts every packet in both directions, fields in network byte order
+typedef struct {
+  uint32_t session; // picked by the client for each transfer
+  uint32_t seq;
+  uint16_t flags;
+  uint16_t len; // payload bytes after the header
+  uint32_t crc; // CRC32C of header and payload, with this field 0
+} packet_header;
+
+// ACK payload, the receive window and then count {start, end} runs of
+// packets received beyond seq, end exclusive, in network byte order
+typedef struct {
+  uint32_t rwnd; // packets past seq the server will accept
+  uint32_t blocks[2 * MAX_SACK_BLOCKS];
+} ack_payload;
+
+// one packet of the send window, kept until it is acknowledged
+typedef struct {
+  char *data; // header followed by the payload, mtu bytes at most
+  size_t len;
+  uint32_t seq;
+  int acked;
+  int retransmissions;
+  uint64_t sent_us; // when it was last sent
+  uint64_t due_us;  // when it is retransmitted unless acknowledged
+} window_slot;
+
+// retransmission timeout from smoothed RTT samples, RFC 6298
+typedef struct {
+  uint64_t srtt_us;
+  uint64_t rttvar_us;
+  uint64_t rto_us;
+  int sampled; // srtt_us and rttvar_us hold a measurement
+} rto_estimator;
+
+// congestion window, in packets, never larger than winsz
+typedef struct {
+  double cwnd;
+  double ssthresh;   // slow start until cwnd reaches it
+  double w_max;      // cwnd before the last loss (CUBIC)
+  uint64_t epoch_us; // when the last loss happened (CUBIC)
+  size_t recovery;   // losses before this seq belong to the same event
+  int cap;           // winsz
+} cc_state;
+
+// a congestion control algorithm, picked with -c
+typedef struct {
+  const char *name;
+  void (*on_ack)(cc_state *cc, uint64_t now_us, uint64_t srtt_us);
+  void (*on_loss)(cc_state *cc, uint64_t now_us);
+} cc_algorithm;
+
+// token bucket pacing the sends, in bytes
+typedef struct {
+  double rate;       // bytes per second, 0 while not pacing
+  double tokens;     // negative after a send that took more than there were
+  uint64_t last_us;  // when tokens were last added
+  double fixed_rate; // from -r, 0 to follow cwnd / srtt
+} pacer;
 
 void validport(int port) {
   if (0 <= port && port <= 1023) {
@@ -39,15 +137,440 @@ char *timestamp() {
 }
 
 void log_packet(const char *type, int pktsn, size_t base, size_t nextsn,
-                int winsz) {
+                size_t window) {
   printf("%s, %s, %d, %zu, %zu, %zu\n", timestamp(), type, pktsn, base, nextsn,
-         base + winsz);
+         base + window);
 }
 
-void send_file(const char *server_ip, int server_port, int mtu, int winsz,
-               const char *infile_path, const char *outfile_path) {
-  char buffer[BUFFER_SIZE];
+uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void rto_init(rto_estimator *e) {
+  memset(e, 0, sizeof(*e));
+  e->rto_us = RTO_INITIAL_US;
+}
+
+// update SRTT and RTTVAR with a measured RTT and recompute the RTO, which
+// also undoes any backoff
+void rto_sample(rto_estimator *e, uint64_t rtt_us) {
+  if (!e->sampled) {
+    e->srtt_us = rtt_us;
+    e->rttvar_us = rtt_us / 2;
+    e->sampled = 1;
+  } else {
+    uint64_t diff =
+        e->srtt_us > rtt_us ? e->srtt_us - rtt_us : rtt_us - e->srtt_us;
+    e->rttvar_us = (3 * e->rttvar_us + diff) / 4;
+    e->srtt_us = (7 * e->srtt_us + rtt_us) / 8;
+  }
+
+  uint64_t variance = 4 * e->rttvar_us;
+  e->rto_us = e->srtt_us +
+              (variance > RTO_GRANULARITY_US ? variance : RTO_GRANULARITY_US);
+  if (e->rto_us < RTO_MIN_US) {
+    e->rto_us = RTO_MIN_US;
+  } else if (e->rto_us > RTO_MAX_US) {
+    e->rto_us = RTO_MAX_US;
+  }
+}
+
+// double the RTO after a timeout, until a new sample comes in
+void rto_backoff(rto_estimator *e) {
+  e->rto_us = e->rto_us * 2 > RTO_MAX_US ? RTO_MAX_US : e->rto_us * 2;
+}
+
+void cc_init(cc_state *cc, int cap) {
+  memset(cc, 0, sizeof(*cc));
+  cc->cwnd = CC_INITIAL_WINDOW < cap ? CC_INITIAL_WINDOW : cap;
+  cc->ssthresh = cap;
+  cc->cap = cap;
+}
+
+// packets that may be in flight right now
+size_t cc_window(cc_state *cc) {
+  return cc->cwnd < cc->cap ? (size_t)cc->cwnd : (size_t)cc->cap;
+}
+
+// slow start, then one packet more per window of ACKs
+void reno_on_ack(cc_state *cc, uint64_t now_us, uint64_t srtt_us) {
+  (void)now_us;
+  (void)srtt_us;
+  if (cc->cwnd < cc->ssthresh) {
+    cc->cwnd += 1;
+  } else {
+    cc->cwnd += 1 / cc->cwnd;
+  }
+}
+
+// halve the window
+void reno_on_loss(cc_state *cc, uint64_t now_us) {
+  (void)now_us;
+  cc->ssthresh = cc->cwnd / 2 > CC_MIN_WINDOW ? cc->cwnd / 2 : CC_MIN_WINDOW;
+  cc->cwnd = cc->ssthresh;
+}
+
+// slow start, then grow along the cubic W(t) = C (t - K)^3 + W_max
+// (RFC 8312), which is flat around the window of the last loss and
+// probes quickly away from it
+void cubic_on_ack(cc_state *cc, uint64_t now_us, uint64_t srtt_us) {
+  if (cc->cwnd < cc->ssthresh) {
+    cc->cwnd += 1;
+    return;
+  }
+  if (cc->epoch_us == 0) { // no loss yet, start from here
+    cc->epoch_us = now_us;
+    cc->w_max = cc->cwnd;
+  }
+
+  double t = (now_us - cc->epoch_us + srtt_us) / 1e6;
+  double k = cbrt(cc->w_max * (1 - CUBIC_BETA) / CUBIC_C);
+  double target = CUBIC_C * (t - k) * (t - k) * (t - k) + cc->w_max;
+  if (target > cc->cwnd) {
+    cc->cwnd += (target - cc->cwnd) / cc->cwnd;
+  } else {
+    cc->cwnd += 0.01 / cc->cwnd;
+  }
+}
+
+// shrink the window by beta and remember where the loss happened
+void cubic_on_loss(cc_state *cc, uint64_t now_us) {
+  cc->w_max = cc->cwnd;
+  cc->epoch_us = now_us;
+  cc->cwnd = cc->cwnd * CUBIC_BETA > CC_MIN_WINDOW ? cc->cwnd * CUBIC_BETA
+                                                   : CC_MIN_WINDOW;
+  cc->ssthresh = cc->cwnd;
+}
+
+cc_algorithm cc_algorithms[] = {
+    {"reno", reno_on_ack, reno_on_loss},
+    {"cubic", cubic_on_ack, cubic_on_loss},
+};
+
+cc_algorithm *cc_find(const char *name) {
+  for (size_t i = 0; i < sizeof(cc_algorithms) / sizeof(cc_algorithms[0]);
+       i++) {
+    if (strcmp(cc_algorithms[i].name, name) == 0) {
+      return &cc_algorithms[i];
+    }
+  }
+  return NULL;
+}
+
+// log the congestion window whenever it changes by a whole packet
+void log_cwnd(cc_state *cc, size_t *logged) {
+  size_t window = cc_window(cc);
+  if (window != *logged) {
+    printf("%s, CWND, %zu, %.0f\n", timestamp(), window, cc->ssthresh);
+    *logged = window;
+  }
+}
+
+// pace sends at gain * cwnd / srtt, or the rate given with -r, instead of
+// sending a whole window back to back, the bucket holds PACE_BURST_US
+// worth of tokens (at least PACE_MIN_BURST packets)
+void pace_update(pacer *p, cc_state *cc, rto_estimator *rto, int mtu,
+                 uint64_t now) {
+  if (p->fixed_rate > 0) {
+    p->rate = p->fixed_rate;
+  } else if (rto->sampled && rto->srtt_us > 0) {
+    double gain =
+        cc->cwnd < cc->ssthresh ? PACE_GAIN_SLOW_START : PACE_GAIN;
+    p->rate = gain * cc_window(cc) * mtu * 1e6 / rto->srtt_us;
+  } else {
+    p->rate = 0; // no RTT yet, the initial window goes out at once
+  }
+
+  double depth = p->rate * PACE_BURST_US / 1e6;
+  if (depth < PACE_MIN_BURST * mtu) {
+    depth = PACE_MIN_BURST * mtu;
+  }
+  if (p->rate == 0) {
+    p->tokens = depth;
+  } else {
+    p->tokens += (now - p->last_us) * p->rate / 1e6;
+    if (p->tokens > depth) {
+      p->tokens = depth;
+    }
+  }
+  p->last_us = now;
+}
+
+// take the tokens of a packet, the bucket may go into debt
+void pace_sent(pacer *p, size_t bytes) {
+  if (p->rate > 0) {
+    p->tokens -= bytes;
+  }
+}
+
+// when the bucket has tokens again
+uint64_t pace_next_us(pacer *p) {
+  if (p->tokens > 0 || p->rate == 0) {
+    return p->last_us;
+  }
+  return p->last_us + (uint64_t)(-p->tokens * 1e6 / p->rate) + 1;
+}
+
+// how many mtu sized datagrams one UDP GSO send can carry on this socket,
+// 1 if the kernel doesn't support UDP_SEGMENT
+int gso_segments(int sockfd, int mtu) {
+  int size = mtu;
+  if (setsockopt(sockfd, IPPROTO_UDP, UDP_SEGMENT, &size, sizeof(size)) ==
+      -1) {
+    return 1;
+  }
+  size = 0; // sizes are given per send, not for the socket
+  setsockopt(sockfd, IPPROTO_UDP, UDP_SEGMENT, &size, sizeof(size));
+
+  int segments = GSO_MAX_BYTES / mtu;
+  return segments > GSO_MAX_SEGMENTS ? GSO_MAX_SEGMENTS : segments;
+}
+
+// send count packets (all mtu bytes but the last), all in one system call
+// with UDP GSO while it works, one sendto per packet otherwise
+int send_segments(int sockfd, struct sockaddr_in *server_addr,
+                  struct iovec *iov, int count, int mtu, int *gso) {
+  if (*gso && count > 1) {
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_name = server_addr;
+    msg.msg_namelen = sizeof(*server_addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t segment_size = mtu;
+    memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+
+    ssize_t len = 0;
+    for (int i = 0; i < count; i++) {
+      len += iov[i].iov_len;
+    }
+    if (sendmsg(sockfd, &msg, 0) == len) {
+      return 0;
+    }
+    // e.g. the route has no checksum offload or a smaller MTU
+    fprintf(stderr, "UDP GSO send failed, sending one datagram at a time\n");
+    *gso = 0;
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (sendto(sockfd, iov[i].iov_base, iov[i].iov_len, 0,
+               (struct sockaddr *)server_addr, sizeof(*server_addr)) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// CRC32C (Castagnoli), reflected polynomial, as in iSCSI and ext4
+uint32_t crc32c_table[256];
+int crc32c_hw; // the CPU has SSE4.2
+
+void crc32c_init() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    }
+    crc32c_table[i] = crc;
+  }
+#if defined(__x86_64__)
+  crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+// 8 bytes per crc32 instruction, the odd bytes at the end one at a time
+__attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *data, size_t len) {
+  uint64_t crc64 = crc;
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = crc64;
+  for (; len > 0; data++, len--) {
+    crc = _mm_crc32_u8(crc, *data);
+  }
+  return crc;
+}
+#endif
+
+// continue the CRC32C crc (0 to start) over len more bytes
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+  const uint8_t *bytes = data;
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (crc32c_hw) {
+    return ~crc32c_sse42(crc, bytes, len);
+  }
+#endif
+  for (size_t i = 0; i < len; i++) {
+    crc = crc32c_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// CRC32C of a packet with its crc field 0, header in network byte order
+uint32_t packet_crc(const packet_header *header, const void *payload,
+                    size_t len) {
+  packet_header zeroed = *header;
+  zeroed.crc = 0;
+  return crc32c(crc32c(0, &zeroed, sizeof(zeroed)), payload, len);
+}
+
+// send a probe of size bytes and wait for the server to echo it, up to
+// tries times for timeout_us each, 1 if it got through. ACKs of the
+// transfer read meanwhile are dropped, but like the echo they show that
+// the server is there, alive_us (unless NULL) is set when one arrives
+int pmtu_probe(int sockfd, struct sockaddr_in *server_addr, uint32_t session,
+               char *probe, size_t size, int tries, uint64_t timeout_us,
+               uint64_t *alive_us) {
+  packet_header header;
+  size_t len = size - sizeof(header);
+  header.session = htonl(session);
+  header.seq = htonl(size);
+  header.flags = htons(FLAG_PROBE);
+  header.len = htons(len);
+  memset(probe + sizeof(header), 0, len);
+  header.crc = htonl(packet_crc(&header, probe + sizeof(header), len));
+  memcpy(probe, &header, sizeof(header));
+
+  for (int try = 0; try < tries; try++) {
+    if (sendto(sockfd, probe, size, 0, (struct sockaddr *)server_addr,
+               sizeof(*server_addr)) == -1) {
+      return 0; // EMSGSIZE, larger than the route's MTU
+    }
+    uint64_t deadline_us = now_us() + timeout_us;
+    uint64_t current_us;
+    while ((current_us = now_us()) < deadline_us) {
+      struct pollfd pfd = {sockfd, POLLIN, 0};
+      int timeout_ms = (deadline_us - current_us + 999) / 1000;
+      if (poll(&pfd, 1, timeout_ms) <= 0) {
+        break;
+      }
+      char reply[sizeof(packet_header) + sizeof(ack_payload)];
+      packet_header header;
+      ssize_t bytes_received = recv(sockfd, reply, sizeof(reply), MSG_DONTWAIT);
+      if (bytes_received < (ssize_t)sizeof(header)) {
+        continue;
+      }
+      memcpy(&header, reply, sizeof(header));
+      size_t len = ntohs(header.len);
+      if (ntohl(header.session) != session ||
+          !(ntohs(header.flags) & FLAG_ACK) ||
+          len > bytes_received - sizeof(header) ||
+          ntohl(header.crc) !=
+              packet_crc(&header, reply + sizeof(header), len)) {
+        continue; // stale, for an earlier transfer or corrupt
+      }
+      if (alive_us != NULL) {
+        *alive_us = now_us();
+      }
+      if (ntohs(header.flags) == (FLAG_PROBE | FLAG_ACK) &&
+          ntohl(header.seq) == size && len == 0) {
+        return 1;
+      } // anything else is an ACK of the transfer, later ones cover it
+    }
+  }
+  return 0;
+}
+
+// binary search for the largest datagram that reaches the server, from lo,
+// which is taken to get through, up to hi, probing as pmtu_probe does
+int pmtu_discover(int sockfd, struct sockaddr_in *server_addr,
+                  uint32_t session, int lo, int hi, int tries,
+                  uint64_t timeout_us, uint64_t *alive_us) {
+  // DF set, and sends larger than the route's MTU fail instead of being
+  // fragmented, whatever the kernel thinks the path MTU is
+  int mode = IP_PMTUDISC_PROBE;
+  setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+
+  char *probe = malloc(hi);
+  if (probe == NULL) {
+    fprintf(stderr, "Error allocating MTU probe\n");
+    exit(1);
+  }
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (pmtu_probe(sockfd, server_addr, session, probe, mid, tries,
+                   timeout_us, alive_us)) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  free(probe);
+  return lo;
+}
+
+// fill in the header of a window slot and the payload length
+void prepare_slot(window_slot *slot, uint32_t session, uint32_t seq,
+                  uint16_t flags, size_t payload_len) {
+  packet_header header;
+  header.session = htonl(session);
+  header.seq = htonl(seq);
+  header.flags = htons(flags);
+  header.len = htons(payload_len);
+  header.crc = htonl(
+      packet_crc(&header, slot->data + sizeof(header), payload_len));
+  memcpy(slot->data, &header, sizeof(header));
+
+  slot->len = sizeof(header) + payload_len;
+  slot->seq = seq;
+  slot->acked = 0;
+  slot->retransmissions = 0;
+}
+
+// mark packets from..to-1 of the window acknowledged, returns how many
+// weren't before, and keeps the latest send time of those that were sent
+// just once (Karn: an ACK of a resent packet may be for either send)
+int ack_range(window_slot *slots, int winsz, size_t from, size_t to,
+              uint64_t *sample_sent_us) {
+  int count = 0;
+  for (size_t seq = from; seq < to; seq++) {
+    window_slot *slot = &slots[seq % winsz];
+    if (slot->acked) {
+      continue;
+    }
+    slot->acked = 1;
+    count++;
+    if (slot->retransmissions == 0 && slot->sent_us > *sample_sent_us) {
+      *sample_sent_us = slot->sent_us;
+    }
+  }
+  return count;
+}
 
+// arm timerfd to fire at the earliest retransmission deadline, which is
+// on the same monotonic clock as now_us()
+void arm_timer(int timerfd, uint64_t due_us) {
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if (due_us != UINT64_MAX) {
+    its.it_value.tv_sec = due_us / 1000000;
+    its.it_value.tv_nsec = (due_us % 1000000) * 1000;
+  }
+  timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// selective repeat: up to cwnd packets in flight, each acknowledged and
+// retransmitted on its own, the server puts them back in order, mtu 0 to
+// discover it, rate 0 to pace by cwnd / srtt
+void send_file(const char *server_ip, int server_port, int mtu, int winsz,
+               const char *infile_path, const char *outfile_path, int use_gso,
+               cc_algorithm *algorithm, double rate) {
   // open infile in read bytes mode
   FILE *infile = fopen(infile_path, "rb");
   if (infile == NULL) {
@@ -55,13 +578,6 @@ void send_file(const char *server_ip, int server_port, int mtu, int winsz,
     exit(1);
   }
 
-  // truncate outfile before server appends to it
-  if (truncate(outfile_path, 0) == -1) {
-    fprintf(stderr, "Error truncating output file\n");
-    fclose(infile);
-    exit(1);
-  }
-
   // create socket file descriptor
   int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   if (sockfd == -1) {
@@ -77,99 +593,302 @@ void send_file(const char *server_ip, int server_port, int mtu, int winsz,
   server_addr.sin_addr.s_addr = inet_addr(server_ip);
   server_addr.sin_port = htons(server_port);
 
-  // first packet sent contains outfile path
-  ssize_t bytes_sent =
-      sendto(sockfd, outfile_path, strlen(outfile_path) + 1, 0,
-             (struct sockaddr *)&server_addr, sizeof(server_addr));
-  if (bytes_sent == -1) {
-    fprintf(stderr, "sendto() failed\n");
+  // clients started back to back must not share an id, so not from rand()
+  uint32_t session;
+  if (getrandom(&session, sizeof(session), 0) != sizeof(session)) {
+    fprintf(stderr, "getrandom() failed\n");
     fclose(infile);
     close(sockfd);
     exit(1);
   }
 
-  // printf("Sent outfile_path: %s\n", outfile_path); // debug message
+  // without an MTU given, use the largest packet the path carries
+  int pmtu_auto = mtu == 0;
+  int fragmenting = 0; // the path shrank, the kernel fragments packets
+  if (pmtu_auto) {
+    mtu = pmtu_discover(sockfd, &server_addr, session, PMTU_MIN, PMTU_MAX,
+                        PMTU_PROBE_TRIES, PMTU_PROBE_TIMEOUT_US, NULL);
+    printf("%s, PMTU, %d\n", timestamp(), mtu);
+  }
+  size_t payload_size = mtu - sizeof(packet_header);
 
-  size_t base = 0;
-  size_t nextsn = 0;
-  int retransmissions = 0;
+  // with GSO, new packets of the window go out together in one send
+  int gso = 0;
+  int max_segments = 1;
+  if (use_gso) {
+    max_segments = gso_segments(sockfd, mtu);
+    gso = max_segments > 1;
+    if (!gso) {
+      fprintf(stderr, "UDP GSO not supported, sending one datagram at a "
+                      "time\n");
+    }
+  }
 
-  while (1) {
-    for (size_t i = base; i < base + winsz; i++) {
-      size_t bytes_read =
-          fread(buffer, 1, mtu, infile); // read packets up to size mtu
-      if (bytes_read == 0) {
-        break;
+  // retransmission deadlines fire on a timerfd, with sub-millisecond
+  // resolution
+  int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (timerfd == -1) {
+    fprintf(stderr, "timerfd_create() failed\n");
+    fclose(infile);
+    close(sockfd);
+    exit(1);
+  }
+  rto_estimator rto;
+  rto_init(&rto);
+  cc_state cc;
+  cc_init(&cc, winsz);
+  size_t logged_window = 0;
+  uint64_t last_ack_us = now_us(); // a short stall mustn't end the transfer
+  log_cwnd(&cc, &logged_window);
+  pacer pacer;
+  memset(&pacer, 0, sizeof(pacer));
+  pacer.fixed_rate = rate;
+
+  window_slot *slots = calloc(winsz, sizeof(window_slot));
+  struct iovec *burst = calloc(max_segments, sizeof(struct iovec));
+  char *ack = malloc(sizeof(packet_header) + sizeof(ack_payload));
+  if (slots == NULL || burst == NULL || ack == NULL) {
+    fprintf(stderr, "Error allocating send window\n");
+    exit(1);
+  }
+  for (int i = 0; i < winsz; i++) {
+    slots[i].data = malloc(mtu);
+    if (slots[i].data == NULL) {
+      fprintf(stderr, "Error allocating send window\n");
+      exit(1);
+    }
+  }
+
+  size_t base = 0;   // oldest packet not yet acknowledged
+  size_t nextsn = 0; // next packet to send
+  size_t rwnd_end = SIZE_MAX; // first packet past the server's window
+  size_t cumulative = 0;      // highest cumulative ACK so far
+  uint32_t digest = 0;        // CRC32C of the infile read so far
+  int fin_sent = 0;
+
+  // the first packet carries the outfile path, the last one is FIN
+  while (!fin_sent || base < nextsn) {
+    int count = 0;
+    pace_update(&pacer, &cc, &rto, mtu, now_us());
+    // a packet at a time while the server's window is closed, to learn
+    // when it opens
+    while (!fin_sent && nextsn < base + cc_window(&cc) &&
+           (nextsn < rwnd_end || base == nextsn) && pacer.tokens > 0) {
+      window_slot *slot = &slots[nextsn % winsz];
+      if (nextsn == 0) {
+        size_t name_len = strlen(outfile_path) + 1;
+        memcpy(slot->data + sizeof(packet_header), outfile_path, name_len);
+        prepare_slot(slot, session, nextsn, FLAG_NAME, name_len);
+      } else {
+        size_t bytes_read = fread(slot->data + sizeof(packet_header), 1,
+                                  payload_size, infile);
+        if (bytes_read == 0) {
+          // the server checks its copy against the digest in FIN
+          uint32_t fin_digest = htonl(digest);
+          memcpy(slot->data + sizeof(packet_header), &fin_digest,
+                 sizeof(fin_digest));
+          prepare_slot(slot, session, nextsn, FLAG_FIN, sizeof(fin_digest));
+          fin_sent = 1;
+        } else {
+          digest = crc32c(digest, slot->data + sizeof(packet_header),
+                          bytes_read);
+          prepare_slot(slot, session, nextsn, FLAG_DATA, bytes_read);
+        }
       }
 
-      // send packet to server
-      ssize_t bytes_sent =
-          sendto(sockfd, buffer, bytes_read, 0, (struct sockaddr *)&server_addr,
-                 sizeof(server_addr));
-      if (bytes_sent == -1) {
+      burst[count].iov_base = slot->data;
+      burst[count].iov_len = slot->len;
+      count++;
+      pace_sent(&pacer, slot->len);
+      slot->sent_us = now_us();
+      slot->due_us = slot->sent_us + rto.rto_us;
+      // log DATA packet
+      log_packet("DATA", nextsn, base, nextsn, cc_window(&cc));
+      nextsn++;
+
+      // only the last packet of a GSO send may be short
+      if (count == max_segments || slot->len < (size_t)mtu) {
+        break;
+      }
+    }
+    if (count > 0) {
+      if (send_segments(sockfd, &server_addr, burst, count, mtu, &gso) ==
+          -1) {
         fprintf(stderr, "sendto() failed\n");
         fclose(infile);
         close(sockfd);
         exit(1);
       }
+      if (!fin_sent && nextsn < base + cc_window(&cc) && nextsn < rwnd_end &&
+          pacer.tokens > 0) {
+        continue; // keep filling the window
+      }
+    }
 
-      // printf("%s, Sent DATA packet %zu\n", timestamp(), nextsn); // debug
-      // message
-      log_packet("DATA", nextsn, base, nextsn, winsz); // log DATA packet
-
-      nextsn++;
+    // wait for ACKs until the earliest unacknowledged packet times out, or
+    // the pacer lets the next one go
+    uint64_t deadline_us = UINT64_MAX;
+    for (size_t seq = base; seq < nextsn; seq++) {
+      window_slot *slot = &slots[seq % winsz];
+      if (!slot->acked && slot->due_us < deadline_us) {
+        deadline_us = slot->due_us;
+      }
+    }
+    if (!fin_sent && nextsn < base + cc_window(&cc) &&
+        (nextsn < rwnd_end || base == nextsn) &&
+        pace_next_us(&pacer) < deadline_us) {
+      deadline_us = pace_next_us(&pacer);
+    }
+    arm_timer(timerfd, deadline_us);
+    struct pollfd pfds[2] = {{sockfd, POLLIN, 0}, {timerfd, POLLIN, 0}};
+    if (poll(pfds, 2, -1) == -1) {
+      fprintf(stderr, "poll() failed\n");
+      fclose(infile);
+      close(sockfd);
+      exit(1);
+    }
+    uint64_t expirations;
+    if (pfds[1].revents & POLLIN) {
+      read(timerfd, &expirations, sizeof(expirations));
+    }
 
-      // wait for ACK
-      struct timeval timeout;
-      timeout.tv_sec = RETRANSMISSION_TIMEOUT_SECONDS;
-      timeout.tv_usec = 0;
-      fd_set readfds;
-      FD_ZERO(&readfds);        // clear set of file descriptors
-      FD_SET(sockfd, &readfds); // add sockfd to file descriptor set
-
-      int select_result = select(sockfd + 1, &readfds, NULL, NULL, &timeout);
-      if (select_result == -1) {
-        fprintf(stderr, "select() failed\n");
+    // ACKs are cumulative, runs of packets past the cumulative one come as
+    // SACK blocks
+    ssize_t bytes_received;
+    while ((bytes_received = recv(sockfd, ack,
+                                  sizeof(packet_header) + sizeof(ack_payload),
+                                  MSG_DONTWAIT)) >=
+           (ssize_t)sizeof(packet_header)) {
+      packet_header header;
+      ack_payload payload;
+      memcpy(&header, ack, sizeof(header));
+      uint32_t ack_sn = ntohl(header.seq);
+      size_t len = ntohs(header.len);
+      if (ntohl(header.session) != session ||
+          !(ntohs(header.flags) & FLAG_ACK) || ack_sn > nextsn ||
+          len < sizeof(payload.rwnd) || len > sizeof(payload) ||
+          (size_t)bytes_received < sizeof(header) + len ||
+          ntohl(header.crc) !=
+              packet_crc(&header, ack + sizeof(header), len)) {
+        continue; // stale, for an earlier transfer or corrupt
+      }
+      memcpy(&payload, ack + sizeof(header), len);
+      if (ntohs(header.flags) & FLAG_MISMATCH) {
+        fprintf(stderr, "Outfile on the server doesn't match the infile\n");
         fclose(infile);
         close(sockfd);
         exit(1);
-      } else if (select_result == 0) { // timeout occurred
-        fprintf(stderr, "%s, Packet loss detected.\n", timestamp());
-        fseek(infile, i,
-              SEEK_SET); // move pointer back to retransmit packet content
-        retransmissions++;
-      } else { // ACK received check if matches packet
-        int ack_sn;
-        ssize_t bytes_received = recv(sockfd, &ack_sn, sizeof(ack_sn), 0);
-        if (bytes_received == -1) {
-          fprintf(stderr, "recv() failed");
-          fclose(infile);
-          close(sockfd);
-          exit(1);
-        }
+      }
 
-        // printf("%s, Received ACK: %d\n", timestamp(), ack_sn); // debug
-        // message
-        log_packet("ACK", ack_sn, base, nextsn, winsz); // log ACK packet
+      last_ack_us = now_us();
+      log_packet("ACK", ack_sn, base, nextsn, cc_window(&cc)); // log ACK packet
+      if (ack_sn >= cumulative) { // ACKs can be reordered too
+        cumulative = ack_sn;
+        rwnd_end = ack_sn + ntohl(payload.rwnd);
+      }
+      uint64_t sample_sent_us = 0;
+      int acked = 0;
+      if (ack_sn > base) {
+        acked += ack_range(slots, winsz, base, ack_sn, &sample_sent_us);
+      }
+      int count = (len - sizeof(payload.rwnd)) / (2 * sizeof(uint32_t));
+      for (int i = 0; i < count; i++) {
+        size_t start = ntohl(payload.blocks[2 * i]);
+        size_t end = ntohl(payload.blocks[2 * i + 1]);
+        acked += ack_range(slots, winsz, start > base ? start : base,
+                           end < nextsn ? end : nextsn, &sample_sent_us);
+      }
 
-        if (ack_sn == (int)i) { // ACK matches current packet
-          base++;
-        }
+      if (sample_sent_us != 0) {
+        rto_sample(&rto, now_us() - sample_sent_us);
       }
+      for (int i = 0; i < acked; i++) {
+        algorithm->on_ack(&cc, now_us(), rto.srtt_us);
+      }
+      if (cc.cwnd > winsz) {
+        cc.cwnd = winsz; // don't build up credit past the cap
+      }
+    }
+    log_cwnd(&cc, &logged_window);
 
-      if (retransmissions >= MAX_RETRANSMISSIONS) {
+    // slide the window past everything acknowledged
+    while (base < nextsn && slots[base % winsz].acked) {
+      base++;
+    }
+
+    // retransmit only the packets that timed out, backing off the RTO
+    // once for each time the timer fires
+    uint64_t current_us = now_us();
+    int backed_off = 0;
+    for (size_t seq = base; seq < nextsn; seq++) {
+      window_slot *slot = &slots[seq % winsz];
+      if (slot->acked || current_us < slot->due_us) {
+        continue;
+      }
+      if (!backed_off) {
+        rto_backoff(&rto);
+        backed_off = 1;
+      }
+      // one window reduction per loss event, not per lost packet
+      if (seq >= cc.recovery) {
+        algorithm->on_loss(&cc, current_us);
+        cc.recovery = nextsn;
+        log_cwnd(&cc, &logged_window);
+      }
+      if (++slot->retransmissions > MAX_RETRANSMISSIONS &&
+          current_us - last_ack_us >= GIVE_UP_US) {
         fprintf(stderr, "Reached max re-transmission limit\n");
         fclose(infile);
         close(sockfd);
         exit(1);
       }
-    }
 
-    if (feof(infile)) {
-      break;
+      // a full size packet lost again and again may no longer fit a path
+      // that changed, packets of this size are already in the window, so
+      // if so the kernel fragments them from now on. The transfer waits
+      // meanwhile, so sizes just below the MTU are tried, once each for an
+      // RTO, and any smaller path is left to fragmenting
+      if (pmtu_auto && !fragmenting &&
+          slot->retransmissions == PMTU_REPROBE_RETRANSMISSIONS &&
+          slot->len == (size_t)mtu) {
+        int floor = mtu * PMTU_REPROBE_FLOOR_PC / 100;
+        int pmtu = pmtu_discover(
+            sockfd, &server_addr, session, floor > PMTU_MIN ? floor : PMTU_MIN,
+            mtu, PMTU_REPROBE_TRIES,
+            rto.rto_us < PMTU_PROBE_TIMEOUT_US ? rto.rto_us
+                                               : PMTU_PROBE_TIMEOUT_US,
+            &last_ack_us);
+        printf("%s, PMTU, %d\n", timestamp(), pmtu);
+        if (pmtu < mtu) {
+          int mode = IP_PMTUDISC_DONT;
+          setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+          fragmenting = 1;
+        }
+        current_us = now_us();
+      }
+
+      fprintf(stderr, "%s, Packet loss detected.\n", timestamp());
+      if (sendto(sockfd, slot->data, slot->len, 0,
+                 (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        fprintf(stderr, "sendto() failed\n");
+        fclose(infile);
+        close(sockfd);
+        exit(1);
+      }
+      slot->sent_us = current_us;
+      slot->due_us = current_us + rto.rto_us;
+      pace_sent(&pacer, slot->len);
+      log_packet("DATA", seq, base, nextsn, cc_window(&cc)); // log DATA packet
     }
   }
 
+  for (int i = 0; i < winsz; i++) {
+    free(slots[i].data);
+  }
+  free(slots);
+  free(burst);
+  free(ack);
+  close(timerfd);
   fclose(infile);
   close(sockfd);
 
@@ -177,24 +896,67 @@ void send_file(const char *server_ip, int server_port, int mtu, int winsz,
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 7) {
+  int use_gso = 0;
+  cc_algorithm *algorithm = &cc_algorithms[0];
+  double rate = 0;
+  int opt;
+
+  // -g to hand packets of the window to the kernel in one UDP GSO send,
+  // -c to pick the congestion control algorithm, -r to pace at a fixed rate
+  while ((opt = getopt(argc, argv, "gc:r:")) != -1) {
+    switch (opt) {
+    case 'g':
+      use_gso = 1;
+      break;
+    case 'c':
+      algorithm = cc_find(optarg);
+      if (algorithm == NULL) {
+        fprintf(stderr, "Unknown congestion control: %s (reno, cubic)\n",
+                optarg);
+        exit(1);
+      }
+      break;
+    case 'r':
+      rate = atof(optarg) * 1e6 / 8; // Mbit/s to bytes per second
+      if (rate <= 0) {
+        fprintf(stderr, "Invalid pacing rate: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    default:
+      argc = 0; // print usage
+      break;
+    }
+  }
+
+  if (argc - optind != 6) {
     fprintf(stderr,
-            "Usage: %s <Server IP> <Server Port> <MTU> <Window Size> <Infile "
-            "Path> <Outfile Path>\n",
+            "Usage: %s <Server IP> <Server Port> <MTU|auto> <Window Size> "
+            "<Infile Path> <Outfile Path> [-g] [-c reno|cubic] "
+            "[-r Mbit/s]\n",
             argv[0]);
     exit(1);
   }
 
-  const char *server_ip = argv[1];
-  int server_port = atoi(argv[2]);
-  int mtu = atoi(argv[3]);
-  int winsz = atoi(argv[4]);
-  const char *infile_path = argv[5];
-  const char *outfile_path = argv[6];
+  const char *server_ip = argv[optind];
+  int server_port = atoi(argv[optind + 1]);
+  const char *mtu_arg = argv[optind + 2];
+  int mtu = strcmp(mtu_arg, "auto") == 0 ? 0 : atoi(mtu_arg);
+  int winsz = atoi(argv[optind + 3]);
+  const char *infile_path = argv[optind + 4];
+  const char *outfile_path = argv[optind + 5];
 
   validport(server_port);
-  if (mtu < 1) {
-    fprintf(stderr, "MTU must be at least 1\n");
+  // FIN carries a 4 byte digest
+  if (mtu != 0 && (mtu < (int)(sizeof(packet_header) + sizeof(uint32_t)) ||
+                   mtu > GSO_MAX_BYTES)) {
+    fprintf(stderr, "MTU must be within: %zu-%d\n",
+            sizeof(packet_header) + sizeof(uint32_t), GSO_MAX_BYTES);
+    exit(1);
+  }
+  if (strlen(outfile_path) + 1 >
+      (mtu != 0 ? mtu : PMTU_MIN) - sizeof(packet_header)) {
+    fprintf(stderr, "Outfile path doesn't fit in one packet\n");
     exit(1);
   }
   if (winsz < 1) {
@@ -202,7 +964,9 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
-  send_file(server_ip, server_port, mtu, winsz, infile_path, outfile_path);
+  crc32c_init();
+  send_file(server_ip, server_port, mtu, winsz, infile_path, outfile_path,
+            use_gso, algorithm, rate);
 
   return 0;
 }
@@ -1,12 +1,76 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <getopt.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define BUFFER_SIZE 4096 // KiB
+#define GRO_BUFFER_SIZE 65536 // datagrams coalesced by UDP GRO
+#define RECEIVE_WINDOW 4096 // packets held for reordering, beyond are dropped
+#define MAX_SACK_BLOCKS 4 // runs of packets past the cumulative ACK
+#define ACK_EVERY 8 // in order packets acknowledged together by default
+#define ACK_DELAY_US 200 // longest an in order packet waits for its ACK
+
+// packet types
+#define FLAG_NAME 0x1 // seq 0, payload is the outfile path
+#define FLAG_DATA 0x2
+#define FLAG_FIN 0x4 // last seq, payload is the CRC32C of the whole file
+#define FLAG_ACK 0x8 // to the client, seq is the next one expected
+#define FLAG_MISMATCH 0x10 // on the ACK of FIN, the digest didn't match
+#define FLAG_PROBE 0x20 // MTU probe, seq is its size, echoed with FLAG_ACK
+
+// starts every packet in both directions, fields in network byte order
+typedef struct {
+  uint32_t session; // picked by the client for each transfer
+  uint32_t seq;
+  uint16_t flags;
+  uint16_t len; // payload bytes after the header
+  uint32_t crc; // CRC32C of header and payload, with this field 0
+} packet_header;
+
+// ACK payload, the receive window and then count {start, end} runs of
+// packets received beyond seq, end exclusive, in network byte order
+typedef struct {
+  uint32_t rwnd; // packets past seq the server will accept
+  uint32_t blocks[2 * MAX_SACK_BLOCKS];
+} ack_payload;
+
+// command line options
+typedef struct {
+  int droppc;
+  int ack_every;    // in order packets per ACK
+  int ack_delay_us; // or this long after the first of them
+} server_opts;
+
+// transfer in progress, a NAME packet with a new session id or from another
+// client replaces it
+typedef struct {
+  uint32_t id;
+  int active;
+  char outfile_path[256];
+  uint32_t expected; // next seq to write to the outfile
+  int complete;      // FIN has been written
+  uint32_t digest;   // CRC32C of the outfile as far as it is written
+  int mismatch;      // it differed from the one in FIN
+  uint32_t highest;  // highest seq received
+  struct sockaddr_in peer; // the client, ids alone can collide
+  int unacked;         // in order packets not acknowledged yet
+  uint64_t ack_due_us; // when they will be at the latest
+  // packets that arrived ahead of expected, slot seq % RECEIVE_WINDOW
+  char *chunks[RECEIVE_WINDOW];
+  uint16_t lens[RECEIVE_WINDOW];
+  uint16_t flags[RECEIVE_WINDOW];
+} session;
 
 void validport(int port) {
   if (0 <= port && port <= 1023) {
@@ -22,6 +86,12 @@ void validport(int port) {
   return;
 }
 
+uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 char *timestamp() {
   time_t rawtime;
   struct tm *timeinfo;
@@ -33,71 +103,320 @@ char *timestamp() {
   return timestamp;
 }
 
-void process_packet(int sockfd, struct sockaddr_in *client_addr,
-                    socklen_t addr_len, int droppc, char *outfile_path,
-                    int *pktsn) {
-  char buffer[BUFFER_SIZE];
+// CRC32C (Castagnoli), reflected polynomial, as in iSCSI and ext4
+uint32_t crc32c_table[256];
+int crc32c_hw; // the CPU has SSE4.2
 
-  // receive packet from client
-  ssize_t bytes_received = recvfrom(sockfd, buffer, BUFFER_SIZE, 0,
-                                    (struct sockaddr *)client_addr, &addr_len);
-  if (bytes_received == -1) {
-    fprintf(stderr, "recvfrom() failed\n");
+void crc32c_init() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    }
+    crc32c_table[i] = crc;
+  }
+#if defined(__x86_64__)
+  crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+// 8 bytes per crc32 instruction, the odd bytes at the end one at a time
+__attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *data, size_t len) {
+  uint64_t crc64 = crc;
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = crc64;
+  for (; len > 0; data++, len--) {
+    crc = _mm_crc32_u8(crc, *data);
+  }
+  return crc;
+}
+#endif
+
+// continue the CRC32C crc (0 to start) over len more bytes
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+  const uint8_t *bytes = data;
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (crc32c_hw) {
+    return ~crc32c_sse42(crc, bytes, len);
+  }
+#endif
+  for (size_t i = 0; i < len; i++) {
+    crc = crc32c_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// CRC32C of a packet with its crc field 0, header in network byte order
+uint32_t packet_crc(const packet_header *header, const void *payload,
+                    size_t len) {
+  packet_header zeroed = *header;
+  zeroed.crc = 0;
+  return crc32c(crc32c(0, &zeroed, sizeof(zeroed)), payload, len);
+}
+
+// forget the previous transfer and start writing the new outfile
+void start_session(session *s, uint32_t id, struct sockaddr_in *peer,
+                   const char *name, size_t len) {
+  for (int i = 0; i < RECEIVE_WINDOW; i++) {
+    free(s->chunks[i]);
+    s->chunks[i] = NULL;
+  }
+  s->id = id;
+  s->peer = *peer;
+  s->active = 1;
+  s->expected = 1;
+  s->complete = 0;
+  s->digest = 0;
+  s->mismatch = 0;
+  s->highest = 0;
+  s->unacked = 0;
+  if (len >= sizeof(s->outfile_path)) {
+    len = sizeof(s->outfile_path) - 1;
+  }
+  memcpy(s->outfile_path, name, len);
+  s->outfile_path[len] = '\0';
+
+  // truncate outfile before packets are appended to it
+  FILE *outfile = fopen(s->outfile_path, "wb");
+  if (outfile == NULL) {
+    fprintf(stderr, "Error opening output file\n");
     return;
   }
+  fclose(outfile);
+}
 
-  // log received packet
-  printf("%s, DATA, %d\n", timestamp(), *pktsn);
-  // printf("Received data: %s\n", buffer); // debug message
-
-  // process first packet (contains outfile path)
-  if (*pktsn == 0) {
-    strncpy(outfile_path, buffer, bytes_received);
-    // printf("Output file path received: %s\n", outfile_path); // debug message
-  } else {
-    // droppc is applied for subsequent packets
-    srand(time(NULL));
-    int chance = rand() % 100;
-    int should_drop = (chance) < droppc;
-    // printf("rand() %% 100 = %d\n", chance); // debug message
-
-    // log dropped packet
-    if (should_drop) {
-      if (buffer[0] == 'A') {
-        printf("%s, DROP ACK, %d\n", timestamp(), *pktsn);
-      } else {
-        printf("%s, DROP DATA, %d\n", timestamp(), *pktsn);
-      }
-      return;
-    }
+// append every packet that is now in order to the outfile
+void deliver(session *s) {
+  FILE *outfile = NULL;
 
-    // write buffered data to outfile path (but not first packet)
-    if (strcmp(buffer, outfile_path) != 0) {
-      FILE *outfile = fopen(outfile_path, "ab"); // append bytes mode
+  while (!s->complete && s->chunks[s->expected % RECEIVE_WINDOW] != NULL) {
+    int slot = s->expected % RECEIVE_WINDOW;
+    if (s->flags[slot] & FLAG_FIN) {
+      // the digest was computed while appending, the outfile isn't read back
+      uint32_t fin_digest;
+      memcpy(&fin_digest, s->chunks[slot], sizeof(fin_digest));
+      s->complete = 1;
+      s->mismatch = s->digest != ntohl(fin_digest);
+      printf("%s, %s, %s\n", timestamp(),
+             s->mismatch ? "MISMATCH" : "COMPLETE", s->outfile_path);
+    } else {
       if (outfile == NULL) {
-        fprintf(stderr, "Error opening output file\n");
-        return;
+        outfile = fopen(s->outfile_path, "ab"); // append bytes mode
+        if (outfile == NULL) {
+          fprintf(stderr, "Error opening output file\n");
+          return;
+        }
       }
-      fwrite(buffer, 1, bytes_received, outfile);
-      fclose(outfile);
+      fwrite(s->chunks[slot], 1, s->lens[slot], outfile);
+      s->digest = crc32c(s->digest, s->chunks[slot], s->lens[slot]);
     }
+    free(s->chunks[slot]);
+    s->chunks[slot] = NULL;
+    s->expected++;
+  }
+
+  if (outfile != NULL) {
+    fclose(outfile);
   }
+}
 
-  // send ACK to client for the received packet
-  ssize_t bytes_sent = sendto(sockfd, pktsn, sizeof(*pktsn), 0,
-                              (struct sockaddr *)client_addr, addr_len);
+// acknowledge everything below expected, and the runs of packets buffered
+// past it
+void send_ack(int sockfd, session *s) {
+  packet_header header;
+  ack_payload payload;
+  int count = 0;
+  for (uint32_t seq = s->expected + 1;
+       seq <= s->highest && count < MAX_SACK_BLOCKS; seq++) {
+    if (s->chunks[seq % RECEIVE_WINDOW] == NULL ||
+        s->chunks[(seq - 1) % RECEIVE_WINDOW] != NULL) {
+      continue; // not the start of a run
+    }
+    uint32_t end = seq;
+    while (end <= s->highest && s->chunks[end % RECEIVE_WINDOW] != NULL) {
+      end++;
+    }
+    payload.blocks[2 * count] = htonl(seq);
+    payload.blocks[2 * count + 1] = htonl(end);
+    count++;
+    seq = end;
+  }
+  payload.rwnd = htonl(RECEIVE_WINDOW);
+
+  size_t len = sizeof(payload.rwnd) + 2 * count * sizeof(uint32_t);
+  header.session = htonl(s->id);
+  header.seq = htonl(s->expected);
+  header.flags = htons(FLAG_ACK | (s->mismatch ? FLAG_MISMATCH : 0));
+  header.len = htons(len);
+  header.crc = htonl(packet_crc(&header, &payload, len));
+  char packet[sizeof(header) + sizeof(payload)];
+  memcpy(packet, &header, sizeof(header));
+  memcpy(packet + sizeof(header), &payload, len);
+
+  s->unacked = 0;
+  ssize_t bytes_sent = sendto(sockfd, packet, sizeof(header) + len, 0,
+                              (struct sockaddr *)&s->peer, sizeof(s->peer));
   if (bytes_sent == -1) {
     fprintf(stderr, "sendto() failed\n");
     return;
   }
 
   // log ACK packet
-  printf("%s, ACK, %d\n", timestamp(), *pktsn);
+  printf("%s, ACK, %u\n", timestamp(), s->expected);
+}
 
-  (*pktsn)++;
+// echo an MTU probe in a bare header, the client only needs to know that
+// it arrived
+void send_probe_ack(int sockfd, struct sockaddr_in *client_addr,
+                    packet_header *probe) {
+  packet_header header = *probe;
+  header.flags = htons(FLAG_PROBE | FLAG_ACK);
+  header.len = 0;
+  header.crc = htonl(packet_crc(&header, NULL, 0));
+  if (sendto(sockfd, &header, sizeof(header), 0,
+             (struct sockaddr *)client_addr, sizeof(*client_addr)) == -1) {
+    fprintf(stderr, "sendto() failed\n");
+  }
 }
 
-void start_server(int port, int droppc) {
+void process_packet(int sockfd, struct sockaddr_in *client_addr,
+                    server_opts *opts, session *s, char *buffer,
+                    ssize_t bytes_received) {
+  packet_header header;
+  if (bytes_received < (ssize_t)sizeof(header)) {
+    return;
+  }
+  memcpy(&header, buffer, sizeof(header));
+  uint32_t id = ntohl(header.session);
+  uint32_t seq = ntohl(header.seq);
+  uint16_t flags = ntohs(header.flags);
+  size_t len = ntohs(header.len);
+  char *payload = buffer + sizeof(header);
+  if (len > bytes_received - sizeof(header)) {
+    return; // truncated
+  }
+
+  // log received packet, MTU probes apart from the transfer
+  printf("%s, %s, %u\n", timestamp(), (flags & FLAG_PROBE) ? "PROBE" : "DATA",
+         seq);
+
+  // a corrupt packet is dropped like a lost one, the client resends it
+  if (ntohl(header.crc) != packet_crc(&header, payload, len)) {
+    printf("%s, CORRUPT, %u\n", timestamp(), seq);
+    return;
+  }
+
+  // droppc is applied to every packet but the outfile path and MTU probes,
+  // which would otherwise make the path look smaller than it is
+  int should_drop =
+      !(flags & (FLAG_NAME | FLAG_PROBE)) && rand() % 100 < opts->droppc;
+  if (should_drop) {
+    printf("%s, DROP DATA, %u\n", timestamp(), seq);
+    return;
+  }
+
+  if (flags & FLAG_PROBE) { // not part of the transfer
+    send_probe_ack(sockfd, client_addr, &header);
+    return;
+  }
+
+  int ours = s->active && s->id == id &&
+             s->peer.sin_addr.s_addr == client_addr->sin_addr.s_addr &&
+             s->peer.sin_port == client_addr->sin_port;
+  if (flags & FLAG_NAME) {
+    if (!ours) {
+      start_session(s, id, client_addr, payload, len);
+    }
+  } else if (!ours) {
+    return; // the outfile path hasn't arrived yet, the client will resend
+  } else if (seq >= s->expected + RECEIVE_WINDOW) {
+    return; // too far ahead to buffer, the client will resend
+  } else if ((flags & FLAG_FIN) && len != sizeof(uint32_t)) {
+    return; // FIN carries the digest
+  }
+
+  uint32_t expected = s->expected;
+  if (!(flags & FLAG_NAME) && seq >= expected) {
+    int slot = seq % RECEIVE_WINDOW;
+    if (s->chunks[slot] == NULL) {
+      s->chunks[slot] = malloc(len > 0 ? len : 1);
+      if (s->chunks[slot] == NULL) {
+        return;
+      }
+      memcpy(s->chunks[slot], payload, len);
+      s->lens[slot] = len;
+      s->flags[slot] = flags;
+      if (seq > s->highest) {
+        s->highest = seq;
+      }
+      deliver(s);
+    }
+  } // below expected it's a duplicate of a written packet, ACK it again
+
+  // in order packets are acknowledged together, anything the client should
+  // hear about soon (the start and end of the transfer, gaps, duplicates)
+  // right away
+  int in_order = (flags & FLAG_DATA) && seq == expected && !s->complete &&
+                 s->expected > s->highest;
+  if (!in_order || ++s->unacked >= opts->ack_every) {
+    send_ack(sockfd, s);
+  } else if (s->unacked == 1) {
+    s->ack_due_us = now_us() + opts->ack_delay_us;
+  }
+}
+
+// receive one datagram, or with UDP GRO a run of datagrams from the same
+// client that the kernel coalesced, and process each of them in turn
+void receive_packets(int sockfd, struct sockaddr_in *client_addr,
+                     socklen_t addr_len, server_opts *opts, session *s,
+                     char *buffer) {
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {buffer, GRO_BUFFER_SIZE};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = client_addr;
+  msg.msg_namelen = addr_len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  // receive packets from client
+  ssize_t bytes_received = recvmsg(sockfd, &msg, 0);
+  if (bytes_received == -1) {
+    fprintf(stderr, "recvfrom() failed\n");
+    return;
+  }
+
+  // coalesced datagrams all have the segment size, except maybe the last
+  ssize_t segment_size = bytes_received;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int gso_size;
+      memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+      segment_size = gso_size;
+    }
+  }
+
+  ssize_t offset = 0;
+  do {
+    ssize_t len = bytes_received - offset < segment_size
+                      ? bytes_received - offset
+                      : segment_size;
+    process_packet(sockfd, client_addr, opts, s, buffer + offset, len);
+    offset += len;
+  } while (offset < bytes_received);
+}
+
+void start_server(int port, server_opts *opts) {
   // create socket file descriptor
   int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   if (sockfd == -1) {
@@ -120,39 +439,93 @@ void start_server(int port, int droppc) {
     exit(1);
   }
 
+  // let the kernel coalesce datagrams of a flow (GSO senders on loopback
+  // arrive in one piece), if it can't they just arrive one at a time
+  int on = 1;
+  setsockopt(sockfd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on));
+
   printf("Server listening on port: %d\n", port);
 
   struct sockaddr_in client_addr;
   socklen_t addr_len = sizeof(client_addr);
-  char outfile_path[256] = "";
-  int pktsn = 0;
+  session *s = calloc(1, sizeof(session));
+  char *buffer = malloc(GRO_BUFFER_SIZE);
+  if (s == NULL || buffer == NULL) {
+    fprintf(stderr, "Error allocating receive buffer\n");
+    exit(1);
+  }
 
-  // process incoming packets one at a time
+  // process incoming packets one at a time, until delayed ACKs are due
   while (1) {
-    process_packet(sockfd, &client_addr, addr_len, droppc, outfile_path,
-                   &pktsn);
+    struct timespec wait;
+    struct timespec *timeout = NULL;
+    if (s->unacked > 0) {
+      uint64_t current_us = now_us();
+      uint64_t left_us =
+          s->ack_due_us > current_us ? s->ack_due_us - current_us : 0;
+      wait.tv_sec = left_us / 1000000;
+      wait.tv_nsec = (left_us % 1000000) * 1000;
+      timeout = &wait;
+    }
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    if (ppoll(&pfd, 1, timeout, NULL) > 0) {
+      receive_packets(sockfd, &client_addr, addr_len, opts, s, buffer);
+    }
+    if (s->unacked > 0 && now_us() >= s->ack_due_us) {
+      send_ack(sockfd, s);
+    }
   }
 
   close(sockfd);
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <Port Number> <Drop Percentage>\n", argv[0]);
+  server_opts opts;
+  opts.ack_every = ACK_EVERY;
+  opts.ack_delay_us = ACK_DELAY_US;
+  int opt;
+
+  // -a to acknowledge every N in order packets, -d to wait at most so many
+  // microseconds for them
+  while ((opt = getopt(argc, argv, "a:d:")) != -1) {
+    switch (opt) {
+    case 'a':
+      opts.ack_every = atoi(optarg);
+      break;
+    case 'd':
+      opts.ack_delay_us = atoi(optarg);
+      break;
+    default:
+      argc = 0; // print usage
+      break;
+    }
+  }
+
+  if (argc - optind != 2) {
+    fprintf(stderr,
+            "Usage: %s <Port Number> <Drop Percentage> [-a <Packets>] "
+            "[-d <Microseconds>]\n",
+            argv[0]);
     exit(1);
   }
 
-  int port = atoi(argv[1]);
-  int droppc = atoi(argv[2]);
+  int port = atoi(argv[optind]);
+  opts.droppc = atoi(argv[optind + 1]);
 
   validport(port);
-  if (droppc < 0 || droppc > 100) {
+  if (opts.droppc < 0 || opts.droppc > 100) {
     fprintf(stderr, "Drop percentage must be in the range: 0-100.\n");
     exit(1);
   }
+  if (opts.ack_every < 1 || opts.ack_delay_us < 0) {
+    fprintf(stderr, "ACKs must cover at least 1 packet, with a delay of at "
+                    "least 0 us\n");
+    exit(1);
+  }
 
   srand(time(NULL));
-  start_server(port, droppc);
+  crc32c_init();
+  start_server(port, &opts);
 
   return 0;
 }
@@ -1,27 +1,173 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <netinet/udp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-#define RECV_TIMEOUT_SECONDS 10
-#define MAX_RETRANSMISSIONS 10
-#define RETRANSMISSION_TIMEOUT_SECONDS 10
-#define BUFFER_SIZE 1024
+#define MAX_RETRANSMISSIONS 10 // per packet, and then only
+#define GIVE_UP_US 10000000 // if nothing was acknowledged for this long
+#define RTO_INITIAL_US 1000000 // until the first RTT sample (RFC 6298)
+#define RTO_MIN_US 1000 // RFC 6298 says 1 s, far too long for a LAN
+#define RTO_MAX_US 60000000
+#define RTO_GRANULARITY_US 100 // clock granularity G of RFC 6298
+#define CC_INITIAL_WINDOW 10 // packets, as TCP's IW10 (RFC 6928)
+#define CC_MIN_WINDOW 2
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+#define PACE_GAIN_SLOW_START 2.0 // pacing rate over cwnd / srtt, as Linux
+#define PACE_GAIN 1.2
+#define PACE_BURST_US 1000 // tokens the bucket holds, in time at the rate
+#define PACE_MIN_BURST 2   // packets
+#define GSO_MAX_SEGMENTS 64 // most segments the kernel takes in one send
+#define GSO_MAX_BYTES 65000 // UDP payload limit, with room for headers
+#define PMTU_MIN 548  // UDP payload every IPv4 path carries (576 - 28)
+#define PMTU_MAX 8972 // UDP payload of a 9000 byte jumbo frame
+#define PMTU_PROBE_TRIES 3
+#define PMTU_PROBE_TIMEOUT_US 200000
+#define PMTU_REPROBE_RETRANSMISSIONS 3 // of a full size packet
+#define PMTU_REPROBE_FLOOR_PC 75       // percent of the MTU searched down to
+#define PMTU_REPROBE_TRIES 1
+#define FEC_MAX_BLOCK 64 // data packets per FEC block
+#define FEC_MAX_PARITY 8 // parity packets per block
+#define FEC_CLEAN_BLOCKS 8 // blocks without a loss before adaptive FEC eases
+#define INFILE_CHUNK (1 << 20) // bytes, a multiple of the page size
+#define INFILE_READAHEAD 8     // chunks past the leading replica
+
+// packet types
+#define FLAG_NAME 0x1 // seq 0, payload is the chunk size and outfile path
+#define FLAG_DATA 0x2
+#define FLAG_FIN 0x4 // last seq, payload is the CRC32C of the whole file
+#define FLAG_ACK 0x8 // from the server, seq is the next one expected
+#define FLAG_PARITY 0x10 // FEC parity of the block whose first seq is seq
+#define FLAG_MISMATCH 0x20 // on the ACK of FIN, the digest didn't match
+#define FLAG_PROBE 0x40 // MTU probe, seq is its size, echoed with FLAG_ACK
+#define MAX_SACK_BLOCKS 4 // runs of packets past the cumulative ACK
+
+// starts every packet in both directions, fields in network byte order
+typedef struct {
+  uint32_t session; // picked by the client for each transfer
+  uint32_t seq;
+  uint16_t flags;
+  uint16_t len; // payload bytes after the header
+  uint32_t crc; // CRC32C of header and payload, with this field 0
+} packet_header;
+
+// ACK payload, the receive window and then count {start, end} runs of
+// packets received beyond seq, end exclusive, in network byte order
+typedef struct {
+  uint32_t rwnd; // packets past seq the server will accept
+  uint32_t blocks[2 * MAX_SACK_BLOCKS];
+} ack_payload;
+
+// starts the payload of a parity packet, followed by the coded length (2
+// bytes, big endian) and the coded payloads of the block's data packets
+typedef struct {
+  uint8_t k;          // data packets in this block
+  uint8_t block_size; // data packets in every full block
+  uint8_t index;      // parity row
+  uint8_t count;      // parity packets of this block
+} fec_header;
+
+// one packet of the send window, kept until it is acknowledged
+typedef struct {
+  packet_header header; // in network byte order
+  const char *payload;  // in the mapped infile, or the NAME payload
+  size_t len;           // payload bytes
+  uint32_t seq;
+  int acked;
+  int retransmissions;
+  uint64_t sent_us; // when it was last sent
+  uint64_t due_us;  // when it is retransmitted unless acknowledged
+} window_slot;
+
+// retransmission timeout from smoothed RTT samples, RFC 6298
+typedef struct {
+  uint64_t srtt_us;
+  uint64_t rttvar_us;
+  uint64_t rto_us;
+  int sampled; // srtt_us and rttvar_us hold a measurement
+} rto_estimator;
+
+// congestion window, in packets, never larger than winsz
+typedef struct {
+  double cwnd;
+  double ssthresh;   // slow start until cwnd reaches it
+  double w_max;      // cwnd before the last loss (CUBIC)
+  uint64_t epoch_us; // when the last loss happened (CUBIC)
+  size_t recovery;   // losses before this seq belong to the same event
+  int cap;           // winsz
+} cc_state;
+
+// a congestion control algorithm, picked with -c
+typedef struct {
+  const char *name;
+  void (*on_ack)(cc_state *cc, uint64_t now_us, uint64_t srtt_us);
+  void (*on_loss)(cc_state *cc, uint64_t now_us);
+} cc_algorithm;
+
+// token bucket pacing the sends, in bytes
+typedef struct {
+  double rate;       // bytes per second, 0 while not pacing
+  double tokens;     // negative after a send that took more than there were
+  uint64_t last_us;  // when tokens were last added
+  double fixed_rate; // from -r, 0 to follow cwnd / srtt
+} pacer;
+
+// parity packets of the FEC block being sent, rebuilt for every block
+typedef struct {
+  int block_size;                     // data packets per block, 0 without FEC
+  int count;                          // parity packets per block right now
+  int adaptive;                       // count follows the retransmissions
+  int clean;                          // blocks since they last went up
+  unsigned long long retransmissions; // when the block started
+  uint32_t start;                     // seq of the block's first packet
+  int k;                              // data packets added so far
+  size_t row_size;                    // coded length and payload
+  char *parity[FEC_MAX_PARITY];       // header, fec_header and row
+} fec_encoder;
+
+// the infile, mapped once and shared by all sender threads, read ahead and
+// freed a chunk at a time
+typedef struct {
+  const char *data;
+  size_t size;
+  int fd;
+  size_t chunks;
+  int *refs;     // replicas that haven't acknowledged each chunk yet
+  size_t loaded; // chunks the kernel was asked to read ahead
+  pthread_mutex_t lock;
+} shared_infile;
 
 // server configuration arguments
 typedef struct {
   char *server_ip;
   int server_port;
-  int mtu;
+  int mtu; // 0 to discover it
   int winsz;
-  char *infile_path;
+  shared_infile *infile;
   char *outfile_path;
+  int gso; // send the window in UDP GSO batches if the kernel can
+  cc_algorithm *algorithm;
+  int fec_block;  // data packets per FEC block, 0 without FEC
+  int fec_parity; // parity packets per block, 0 to adapt to losses
+  double rate;    // pacing rate in bytes per second, 0 to follow cwnd / srtt
 } servconf;
 
 // sender thread arguments
@@ -30,10 +176,14 @@ typedef struct {
   struct sockaddr_in server_addr;
   struct sockaddr_in client_addr;
   char *outfile_path;
-  FILE *infile;
+  shared_infile *infile;
   int mtu;
-  int winsz;
-  int *pktsn;
+  int winsz; // cap for the congestion window
+  int gso;
+  cc_algorithm *algorithm;
+  int fec_block;
+  int fec_parity;
+  double rate;
 } sender_args;
 
 void validport(int port) {
@@ -52,21 +202,716 @@ void validport(int port) {
   return;
 }
 
+// one sender thread per server logs, each formats into its own buffer
 char *timestamp() {
   time_t rawtime;
-  struct tm *timeinfo;
-  static char timestamp[30];
+  struct tm timeinfo;
+  static __thread char timestamp[30];
   time(&rawtime);
-  timeinfo = localtime(&rawtime);
-  strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", timeinfo);
+  localtime_r(&rawtime, &timeinfo);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &timeinfo);
 
   return timestamp;
 }
 
+uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void rto_init(rto_estimator *e) {
+  memset(e, 0, sizeof(*e));
+  e->rto_us = RTO_INITIAL_US;
+}
+
+// update SRTT and RTTVAR with a measured RTT and recompute the RTO, which
+// also undoes any backoff
+void rto_sample(rto_estimator *e, uint64_t rtt_us) {
+  if (!e->sampled) {
+    e->srtt_us = rtt_us;
+    e->rttvar_us = rtt_us / 2;
+    e->sampled = 1;
+  } else {
+    uint64_t diff =
+        e->srtt_us > rtt_us ? e->srtt_us - rtt_us : rtt_us - e->srtt_us;
+    e->rttvar_us = (3 * e->rttvar_us + diff) / 4;
+    e->srtt_us = (7 * e->srtt_us + rtt_us) / 8;
+  }
+
+  uint64_t variance = 4 * e->rttvar_us;
+  e->rto_us = e->srtt_us +
+              (variance > RTO_GRANULARITY_US ? variance : RTO_GRANULARITY_US);
+  if (e->rto_us < RTO_MIN_US) {
+    e->rto_us = RTO_MIN_US;
+  } else if (e->rto_us > RTO_MAX_US) {
+    e->rto_us = RTO_MAX_US;
+  }
+}
+
+// double the RTO after a timeout, until a new sample comes in
+void rto_backoff(rto_estimator *e) {
+  e->rto_us = e->rto_us * 2 > RTO_MAX_US ? RTO_MAX_US : e->rto_us * 2;
+}
+
+void cc_init(cc_state *cc, int cap) {
+  memset(cc, 0, sizeof(*cc));
+  cc->cwnd = CC_INITIAL_WINDOW < cap ? CC_INITIAL_WINDOW : cap;
+  cc->ssthresh = cap;
+  cc->cap = cap;
+}
+
+// packets that may be in flight right now
+size_t cc_window(cc_state *cc) {
+  return cc->cwnd < cc->cap ? (size_t)cc->cwnd : (size_t)cc->cap;
+}
+
+// slow start, then one packet more per window of ACKs
+void reno_on_ack(cc_state *cc, uint64_t now_us, uint64_t srtt_us) {
+  (void)now_us;
+  (void)srtt_us;
+  if (cc->cwnd < cc->ssthresh) {
+    cc->cwnd += 1;
+  } else {
+    cc->cwnd += 1 / cc->cwnd;
+  }
+}
+
+// halve the window
+void reno_on_loss(cc_state *cc, uint64_t now_us) {
+  (void)now_us;
+  cc->ssthresh = cc->cwnd / 2 > CC_MIN_WINDOW ? cc->cwnd / 2 : CC_MIN_WINDOW;
+  cc->cwnd = cc->ssthresh;
+}
+
+// slow start, then grow along the cubic W(t) = C (t - K)^3 + W_max
+// (RFC 8312), which is flat around the window of the last loss and
+// probes quickly away from it
+void cubic_on_ack(cc_state *cc, uint64_t now_us, uint64_t srtt_us) {
+  if (cc->cwnd < cc->ssthresh) {
+    cc->cwnd += 1;
+    return;
+  }
+  if (cc->epoch_us == 0) { // no loss yet, start from here
+    cc->epoch_us = now_us;
+    cc->w_max = cc->cwnd;
+  }
+
+  double t = (now_us - cc->epoch_us + srtt_us) / 1e6;
+  double k = cbrt(cc->w_max * (1 - CUBIC_BETA) / CUBIC_C);
+  double target = CUBIC_C * (t - k) * (t - k) * (t - k) + cc->w_max;
+  if (target > cc->cwnd) {
+    cc->cwnd += (target - cc->cwnd) / cc->cwnd;
+  } else {
+    cc->cwnd += 0.01 / cc->cwnd;
+  }
+}
+
+// shrink the window by beta and remember where the loss happened
+void cubic_on_loss(cc_state *cc, uint64_t now_us) {
+  cc->w_max = cc->cwnd;
+  cc->epoch_us = now_us;
+  cc->cwnd = cc->cwnd * CUBIC_BETA > CC_MIN_WINDOW ? cc->cwnd * CUBIC_BETA
+                                                   : CC_MIN_WINDOW;
+  cc->ssthresh = cc->cwnd;
+}
+
+cc_algorithm cc_algorithms[] = {
+    {"reno", reno_on_ack, reno_on_loss},
+    {"cubic", cubic_on_ack, cubic_on_loss},
+};
+
+cc_algorithm *cc_find(const char *name) {
+  for (size_t i = 0; i < sizeof(cc_algorithms) / sizeof(cc_algorithms[0]);
+       i++) {
+    if (strcmp(cc_algorithms[i].name, name) == 0) {
+      return &cc_algorithms[i];
+    }
+  }
+  return NULL;
+}
+
+// pace sends at gain * cwnd / srtt, or the rate given with -r, instead of
+// sending a whole window back to back, the bucket holds PACE_BURST_US
+// worth of tokens (at least PACE_MIN_BURST packets)
+void pace_update(pacer *p, cc_state *cc, rto_estimator *rto, int mtu,
+                 uint64_t now) {
+  if (p->fixed_rate > 0) {
+    p->rate = p->fixed_rate;
+  } else if (rto->sampled && rto->srtt_us > 0) {
+    double gain =
+        cc->cwnd < cc->ssthresh ? PACE_GAIN_SLOW_START : PACE_GAIN;
+    p->rate = gain * cc_window(cc) * mtu * 1e6 / rto->srtt_us;
+  } else {
+    p->rate = 0; // no RTT yet, the initial window goes out at once
+  }
+
+  double depth = p->rate * PACE_BURST_US / 1e6;
+  if (depth < PACE_MIN_BURST * mtu) {
+    depth = PACE_MIN_BURST * mtu;
+  }
+  if (p->rate == 0) {
+    p->tokens = depth;
+  } else {
+    p->tokens += (now - p->last_us) * p->rate / 1e6;
+    if (p->tokens > depth) {
+      p->tokens = depth;
+    }
+  }
+  p->last_us = now;
+}
+
+// take the tokens of a packet, the bucket may go into debt
+void pace_sent(pacer *p, size_t bytes) {
+  if (p->rate > 0) {
+    p->tokens -= bytes;
+  }
+}
+
+// when the bucket has tokens again
+uint64_t pace_next_us(pacer *p) {
+  if (p->tokens > 0 || p->rate == 0) {
+    return p->last_us;
+  }
+  return p->last_us + (uint64_t)(-p->tokens * 1e6 / p->rate) + 1;
+}
+
+
+// CRC32C (Castagnoli), reflected polynomial, as in iSCSI and ext4
+uint32_t crc32c_table[256];
+int crc32c_hw; // the CPU has SSE4.2
+
+void crc32c_init() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    }
+    crc32c_table[i] = crc;
+  }
+#if defined(__x86_64__)
+  crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+// 8 bytes per crc32 instruction, the odd bytes at the end one at a time
+__attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *data, size_t len) {
+  uint64_t crc64 = crc;
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = crc64;
+  for (; len > 0; data++, len--) {
+    crc = _mm_crc32_u8(crc, *data);
+  }
+  return crc;
+}
+#endif
+
+// continue the CRC32C crc (0 to start) over len more bytes
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+  const uint8_t *bytes = data;
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (crc32c_hw) {
+    return ~crc32c_sse42(crc, bytes, len);
+  }
+#endif
+  for (size_t i = 0; i < len; i++) {
+    crc = crc32c_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// CRC32C of a packet with its crc field 0, header in network byte order
+uint32_t packet_crc(const packet_header *header, const void *payload,
+                    size_t len) {
+  packet_header zeroed = *header;
+  zeroed.crc = 0;
+  return crc32c(crc32c(0, &zeroed, sizeof(zeroed)), payload, len);
+}
+
+// send a probe of size bytes and wait for the server to echo it, up to
+// tries times for timeout_us each, 1 if it got through. ACKs of the
+// transfer read meanwhile are dropped, but like the echo they show that
+// the server is there, alive_us (unless NULL) is set when one arrives
+int pmtu_probe(int sockfd, struct sockaddr_in *server_addr, uint32_t session,
+               char *probe, size_t size, int tries, uint64_t timeout_us,
+               uint64_t *alive_us) {
+  packet_header header;
+  size_t len = size - sizeof(header);
+  header.session = htonl(session);
+  header.seq = htonl(size);
+  header.flags = htons(FLAG_PROBE);
+  header.len = htons(len);
+  memset(probe + sizeof(header), 0, len);
+  header.crc = htonl(packet_crc(&header, probe + sizeof(header), len));
+  memcpy(probe, &header, sizeof(header));
+
+  for (int try = 0; try < tries; try++) {
+    if (sendto(sockfd, probe, size, 0, (struct sockaddr *)server_addr,
+               sizeof(*server_addr)) == -1) {
+      return 0; // EMSGSIZE, larger than the route's MTU
+    }
+    uint64_t deadline_us = now_us() + timeout_us;
+    uint64_t current_us;
+    while ((current_us = now_us()) < deadline_us) {
+      struct pollfd pfd = {sockfd, POLLIN, 0};
+      int timeout_ms = (deadline_us - current_us + 999) / 1000;
+      if (poll(&pfd, 1, timeout_ms) <= 0) {
+        break;
+      }
+      char reply[sizeof(packet_header) + sizeof(ack_payload)];
+      packet_header header;
+      ssize_t bytes_received = recv(sockfd, reply, sizeof(reply), MSG_DONTWAIT);
+      if (bytes_received < (ssize_t)sizeof(header)) {
+        continue;
+      }
+      memcpy(&header, reply, sizeof(header));
+      size_t len = ntohs(header.len);
+      if (ntohl(header.session) != session ||
+          !(ntohs(header.flags) & FLAG_ACK) ||
+          len > bytes_received - sizeof(header) ||
+          ntohl(header.crc) !=
+              packet_crc(&header, reply + sizeof(header), len)) {
+        continue; // stale, for an earlier transfer or corrupt
+      }
+      if (alive_us != NULL) {
+        *alive_us = now_us();
+      }
+      if (ntohs(header.flags) == (FLAG_PROBE | FLAG_ACK) &&
+          ntohl(header.seq) == size && len == 0) {
+        return 1;
+      } // anything else is an ACK of the transfer, later ones cover it
+    }
+  }
+  return 0;
+}
+
+// binary search for the largest datagram that reaches the server, from lo,
+// which is taken to get through, up to hi, probing as pmtu_probe does
+int pmtu_discover(int sockfd, struct sockaddr_in *server_addr,
+                  uint32_t session, int lo, int hi, int tries,
+                  uint64_t timeout_us, uint64_t *alive_us) {
+  // DF set, and sends larger than the route's MTU fail instead of being
+  // fragmented, whatever the kernel thinks the path MTU is
+  int mode = IP_PMTUDISC_PROBE;
+  setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+
+  char *probe = malloc(hi);
+  if (probe == NULL) {
+    fprintf(stderr, "Error allocating MTU probe\n");
+    exit(1);
+  }
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (pmtu_probe(sockfd, server_addr, session, probe, mid, tries,
+                   timeout_us, alive_us)) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  free(probe);
+  return lo;
+}
+
+// how many mtu sized datagrams one UDP GSO send can carry on this socket,
+// 1 if the kernel doesn't support UDP_SEGMENT
+int gso_segments(int sockfd, int mtu) {
+  int size = mtu;
+  if (setsockopt(sockfd, IPPROTO_UDP, UDP_SEGMENT, &size, sizeof(size)) ==
+      -1) {
+    return 1;
+  }
+  size = 0; // sizes are given per send, not for the socket
+  setsockopt(sockfd, IPPROTO_UDP, UDP_SEGMENT, &size, sizeof(size));
+
+  int segments = GSO_MAX_BYTES / mtu;
+  return segments > GSO_MAX_SEGMENTS ? GSO_MAX_SEGMENTS : segments;
+}
+
+// send one packet, its header and payload given by two iovecs
+int send_packet(int sockfd, struct sockaddr_in *server_addr,
+                struct iovec *iov) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = server_addr;
+  msg.msg_namelen = sizeof(*server_addr);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  return sendmsg(sockfd, &msg, 0) == -1 ? -1 : 0;
+}
+
+// send count packets (all mtu bytes but the last), each a header and a
+// payload iovec, all in one system call with UDP GSO while it works, one
+// sendmsg per packet otherwise
+int send_segments(int sockfd, struct sockaddr_in *server_addr,
+                  struct iovec *iov, int count, int mtu, int *gso) {
+  if (*gso && count > 1) {
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_name = server_addr;
+    msg.msg_namelen = sizeof(*server_addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2 * count;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t segment_size = mtu;
+    memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+
+    ssize_t len = 0;
+    for (int i = 0; i < 2 * count; i++) {
+      len += iov[i].iov_len;
+    }
+    if (sendmsg(sockfd, &msg, 0) == len) {
+      return 0;
+    }
+    // e.g. the route has no checksum offload or a smaller MTU
+    fprintf(stderr, "UDP GSO send failed, sending one datagram at a time\n");
+    *gso = 0;
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (send_packet(sockfd, server_addr, &iov[2 * i]) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// fill in the header of a window slot and point it at its payload
+void prepare_slot(window_slot *slot, uint32_t session, uint32_t seq,
+                  uint16_t flags, const char *payload, size_t payload_len) {
+  slot->header.session = htonl(session);
+  slot->header.seq = htonl(seq);
+  slot->header.flags = htons(flags);
+  slot->header.len = htons(payload_len);
+  slot->header.crc = htonl(packet_crc(&slot->header, payload, payload_len));
+  slot->payload = payload;
+  slot->len = payload_len;
+  slot->seq = seq;
+  slot->acked = 0;
+  slot->retransmissions = 0;
+}
+
+// the header and payload iovecs of a window slot
+void slot_iov(window_slot *slot, struct iovec *iov) {
+  iov[0].iov_base = &slot->header;
+  iov[0].iov_len = sizeof(slot->header);
+  iov[1].iov_base = (void *)slot->payload;
+  iov[1].iov_len = slot->len;
+}
+
+// mark packets from..to-1 of the window acknowledged, returns how many
+// weren't before, and keeps the latest send time of those that were sent
+// just once (Karn: an ACK of a resent packet may be for either send)
+int ack_range(window_slot *slots, int winsz, size_t from, size_t to,
+              uint64_t *sample_sent_us) {
+  int count = 0;
+  for (size_t seq = from; seq < to; seq++) {
+    window_slot *slot = &slots[seq % winsz];
+    if (slot->acked) {
+      continue;
+    }
+    slot->acked = 1;
+    count++;
+    if (slot->retransmissions == 0 && slot->sent_us > *sample_sent_us) {
+      *sample_sent_us = slot->sent_us;
+    }
+  }
+  return count;
+}
+
+// arm timerfd to fire at the earliest retransmission deadline, which is
+// on the same monotonic clock as now_us()
+void arm_timer(int timerfd, uint64_t due_us) {
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if (due_us != UINT64_MAX) {
+    its.it_value.tv_sec = due_us / 1000000;
+    its.it_value.tv_nsec = (due_us % 1000000) * 1000;
+  }
+  timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1, for Reed-Solomon
+uint8_t gf_exp[512];
+uint8_t gf_log[256];
+int gf_simd; // the CPU has SSSE3
+
+void gf_init() {
+  int x = 1;
+  for (int i = 0; i < 255; i++) {
+    gf_exp[i] = x;
+    gf_log[x] = i;
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= 0x11d;
+    }
+  }
+  for (int i = 255; i < 512; i++) {
+    gf_exp[i] = gf_exp[i - 255];
+  }
+#if defined(__x86_64__)
+  gf_simd = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+uint8_t gf_mul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0) {
+    return 0;
+  }
+  return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+uint8_t gf_inv(uint8_t a) { return gf_exp[255 - gf_log[a]]; }
+
+#if defined(__x86_64__)
+// dst ^= c * src 16 bytes at a time, the product of every byte is looked up
+// by its low and its high nibble with PSHUFB, returns the bytes done
+__attribute__((target("ssse3"))) size_t
+gf_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  uint8_t low[16];
+  uint8_t high[16];
+  for (int i = 0; i < 16; i++) {
+    low[i] = gf_mul(c, i);
+    high[i] = gf_mul(c, i << 4);
+  }
+  __m128i table_low = _mm_loadu_si128((const __m128i *)low);
+  __m128i table_high = _mm_loadu_si128((const __m128i *)high);
+  __m128i mask = _mm_set1_epi8(0x0f);
+
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i product = _mm_xor_si128(
+        _mm_shuffle_epi8(table_low, _mm_and_si128(v, mask)),
+        _mm_shuffle_epi8(table_high,
+                         _mm_and_si128(_mm_srli_epi64(v, 4), mask)));
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, product));
+  }
+  return i;
+}
+#endif
+
+// dst ^= c * src over len bytes
+void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  size_t i = 0;
+  if (c == 0) {
+    return;
+  }
+  if (c == 1) { // plain XOR, which the compiler vectorizes
+    for (; i < len; i++) {
+      dst[i] ^= src[i];
+    }
+    return;
+  }
+#if defined(__x86_64__)
+  if (gf_simd) {
+    i = gf_mul_add_ssse3(dst, src, c, len);
+  }
+#endif
+  for (; i < len; i++) {
+    dst[i] ^= gf_mul(c, src[i]);
+  }
+}
+
+// coefficient of data packet i in parity row j, all ones (XOR) with a
+// single parity packet, otherwise a Cauchy matrix, every square part of
+// which can be inverted
+uint8_t fec_coef(int j, int i, int count) {
+  return count == 1 ? 1 : gf_inv(j ^ (FEC_MAX_PARITY + i));
+}
+
+// start a block at seq start, adaptively sending one parity packet more
+// per block while packets are still being retransmitted and one less after
+// FEC_CLEAN_BLOCKS blocks without
+void fec_start_block(fec_encoder *fec, uint32_t start,
+                     unsigned long long retransmissions) {
+  if (fec->adaptive) {
+    if (retransmissions > fec->retransmissions) {
+      if (fec->count < FEC_MAX_PARITY) {
+        fec->count++;
+      }
+      fec->clean = 0;
+    } else if (++fec->clean >= FEC_CLEAN_BLOCKS && fec->count > 1) {
+      fec->count--;
+      fec->clean = 0;
+    }
+    fec->retransmissions = retransmissions;
+  }
+  fec->start = start;
+  fec->k = 0;
+  for (int j = 0; j < fec->count; j++) {
+    memset(fec->parity[j] + sizeof(packet_header) + sizeof(fec_header), 0,
+           fec->row_size);
+  }
+}
+
+// code the next data packet of the block into every parity row
+void fec_add(fec_encoder *fec, const char *payload, size_t len) {
+  uint8_t coded_len[2] = {len >> 8, len & 0xff};
+  for (int j = 0; j < fec->count; j++) {
+    uint8_t *row = (uint8_t *)fec->parity[j] + sizeof(packet_header) +
+                   sizeof(fec_header);
+    uint8_t c = fec_coef(j, fec->k, fec->count);
+    gf_mul_add(row, coded_len, c, sizeof(coded_len));
+    gf_mul_add(row + sizeof(coded_len), (const uint8_t *)payload, c, len);
+  }
+  fec->k++;
+}
+
+// send the parity packets of the block, which are never acknowledged or
+// retransmitted
+int fec_send(fec_encoder *fec, int sockfd, struct sockaddr_in *server_addr,
+             uint32_t session) {
+  for (int j = 0; j < fec->count; j++) {
+    packet_header header;
+    header.session = htonl(session);
+    header.seq = htonl(fec->start);
+    header.flags = htons(FLAG_PARITY);
+    header.len = htons(sizeof(fec_header) + fec->row_size);
+    fec_header fh = {fec->k, fec->block_size, j, fec->count};
+    memcpy(fec->parity[j] + sizeof(header), &fh, sizeof(fh));
+    header.crc = htonl(packet_crc(&header, fec->parity[j] + sizeof(header),
+                                  sizeof(fh) + fec->row_size));
+    memcpy(fec->parity[j], &header, sizeof(header));
+    if (sendto(sockfd, fec->parity[j],
+               sizeof(header) + sizeof(fh) + fec->row_size, 0,
+               (struct sockaddr *)server_addr, sizeof(*server_addr)) == -1) {
+      return -1;
+    }
+  }
+  fec->k = 0;
+  return 0;
+}
+
+// bytes of chunk c, only the last one may be short
+size_t infile_chunk_len(shared_infile *f, size_t c) {
+  size_t start = c * INFILE_CHUNK;
+  return f->size - start < INFILE_CHUNK ? f->size - start : INFILE_CHUNK;
+}
+
+// a replica is about to send from offset, the first one to get near a chunk
+// has the kernel read it, so it comes off the disk once for all of them
+void infile_reached(shared_infile *f, size_t offset) {
+  size_t want = offset / INFILE_CHUNK + INFILE_READAHEAD;
+  if (want > f->chunks) {
+    want = f->chunks;
+  }
+  pthread_mutex_lock(&(f->lock));
+  for (; f->loaded < want; f->loaded++) {
+    madvise((void *)(f->data + f->loaded * INFILE_CHUNK),
+            infile_chunk_len(f, f->loaded), MADV_WILLNEED);
+  }
+  pthread_mutex_unlock(&(f->lock));
+}
+
+// a replica has acknowledged everything before acked, it drops its
+// reference to each chunk it is done with, and the last one to do so
+// frees the chunk's pages
+void infile_release(shared_infile *f, size_t *released, size_t acked) {
+  while (*released < f->chunks &&
+         ((*released + 1) * INFILE_CHUNK <= acked || acked == f->size)) {
+    size_t start = *released * INFILE_CHUNK;
+    size_t len = infile_chunk_len(f, *released);
+    pthread_mutex_lock(&(f->lock));
+    if (--f->refs[*released] == 0) {
+      madvise((void *)(f->data + start), len, MADV_DONTNEED);
+      posix_fadvise(f->fd, start, len, POSIX_FADV_DONTNEED);
+    }
+    pthread_mutex_unlock(&(f->lock));
+    (*released)++;
+  }
+}
+
+// map the whole infile read only, every sender thread sends from the same
+// pages, data is NULL for an empty file
+shared_infile *map_infile(const char *path, int replicas) {
+  shared_infile *f = calloc(1, sizeof(shared_infile));
+  f->fd = open(path, O_RDONLY);
+  struct stat st;
+  if (f->fd == -1 || fstat(f->fd, &st) == -1) {
+    fprintf(stderr, "Error opening input file\n");
+    exit(1);
+  }
+  f->size = st.st_size;
+  f->chunks = (f->size + INFILE_CHUNK - 1) / INFILE_CHUNK;
+  f->refs = malloc(f->chunks * sizeof(int));
+  for (size_t c = 0; c < f->chunks; c++) {
+    f->refs[c] = replicas;
+  }
+  pthread_mutex_init(&(f->lock), NULL);
+  if (f->size == 0) {
+    return f;
+  }
+
+  void *data = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Error mapping input file\n");
+    exit(1);
+  }
+  f->data = data;
+  madvise(data, f->size, MADV_SEQUENTIAL);
+  infile_reached(f, 0);
+  return f;
+}
+
+void unmap_infile(shared_infile *f) {
+  if (f->data != NULL) {
+    munmap((void *)f->data, f->size);
+  }
+  pthread_mutex_destroy(&(f->lock));
+  close(f->fd);
+  free(f->refs);
+  free(f);
+}
+
+// selective repeat: up to cwnd packets in flight, each acknowledged and
+// retransmitted on its own, the server puts them back in order
 void *sender_thread(void *arg) {
   sender_args *args = (sender_args *)arg;
-  size_t base = 0;
-  size_t nextsn = 0;
+  // clients started back to back must not share an id, so not from rand()
+  uint32_t session;
+  if (getrandom(&session, sizeof(session), 0) != sizeof(session)) {
+    fprintf(stderr, "getrandom() failed\n");
+    close(args->sockfd);
+    exit(1);
+  }
+
+  // without an MTU given, use the largest packet the path carries
+  int pmtu_auto = args->mtu == 0;
+  int fragmenting = 0; // the path shrank, the kernel fragments packets
+  if (pmtu_auto) {
+    args->mtu = pmtu_discover(args->sockfd, &(args->server_addr), session,
+                              PMTU_MIN, PMTU_MAX, PMTU_PROBE_TRIES,
+                              PMTU_PROBE_TIMEOUT_US, NULL);
+  }
+  // with FEC, parity packets carry the payload length and their own header
+  size_t payload_size = args->mtu - sizeof(packet_header) -
+                        (args->fec_block > 0 ? sizeof(fec_header) + 2 : 0);
+  size_t packet_size = sizeof(packet_header) + payload_size;
+  size_t base = 0;   // oldest packet not yet acknowledged
+  size_t nextsn = 0; // next packet to send
+  size_t rwnd_end = SIZE_MAX; // first packet past the server's window
+  size_t cumulative = 0;      // highest cumulative ACK so far
+  size_t offset = 0;          // of the next DATA payload in the infile
+  uint32_t digest = 0;        // CRC32C of the infile up to offset
+  size_t released = 0;        // infile chunks this replica is done with
+  int fin_sent = 0;
 
   // get local port
   socklen_t len = sizeof(args->client_addr);
@@ -81,63 +926,331 @@ void *sender_thread(void *arg) {
   char rip[INET_ADDRSTRLEN];
   int rport;
 
-  // send outfile path as the first packet
-  ssize_t bytes_sent = sendto(
-      args->sockfd, args->outfile_path, strlen(args->outfile_path) + 1, 0,
-      (struct sockaddr *)&(args->server_addr), sizeof(args->server_addr));
-  if (bytes_sent == -1) {
-    fprintf(stderr, "sendto() failed for outfile path\n");
-    fclose(args->infile);
+  // get remote IP and port
+  inet_ntop(AF_INET, &(args->server_addr.sin_addr), rip, INET_ADDRSTRLEN);
+  rport = ntohs(args->server_addr.sin_port);
+  if (pmtu_auto) {
+    printf("%s, %d, %s, %d, PMTU, %d\n", timestamp(), lport, rip, rport,
+           args->mtu);
+  }
+
+  // with GSO, new packets of the window go out together in one send
+  int gso = 0;
+  int max_segments = 1;
+  if (args->gso) {
+    max_segments = gso_segments(args->sockfd, packet_size);
+    gso = max_segments > 1;
+    if (!gso) {
+      fprintf(stderr, "UDP GSO not supported, sending one datagram at a "
+                      "time\n");
+    }
+  }
+
+  // retransmission deadlines fire on a timerfd, with sub-millisecond
+  // resolution
+  int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (timerfd == -1) {
+    fprintf(stderr, "timerfd_create() failed\n");
     close(args->sockfd);
     exit(1);
   }
+  rto_estimator rto;
+  rto_init(&rto);
+  cc_state cc;
+  cc_init(&cc, args->winsz);
+  size_t logged_window = 0;
+  uint64_t last_ack_us = now_us(); // a short stall mustn't end the transfer
+  pacer pacer;
+  memset(&pacer, 0, sizeof(pacer));
+  pacer.fixed_rate = args->rate;
+  unsigned long long retransmitted = 0;
 
-  while (!feof(args->infile)) {
-    for (size_t i = base; i < base + args->winsz; i++) {
-      char buffer[BUFFER_SIZE];
-      size_t bytes_read = fread(buffer, 1, args->mtu, args->infile);
-      if (bytes_read == 0) {
-        break;
+  fec_encoder fec;
+  memset(&fec, 0, sizeof(fec));
+  fec.block_size = args->fec_block;
+  fec.count = args->fec_parity > 0 ? args->fec_parity : 1;
+  fec.adaptive = args->fec_parity == 0;
+  fec.row_size = 2 + payload_size;
+  for (int j = 0; fec.block_size > 0 && j < FEC_MAX_PARITY; j++) {
+    fec.parity[j] = malloc(args->mtu);
+    if (fec.parity[j] == NULL) {
+      fprintf(stderr, "Error allocating FEC parity\n");
+      exit(1);
+    }
+  }
+
+  // slots only hold headers, payloads are sent straight from the mapping
+  window_slot *slots = calloc(args->winsz, sizeof(window_slot));
+  struct iovec *burst = calloc(2 * max_segments, sizeof(struct iovec));
+  char *ack = malloc(sizeof(packet_header) + sizeof(ack_payload));
+  size_t name_len = strlen(args->outfile_path) + 1;
+  char *name = malloc(sizeof(uint32_t) + name_len);
+  if (slots == NULL || burst == NULL || ack == NULL || name == NULL) {
+    fprintf(stderr, "Error allocating send window\n");
+    exit(1);
+  }
+
+  // the first packet carries the outfile path, the last one is FIN
+  while (!fin_sent || base < nextsn) {
+    int count = 0;
+    // log the congestion window whenever it changes by a whole packet
+    if (cc_window(&cc) != logged_window) {
+      logged_window = cc_window(&cc);
+      printf("%s, %d, %s, %d, CWND, %zu, %.0f\n", timestamp(), lport, rip,
+             rport, logged_window, cc.ssthresh);
+    }
+    pace_update(&pacer, &cc, &rto, args->mtu, now_us());
+    // DATA packet seq carries the bytes from (seq - 1) * payload_size
+    size_t acked = base > 1 ? (base - 1) * payload_size : 0;
+    infile_release(args->infile, &released,
+                   acked < args->infile->size ? acked : args->infile->size);
+
+    // a packet at a time while the server's window is closed, to learn
+    // when it opens
+    while (!fin_sent && nextsn < base + cc_window(&cc) &&
+           (nextsn < rwnd_end || base == nextsn) && pacer.tokens > 0) {
+      window_slot *slot = &slots[nextsn % args->winsz];
+      if (nextsn == 0) {
+        // the server places packet seq at (seq - 1) * payload_size
+        uint32_t chunk = htonl(payload_size);
+        memcpy(name, &chunk, sizeof(chunk));
+        memcpy(name + sizeof(chunk), args->outfile_path, name_len);
+        prepare_slot(slot, session, nextsn, FLAG_NAME, name,
+                     sizeof(chunk) + name_len);
+      } else if (offset == args->infile->size) {
+        // the server checks its replica against the digest in FIN
+        digest = htonl(digest);
+        prepare_slot(slot, session, nextsn, FLAG_FIN, (char *)&digest,
+                     sizeof(digest));
+        fin_sent = 1;
+      } else {
+        size_t bytes = args->infile->size - offset < payload_size
+                           ? args->infile->size - offset
+                           : payload_size;
+        if (fec.block_size > 0 && fec.k == 0) {
+          fec_start_block(&fec, nextsn, retransmitted);
+        }
+        prepare_slot(slot, session, nextsn, FLAG_DATA,
+                     args->infile->data + offset,
+                     bytes);
+        if (fec.block_size > 0) {
+          fec_add(&fec, slot->payload, bytes);
+        }
+        digest = crc32c(digest, slot->payload, bytes);
+        offset += bytes;
+        if (offset % INFILE_CHUNK < bytes) {
+          infile_reached(args->infile, offset); // entered the next chunk
+        }
       }
 
-      ssize_t bytes_sent = sendto(args->sockfd, buffer, bytes_read, 0,
-                                  (struct sockaddr *)&(args->server_addr),
-                                  sizeof(args->server_addr));
-      if (bytes_sent == -1) {
+      slot_iov(slot, &burst[2 * count]);
+      count++;
+      pace_sent(&pacer, sizeof(packet_header) + slot->len);
+      slot->sent_us = now_us();
+      slot->due_us = slot->sent_us + rto.rto_us;
+      printf("%s, %d, %s, %d, DATA, %zu, %zu, %zu, %zu\n", timestamp(), lport,
+             rip, rport, nextsn, base, nextsn, base + cc_window(&cc));
+      nextsn++;
+
+      // only the last packet of a GSO send may be short, and parity goes
+      // out right after the block it covers
+      if (count == max_segments || slot->len < payload_size ||
+          (fec.block_size > 0 && fec.k == fec.block_size)) {
+        break;
+      }
+    }
+    if (count > 0) {
+      if (send_segments(args->sockfd, &(args->server_addr), burst, count,
+                        packet_size, &gso) == -1) {
         fprintf(stderr, "sendto() failed\n");
-        fclose(args->infile);
         close(args->sockfd);
         exit(1);
       }
-
-      // get remote IP and port
-      inet_ntop(AF_INET, &(args->server_addr.sin_addr), rip, INET_ADDRSTRLEN);
-      rport = ntohs(args->server_addr.sin_port);
-
-      printf("%s, %d, %s, %d, DATA, %d, %zu, %zu, %zu\n", timestamp(), lport,
-             rip, rport, *args->pktsn, base, nextsn, base + args->winsz);
-      (*args->pktsn)++;
-      nextsn++;
+      if (fec.k > 0 && (fec.k == fec.block_size || fin_sent)) {
+        if (fec_send(&fec, args->sockfd, &(args->server_addr), session) ==
+            -1) {
+          fprintf(stderr, "sendto() failed\n");
+          close(args->sockfd);
+          exit(1);
+        }
+        printf("%s, %d, %s, %d, PARITY, %u, %d\n", timestamp(), lport, rip,
+               rport, fec.start, fec.count);
+        pace_sent(&pacer, fec.count * args->mtu);
+      }
+      if (!fin_sent && nextsn < base + cc_window(&cc) && nextsn < rwnd_end &&
+          pacer.tokens > 0) {
+        continue; // keep filling the window
+      }
     }
 
-    // send ACK
-    char ack_packet[10] = "ACK";
-    ssize_t bytes_sent = sendto(args->sockfd, ack_packet, strlen(ack_packet), 0,
-                                (struct sockaddr *)&(args->server_addr),
-                                sizeof(args->server_addr));
-    if (bytes_sent == -1) {
-      fprintf(stderr, "sendto() failed\n");
-      fclose(args->infile);
+    // wait for ACKs until the earliest unacknowledged packet times out, or
+    // the pacer lets the next one go
+    uint64_t deadline_us = UINT64_MAX;
+    for (size_t seq = base; seq < nextsn; seq++) {
+      window_slot *slot = &slots[seq % args->winsz];
+      if (!slot->acked && slot->due_us < deadline_us) {
+        deadline_us = slot->due_us;
+      }
+    }
+    if (!fin_sent && nextsn < base + cc_window(&cc) &&
+        (nextsn < rwnd_end || base == nextsn) &&
+        pace_next_us(&pacer) < deadline_us) {
+      deadline_us = pace_next_us(&pacer);
+    }
+    arm_timer(timerfd, deadline_us);
+    struct pollfd pfds[2] = {{args->sockfd, POLLIN, 0}, {timerfd, POLLIN, 0}};
+    if (poll(pfds, 2, -1) == -1) {
+      fprintf(stderr, "poll() failed\n");
       close(args->sockfd);
       exit(1);
     }
+    uint64_t expirations;
+    if (pfds[1].revents & POLLIN) {
+      read(timerfd, &expirations, sizeof(expirations));
+    }
+
+    // ACKs are cumulative, runs of packets past the cumulative one come as
+    // SACK blocks
+    ssize_t bytes_received;
+    while ((bytes_received = recv(args->sockfd, ack,
+                                  sizeof(packet_header) + sizeof(ack_payload),
+                                  MSG_DONTWAIT)) >=
+           (ssize_t)sizeof(packet_header)) {
+      packet_header header;
+      ack_payload payload;
+      memcpy(&header, ack, sizeof(header));
+      uint32_t ack_sn = ntohl(header.seq);
+      size_t len = ntohs(header.len);
+      if (ntohl(header.session) != session ||
+          !(ntohs(header.flags) & FLAG_ACK) || ack_sn > nextsn ||
+          len < sizeof(payload.rwnd) || len > sizeof(payload) ||
+          (size_t)bytes_received < sizeof(header) + len ||
+          ntohl(header.crc) !=
+              packet_crc(&header, ack + sizeof(header), len)) {
+        continue; // stale, for an earlier transfer or corrupt
+      }
+      memcpy(&payload, ack + sizeof(header), len);
+      if (ntohs(header.flags) & FLAG_MISMATCH) {
+        fprintf(stderr, "Replica on %s:%d doesn't match the infile\n", rip,
+                rport);
+        close(args->sockfd);
+        exit(1);
+      }
+
+      last_ack_us = now_us();
+      printf("%s, %d, %s, %d, ACK, %u, %zu, %zu, %zu\n", timestamp(), lport,
+             rip, rport, ack_sn, base, nextsn, base + cc_window(&cc));
+      if (ack_sn >= cumulative) { // ACKs can be reordered too
+        cumulative = ack_sn;
+        rwnd_end = ack_sn + ntohl(payload.rwnd);
+      }
+      uint64_t sample_sent_us = 0;
+      int acked = 0;
+      if (ack_sn > base) {
+        acked += ack_range(slots, args->winsz, base, ack_sn, &sample_sent_us);
+      }
+      int count = (len - sizeof(payload.rwnd)) / (2 * sizeof(uint32_t));
+      for (int i = 0; i < count; i++) {
+        size_t start = ntohl(payload.blocks[2 * i]);
+        size_t end = ntohl(payload.blocks[2 * i + 1]);
+        acked += ack_range(slots, args->winsz, start > base ? start : base,
+                           end < nextsn ? end : nextsn, &sample_sent_us);
+      }
+
+      if (sample_sent_us != 0) {
+        rto_sample(&rto, now_us() - sample_sent_us);
+      }
+      for (int i = 0; i < acked; i++) {
+        args->algorithm->on_ack(&cc, now_us(), rto.srtt_us);
+      }
+      if (cc.cwnd > args->winsz) {
+        cc.cwnd = args->winsz; // don't build up credit past the cap
+      }
+    }
+
+    // slide the window past everything acknowledged
+    while (base < nextsn && slots[base % args->winsz].acked) {
+      base++;
+    }
+
+    // retransmit only the packets that timed out, backing off the RTO
+    // once for each time the timer fires
+    uint64_t current_us = now_us();
+    int backed_off = 0;
+    for (size_t seq = base; seq < nextsn; seq++) {
+      window_slot *slot = &slots[seq % args->winsz];
+      if (slot->acked || current_us < slot->due_us) {
+        continue;
+      }
+      if (!backed_off) {
+        rto_backoff(&rto);
+        backed_off = 1;
+      }
+      // one window reduction per loss event, not per lost packet
+      if (seq >= cc.recovery) {
+        args->algorithm->on_loss(&cc, current_us);
+        cc.recovery = nextsn;
+      }
+      retransmitted++;
+      if (++slot->retransmissions > MAX_RETRANSMISSIONS &&
+          current_us - last_ack_us >= GIVE_UP_US) {
+        fprintf(stderr, "Reached max re-transmission limit\n");
+        close(args->sockfd);
+        exit(1);
+      }
 
-    // log ACK packet
-    printf("%s, %d, %s, %d, ACK, %d, %zu, %zu, %zu\n", timestamp(), lport, rip,
-           rport, *args->pktsn, base, nextsn, base + args->winsz);
+      // a full size packet lost again and again may no longer fit a path
+      // that changed, but packets of this size are in the window and set
+      // the server's chunk size, so if so the kernel fragments them. The
+      // transfer waits meanwhile, so sizes just below the MTU are tried,
+      // once each for an RTO, and any smaller path is left to fragmenting
+      if (pmtu_auto && !fragmenting &&
+          slot->retransmissions == PMTU_REPROBE_RETRANSMISSIONS &&
+          slot->len == payload_size) {
+        int floor = args->mtu * PMTU_REPROBE_FLOOR_PC / 100;
+        int pmtu = pmtu_discover(
+            args->sockfd, &(args->server_addr), session,
+            floor > PMTU_MIN ? floor : PMTU_MIN, args->mtu, PMTU_REPROBE_TRIES,
+            rto.rto_us < PMTU_PROBE_TIMEOUT_US ? rto.rto_us
+                                               : PMTU_PROBE_TIMEOUT_US,
+            &last_ack_us);
+        printf("%s, %d, %s, %d, PMTU, %d\n", timestamp(), lport, rip, rport,
+               pmtu);
+        if (pmtu < args->mtu) {
+          int mode = IP_PMTUDISC_DONT;
+          setsockopt(args->sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &mode,
+                     sizeof(mode));
+          fragmenting = 1;
+        }
+        current_us = now_us();
+      }
+
+      // resent from the mapping, the infile is never read again
+      fprintf(stderr, "%s, Packet loss detected.\n", timestamp());
+      struct iovec iov[2];
+      slot_iov(slot, iov);
+      if (send_packet(args->sockfd, &(args->server_addr), iov) == -1) {
+        fprintf(stderr, "sendto() failed\n");
+        close(args->sockfd);
+        exit(1);
+      }
+      slot->sent_us = current_us;
+      slot->due_us = current_us + rto.rto_us;
+      pace_sent(&pacer, sizeof(packet_header) + slot->len);
+      printf("%s, %d, %s, %d, DATA, %zu, %zu, %zu, %zu\n", timestamp(), lport,
+             rip, rport, seq, base, nextsn, base + cc_window(&cc));
+    }
   }
 
-  fclose(args->infile);
+  infile_release(args->infile, &released, args->infile->size);
+  free(slots);
+  free(name);
+  for (int j = 0; j < FEC_MAX_PARITY; j++) {
+    free(fec.parity[j]);
+  }
+  free(burst);
+  free(ack);
+  close(timerfd);
   close(args->sockfd);
   free(args);
 
@@ -145,16 +1258,9 @@ void *sender_thread(void *arg) {
 }
 
 void send_file(servconf *config) {
-  FILE *infile = fopen(config->infile_path, "rb");
-  if (infile == NULL) {
-    fprintf(stderr, "Error opening input file\n");
-    exit(1);
-  }
-
   int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   if (sockfd == -1) {
     fprintf(stderr, "Socket creation failed\n");
-    fclose(infile);
     exit(1);
   }
 
@@ -165,21 +1271,35 @@ void send_file(servconf *config) {
   server_addr.sin_addr.s_addr = inet_addr(config->server_ip);
   server_addr.sin_port = htons(config->server_port);
 
+  // bind to an ephemeral port now so the sender can log it from the start
+  struct sockaddr_in client_addr;
+  memset(&client_addr, 0, sizeof(client_addr));
+  client_addr.sin_family = AF_INET;
+  client_addr.sin_addr.s_addr = INADDR_ANY;
+  if (bind(sockfd, (struct sockaddr *)&client_addr, sizeof(client_addr)) ==
+      -1) {
+    fprintf(stderr, "Socket bind failed\n");
+    close(sockfd);
+    exit(1);
+  }
+
   // set thread args
   sender_args *thread_args = malloc(sizeof(sender_args));
   thread_args->sockfd = sockfd;
   thread_args->server_addr = server_addr;
   thread_args->outfile_path = config->outfile_path;
-  thread_args->infile = infile;
+  thread_args->infile = config->infile;
   thread_args->mtu = config->mtu;
   thread_args->winsz = config->winsz;
-  thread_args->pktsn = malloc(sizeof(int));
-  *(thread_args->pktsn) = 0;
+  thread_args->gso = config->gso;
+  thread_args->algorithm = config->algorithm;
+  thread_args->fec_block = config->fec_block;
+  thread_args->fec_parity = config->fec_parity;
+  thread_args->rate = config->rate;
 
   pthread_t thread;
   if (pthread_create(&thread, NULL, sender_thread, thread_args) != 0) {
     fprintf(stderr, "Error creating sender thread\n");
-    fclose(infile);
     close(sockfd);
     exit(1);
   }
@@ -206,28 +1326,87 @@ void start_client(servconf *config, int num_servers) {
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 7) {
+  int gso = 0;
+  cc_algorithm *algorithm = &cc_algorithms[0];
+  int fec_block = 0;
+  int fec_parity = 0;
+  double rate = 0;
+  int opt;
+
+  // -g to hand packets of the window to the kernel in one UDP GSO send,
+  // -c to pick the congestion control algorithm, -F K[:M] to follow every K
+  // data packets with M parity packets, M adapting to losses if not given,
+  // -r to pace each server at a fixed rate
+  while ((opt = getopt(argc, argv, "gc:F:r:")) != -1) {
+    switch (opt) {
+    case 'g':
+      gso = 1;
+      break;
+    case 'c':
+      algorithm = cc_find(optarg);
+      if (algorithm == NULL) {
+        fprintf(stderr, "Unknown congestion control: %s (reno, cubic)\n",
+                optarg);
+        exit(1);
+      }
+      break;
+    case 'F':
+      if (sscanf(optarg, "%d:%d", &fec_block, &fec_parity) < 1 ||
+          fec_block < 2 || fec_block > FEC_MAX_BLOCK || fec_parity < 0 ||
+          fec_parity > FEC_MAX_PARITY) {
+        fprintf(stderr, "FEC must be K[:M] with K within: 2-%d, M within: "
+                        "1-%d\n",
+                FEC_MAX_BLOCK, FEC_MAX_PARITY);
+        exit(1);
+      }
+      break;
+    case 'r':
+      rate = atof(optarg) * 1e6 / 8; // Mbit/s to bytes per second
+      if (rate <= 0) {
+        fprintf(stderr, "Invalid pacing rate: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    default:
+      argc = 0; // print usage
+      break;
+    }
+  }
+
+  if (argc - optind != 6) {
     fprintf(stderr,
-            "Usage: %s <Number of Servers> <Server Configuration File> <MTU> "
-            "<Window Size> <Input File Path> <Output File Path>\n",
+            "Usage: %s <Number of Servers> <Server Configuration File> "
+            "<MTU|auto> <Window Size> <Input File Path> <Output File Path> "
+            "[-g] [-c reno|cubic] [-F K[:M]] [-r Mbit/s]\n",
             argv[0]);
     exit(1);
   }
 
-  int num_servers = atoi(argv[1]);
-  char *server_config_file = argv[2];
-  int mtu = atoi(argv[3]);
-  int winsz = atoi(argv[4]);
-  char *infile_path = argv[5];
-  char *outfile_path = argv[6];
+  int num_servers = atoi(argv[optind]);
+  char *server_config_file = argv[optind + 1];
+  char *mtu_arg = argv[optind + 2];
+  int mtu = strcmp(mtu_arg, "auto") == 0 ? 0 : atoi(mtu_arg);
+  int winsz = atoi(argv[optind + 3]);
+  char *infile_path = argv[optind + 4];
+  char *outfile_path = argv[optind + 5];
 
   if (num_servers < 1) {
     fprintf(stderr,
             "Number of servers to replicate infile to must be at least 1\n");
     exit(1);
   }
-  if (mtu < 1) {
-    fprintf(stderr, "MTU must be at least 1\n");
+  // FIN carries a 4 byte digest
+  int overhead = sizeof(packet_header) +
+                 (fec_block > 0 ? sizeof(fec_header) + 2 : 0);
+  if (mtu != 0 && (mtu < overhead + (int)sizeof(uint32_t) ||
+                   mtu > GSO_MAX_BYTES)) {
+    fprintf(stderr, "MTU must be within: %zu-%d\n",
+            overhead + sizeof(uint32_t), GSO_MAX_BYTES);
+    exit(1);
+  }
+  if (sizeof(uint32_t) + strlen(outfile_path) + 1 >
+      (size_t)((mtu != 0 ? mtu : PMTU_MIN) - overhead)) {
+    fprintf(stderr, "Outfile path doesn't fit in one packet\n");
     exit(1);
   }
   if (winsz < 1) {
@@ -235,6 +1414,8 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
+  shared_infile *infile = map_infile(infile_path, num_servers);
+
   FILE *server_config = fopen(server_config_file, "r");
   if (server_config == NULL) {
     fprintf(stderr, "Error opening server configuration file\n");
@@ -249,14 +1430,22 @@ int main(int argc, char *argv[]) {
     validport(config[i].server_port); // check each port
     config[i].mtu = mtu;
     config[i].winsz = winsz;
-    config[i].infile_path = infile_path;
+    config[i].infile = infile;
     config[i].outfile_path = outfile_path;
+    config[i].gso = gso;
+    config[i].algorithm = algorithm;
+    config[i].fec_block = fec_block;
+    config[i].fec_parity = fec_parity;
+    config[i].rate = rate;
   }
   fclose(server_config);
 
+  gf_init();
+  crc32c_init();
   start_client(config, num_servers);
 
   free(config);
+  unmap_infile(infile);
 
   return 0;
 }
@@ -1,18 +1,134 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define BUFFER_SIZE 4096 // KiB
+#define GRO_BUFFER_SIZE 65536 // datagrams coalesced by UDP GRO
+#define REASSEMBLY_BYTES (8 << 20) // out of order packets held per session
+#define FLUSH_BYTES (256 << 10) // in order bytes gathered before a write
+#define MAX_WORKERS 64
+#define SESSION_BUCKETS 1024 // hash table of each worker's sessions
+#define MAX_SESSIONS 4096 // per worker, NAME packets beyond are ignored
+#define SESSION_IDLE_SECONDS 30 // sessions quiet this long are reaped
+#define MAX_SACK_BLOCKS 4 // runs of packets past the cumulative ACK
+#define ACK_EVERY 8 // in order packets acknowledged together by default
+#define ACK_DELAY_US 200 // longest an in order packet waits for its ACK
+#define FEC_MAX_BLOCK 64 // data packets per FEC block
+#define FEC_MAX_PARITY 8 // parity packets per block
+#define FEC_BLOCKS 16 // blocks per session whose parity is kept
 
-// global vars
-char *outfile_name;
-char *outfile_path;
-int *pktsn;
+// packet types
+#define FLAG_NAME 0x1 // seq 0, payload is the chunk size and outfile path
+#define FLAG_DATA 0x2
+#define FLAG_FIN 0x4 // last seq, payload is the CRC32C of the whole file
+#define FLAG_ACK 0x8 // to the client, seq is the next one expected
+#define FLAG_PARITY 0x10 // FEC parity of the block whose first seq is seq
+#define FLAG_MISMATCH 0x20 // on the ACK of FIN, the digest didn't match
+#define FLAG_PROBE 0x40 // MTU probe, seq is its size, echoed with FLAG_ACK
+
+// starts every packet in both directions, fields in network byte order
+typedef struct {
+  uint32_t session; // picked by the client for each transfer
+  uint32_t seq;
+  uint16_t flags;
+  uint16_t len; // payload bytes after the header
+  uint32_t crc; // CRC32C of header and payload, with this field 0
+} packet_header;
+
+// ACK payload, the receive window and then count {start, end} runs of
+// packets received beyond seq, end exclusive, in network byte order
+typedef struct {
+  uint32_t rwnd; // packets past seq the server will accept
+  uint32_t blocks[2 * MAX_SACK_BLOCKS];
+} ack_payload;
+
+// starts the payload of a parity packet, followed by the coded length (2
+// bytes, big endian) and the coded payloads of the block's data packets
+typedef struct {
+  uint8_t k;          // data packets in this block
+  uint8_t block_size; // data packets in every full block
+  uint8_t index;      // parity row
+  uint8_t count;      // parity packets of this block
+} fec_header;
+
+// parity packets received for one FEC block
+typedef struct {
+  uint32_t start; // seq of the block's first packet, 0 if unused
+  int k;
+  int count;
+  uint8_t received[FEC_MAX_PARITY];
+  uint8_t *rows; // FEC_MAX_PARITY rows of 2 + chunk bytes
+} fec_block;
+
+// command line options
+typedef struct {
+  int droppc;
+  char *root_folder;
+  size_t sync_bytes; // fdatasync the outfile after this many, 0 never
+  int ack_every;     // in order packets per ACK
+  int ack_delay_us;  // or this long after the first of them
+} server_opts;
+
+// one transfer, identified by the client's address and session id
+typedef struct session {
+  struct sockaddr_in peer;
+  uint32_t id;
+  int active;        // NAME has been received and the outfile opened
+  time_t last_seen;  // reaped after SESSION_IDLE_SECONDS without packets
+  struct session *next; // in the same hash bucket
+  char outfile_path[BUFFER_SIZE];
+  int fd;            // outfile, open from NAME until FIN is written
+  size_t chunk;      // payload of every DATA packet but the last
+  uint32_t expected; // next seq not in the reassembly buffer yet
+  uint32_t flushed;  // next seq to write to the outfile
+  uint32_t fin_seq;  // 0 until FIN has been received
+  int complete;      // FIN has been written
+  uint32_t highest;  // highest seq received
+  int unacked;         // in order packets not acknowledged yet
+  uint64_t ack_due_us; // when they will be at the latest
+  size_t unsynced;   // bytes written since the last fdatasync
+  uint32_t digest;     // CRC32C of the outfile as far as it is written
+  uint32_t fin_digest; // CRC32C of the infile, from FIN
+  int mismatch;        // they differed when FIN was written
+  int failed;          // the outfile couldn't be written, no more ACKs
+  // reassembly buffer, packet seq at slot seq % slots, payloads chunk bytes
+  // apart so a run of slots is written with one pwrite
+  size_t slots;
+  char *ring;
+  uint8_t *have;
+  uint16_t *lens;
+  // parity of the last FEC_BLOCKS blocks, from the first parity packet on
+  int fec_block_size;
+  fec_block *fec;
+  uint8_t *fec_rows;
+} session;
+
+// receive loop with its own socket and its own sessions, the kernel sends
+// all datagrams of a client to the same worker
+typedef struct {
+  int sockfd;
+  server_opts *opts;
+  unsigned int seed; // for rand_r(), rand() would be shared by all workers
+  session *sessions[SESSION_BUCKETS];
+  int count_sessions;
+  uint64_t ack_due_us; // earliest delayed ACK of all sessions, 0 if none
+  pthread_t thread;
+} worker;
 
 void validport(int port) {
   if (0 <= port && port <= 1023) {
@@ -28,111 +144,855 @@ void validport(int port) {
   return;
 }
 
-int file_exists(const char *filename) {
-  FILE *file;
-  if ((file = fopen(filename, "r"))) {
-    // printf("file: %s exists\n", filename); // debug message
-    fclose(file);
-    return 1;
+// CRC32C (Castagnoli), reflected polynomial, as in iSCSI and ext4
+uint32_t crc32c_table[256];
+int crc32c_hw; // the CPU has SSE4.2
+
+void crc32c_init() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    }
+    crc32c_table[i] = crc;
+  }
+#if defined(__x86_64__)
+  crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+// 8 bytes per crc32 instruction, the odd bytes at the end one at a time
+__attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *data, size_t len) {
+  uint64_t crc64 = crc;
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
   }
-  return 0;
+  crc = crc64;
+  for (; len > 0; data++, len--) {
+    crc = _mm_crc32_u8(crc, *data);
+  }
+  return crc;
 }
+#endif
 
+// continue the CRC32C crc (0 to start) over len more bytes
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+  const uint8_t *bytes = data;
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (crc32c_hw) {
+    return ~crc32c_sse42(crc, bytes, len);
+  }
+#endif
+  for (size_t i = 0; i < len; i++) {
+    crc = crc32c_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// CRC32C of a packet with its crc field 0, header in network byte order
+uint32_t packet_crc(const packet_header *header, const void *payload,
+                    size_t len) {
+  packet_header zeroed = *header;
+  zeroed.crc = 0;
+  return crc32c(crc32c(0, &zeroed, sizeof(zeroed)), payload, len);
+}
+
+// GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1, for Reed-Solomon
+uint8_t gf_exp[512];
+uint8_t gf_log[256];
+int gf_simd; // the CPU has SSSE3
+
+void gf_init() {
+  int x = 1;
+  for (int i = 0; i < 255; i++) {
+    gf_exp[i] = x;
+    gf_log[x] = i;
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= 0x11d;
+    }
+  }
+  for (int i = 255; i < 512; i++) {
+    gf_exp[i] = gf_exp[i - 255];
+  }
+#if defined(__x86_64__)
+  gf_simd = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+uint8_t gf_mul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0) {
+    return 0;
+  }
+  return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+uint8_t gf_inv(uint8_t a) { return gf_exp[255 - gf_log[a]]; }
+
+#if defined(__x86_64__)
+// dst ^= c * src 16 bytes at a time, the product of every byte is looked up
+// by its low and its high nibble with PSHUFB, returns the bytes done
+__attribute__((target("ssse3"))) size_t
+gf_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  uint8_t low[16];
+  uint8_t high[16];
+  for (int i = 0; i < 16; i++) {
+    low[i] = gf_mul(c, i);
+    high[i] = gf_mul(c, i << 4);
+  }
+  __m128i table_low = _mm_loadu_si128((const __m128i *)low);
+  __m128i table_high = _mm_loadu_si128((const __m128i *)high);
+  __m128i mask = _mm_set1_epi8(0x0f);
+
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i product = _mm_xor_si128(
+        _mm_shuffle_epi8(table_low, _mm_and_si128(v, mask)),
+        _mm_shuffle_epi8(table_high,
+                         _mm_and_si128(_mm_srli_epi64(v, 4), mask)));
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, product));
+  }
+  return i;
+}
+#endif
+
+// dst ^= c * src over len bytes
+void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  size_t i = 0;
+  if (c == 0) {
+    return;
+  }
+  if (c == 1) { // plain XOR, which the compiler vectorizes
+    for (; i < len; i++) {
+      dst[i] ^= src[i];
+    }
+    return;
+  }
+#if defined(__x86_64__)
+  if (gf_simd) {
+    i = gf_mul_add_ssse3(dst, src, c, len);
+  }
+#endif
+  for (; i < len; i++) {
+    dst[i] ^= gf_mul(c, src[i]);
+  }
+}
+
+// coefficient of data packet i in parity row j, all ones (XOR) with a
+// single parity packet, otherwise a Cauchy matrix, every square part of
+// which can be inverted
+uint8_t fec_coef(int j, int i, int count) {
+  return count == 1 ? 1 : gf_inv(j ^ (FEC_MAX_PARITY + i));
+}
+
+uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// every worker logs, so each thread formats into its own buffer
 char *timestamp() {
   time_t rawtime;
-  struct tm *timeinfo;
-  static char timestamp[30];
+  struct tm timeinfo;
+  static __thread char timestamp[30];
   time(&rawtime);
-  timeinfo = localtime(&rawtime);
-  strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", timeinfo);
+  localtime_r(&rawtime, &timeinfo);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &timeinfo);
 
   return timestamp;
 }
 
-void process_packet(int sockfd, struct sockaddr_in *client_addr,
-                    socklen_t addr_len, int droppc, char *root_folder) {
-  char buffer[BUFFER_SIZE];
+// write every packet that is in order and buffered to the outfile, in runs
+// of consecutive slots, returns -1 if the outfile couldn't be written
+int flush_session(session *s, server_opts *opts) {
+  while (s->flushed < s->expected) {
+    size_t start = s->flushed % s->slots;
+    size_t count = s->expected - s->flushed;
+    if (count > s->slots - start) {
+      count = s->slots - start; // up to the end of the ring
+    }
+    size_t bytes = 0; // all full but the last DATA packet, FIN is empty
+    for (size_t i = start; i < start + count; i++) {
+      bytes += s->lens[i];
+    }
+    off_t offset = (off_t)(s->flushed - 1) * s->chunk;
+    if (bytes > 0 && pwrite(s->fd, s->ring + start * s->chunk, bytes,
+                            offset) != (ssize_t)bytes) {
+      fprintf(stderr, "Error writing output file\n");
+      return -1;
+    }
+    s->digest = crc32c(s->digest, s->ring + start * s->chunk, bytes);
+    memset(s->have + start, 0, count);
+    s->flushed += count;
+    s->unsynced += bytes;
+  }
 
-  // receive packet from client
-  ssize_t bytes_received = recvfrom(sockfd, buffer, BUFFER_SIZE, 0,
-                                    (struct sockaddr *)client_addr, &addr_len);
-  if (bytes_received == -1) {
-    fprintf(stderr, "recvfrom() failed\n");
+  if (opts->sync_bytes > 0 &&
+      (s->unsynced >= opts->sync_bytes || (s->complete && s->unsynced > 0))) {
+    if (fdatasync(s->fd) == -1) {
+      fprintf(stderr, "Error syncing output file\n");
+      return -1;
+    }
+    s->unsynced = 0;
+  }
+  return 0;
+}
+
+// close the outfile and release the reassembly buffer
+void end_session(session *s) {
+  if (s->fd != -1) {
+    close(s->fd);
+    s->fd = -1;
+  }
+  free(s->ring);
+  free(s->have);
+  free(s->lens);
+  free(s->fec);
+  free(s->fec_rows);
+  s->ring = NULL;
+  s->have = NULL;
+  s->lens = NULL;
+  s->fec = NULL;
+  s->fec_rows = NULL;
+}
+
+// start writing the outfile under the root folder, NAME carries the chunk
+// size and then the outfile path
+void start_session(session *s, server_opts *opts, const char *payload,
+                   size_t len) {
+  uint32_t chunk;
+  if (len <= sizeof(chunk)) {
+    return;
+  }
+  memcpy(&chunk, payload, sizeof(chunk));
+  chunk = ntohl(chunk);
+  if (chunk == 0 || chunk > UINT16_MAX) {
     return;
   }
+  const char *name = payload + sizeof(chunk);
+  len -= sizeof(chunk);
 
-  // log received packet
-  printf("%s, %d, %s, %d, DATA, %d\n", timestamp(),
-         ntohs(client_addr->sin_port), inet_ntoa(client_addr->sin_addr),
-         ntohs(client_addr->sin_port), *pktsn);
-
-  // process first packet (contains outfile path)
-  if (*pktsn == 0) {
-    strncpy(outfile_name, buffer, bytes_received);
-    snprintf(outfile_path, BUFFER_SIZE, "%s/%s", root_folder, buffer);
-    // printf("Outfile name: %s\n", outfile_name); // debug message
-    // printf("Output file path received: %s\n", outfile_path); // debug message
-  } else {
-    // droppc is applied for subsequent packets
-    srand(time(NULL));
-    int chance = rand() % 100;
-    int should_drop = (chance) < droppc;
-    // printf("rand() %% 100 = %d\n", chance); // debug message
-
-    // log dropped packet
-    if (should_drop) {
-      if (buffer[0] == 'A') {
-        printf("%s, %d, %s, %d, DROP ACK, %d\n", timestamp(),
-               ntohs(client_addr->sin_port), inet_ntoa(client_addr->sin_addr),
-               ntohs(client_addr->sin_port), *pktsn);
-      } else {
-        printf("%s, %d, %s, %d, DROP DATA, %d\n", timestamp(),
-               ntohs(client_addr->sin_port), inet_ntoa(client_addr->sin_addr),
-               ntohs(client_addr->sin_port), *pktsn);
+  s->active = 1;
+  s->chunk = chunk;
+  s->expected = 1;
+  s->flushed = 1;
+  s->fin_seq = 0;
+  s->complete = 0;
+  s->highest = 0;
+  s->unacked = 0;
+  s->unsynced = 0;
+  s->digest = 0;
+  s->mismatch = 0;
+  snprintf(s->outfile_path, sizeof(s->outfile_path), "%s/%.*s",
+           opts->root_folder, (int)strnlen(name, len), name);
+
+  s->slots = REASSEMBLY_BYTES / chunk;
+  s->ring = malloc(s->slots * chunk);
+  s->have = calloc(s->slots, 1);
+  s->lens = calloc(s->slots, sizeof(uint16_t));
+  if (s->ring == NULL || s->have == NULL || s->lens == NULL) {
+    fprintf(stderr, "Error allocating reassembly buffer\n");
+    exit(1);
+  }
+
+  // the outfile stays open for the whole transfer, truncated once here
+  s->fd = open(s->outfile_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (s->fd == -1) {
+    fprintf(stderr, "Error opening output file\n");
+    end_session(s);
+    s->active = 0; // NAME isn't acknowledged, the client tries again
+  }
+}
+
+// put a DATA or FIN packet in the reassembly buffer, and write out what
+// is in order once there is enough of it
+void store_packet(session *s, server_opts *opts,
+                  struct sockaddr_in *client_addr, uint32_t seq,
+                  uint16_t flags, const char *payload, size_t len) {
+  size_t slot = seq % s->slots;
+  if (s->have[slot]) {
+    return; // duplicate
+  }
+  memcpy(s->ring + slot * s->chunk, payload, len);
+  s->lens[slot] = len;
+  s->have[slot] = 1;
+  if (seq > s->highest) {
+    s->highest = seq;
+  }
+  if (flags & FLAG_FIN) {
+    s->fin_seq = seq;
+  }
+
+  while (s->expected - s->flushed < s->slots &&
+         s->have[s->expected % s->slots] && s->expected != s->fin_seq) {
+    s->expected++;
+  }
+  if (s->fin_seq != 0 && s->expected == s->fin_seq) {
+    s->expected++; // FIN only ends the run, it has no bytes
+    s->complete = 1;
+  }
+
+  // coalesce writes, unless the buffer is filling up
+  int written = 0;
+  if (s->complete || (s->expected - s->flushed) * s->chunk >= FLUSH_BYTES ||
+      s->expected - s->flushed >= s->slots / 2) {
+    written = flush_session(s, opts);
+  }
+  if (written == -1 && !s->complete) {
+    // only this transfer ends, its client gives up once nothing is
+    // acknowledged anymore
+    printf("%s, %d, %s, %d, ERROR, %s\n", timestamp(),
+           ntohs(client_addr->sin_port), inet_ntoa(client_addr->sin_addr),
+           ntohs(client_addr->sin_port), s->outfile_path);
+    end_session(s);
+    s->failed = 1;
+    s->unacked = 0;
+    return;
+  }
+  if (s->complete) {
+    // the digest was computed while writing, the outfile isn't read back,
+    // and one that didn't reach the disk is a bad replica too
+    s->mismatch = written == -1 || s->digest != s->fin_digest;
+    printf("%s, %d, %s, %d, %s, %s\n", timestamp(),
+           ntohs(client_addr->sin_port), inet_ntoa(client_addr->sin_addr),
+           ntohs(client_addr->sin_port), s->mismatch ? "MISMATCH" : "COMPLETE",
+           s->outfile_path);
+    end_session(s);
+  }
+}
+
+// rebuild the packets of a block that are missing from the reassembly
+// buffer, if there is a parity packet for each of them, returns how many
+int fec_recover(session *s, server_opts *opts, struct sockaddr_in *client_addr,
+                fec_block *b) {
+  size_t row_size = 2 + s->chunk;
+  if (s->have == NULL || s->highest >= b->start + s->slots) {
+    return 0; // finished, or packets of the block have been overwritten
+  }
+
+  int missing[FEC_MAX_PARITY];
+  int count_missing = 0;
+  for (int i = 0; i < b->k; i++) {
+    uint32_t seq = b->start + i;
+    if (seq < s->expected || s->have[seq % s->slots]) {
+      continue;
+    }
+    if (count_missing == b->count || seq >= s->flushed + s->slots) {
+      return 0; // more lost than parity can cover
+    }
+    missing[count_missing++] = i;
+  }
+  if (count_missing == 0) {
+    b->start = 0;
+    return 0;
+  }
+  int rows[FEC_MAX_PARITY];
+  int count_rows = 0;
+  for (int j = 0; j < b->count && count_rows < count_missing; j++) {
+    if (b->received[j]) {
+      rows[count_rows++] = j;
+    }
+  }
+  if (count_rows < count_missing) {
+    return 0; // wait for more parity or data
+  }
+
+  // take the packets that did arrive out of the parity rows, which leaves
+  // the missing ones times their coefficients
+  uint8_t *syndromes = malloc(count_missing * row_size);
+  uint8_t *packet = malloc(row_size);
+  if (syndromes == NULL || packet == NULL) {
+    fprintf(stderr, "Error allocating FEC buffers\n");
+    exit(1);
+  }
+  for (int r = 0; r < count_missing; r++) {
+    uint8_t *syndrome = syndromes + r * row_size;
+    memcpy(syndrome, b->rows + rows[r] * row_size, row_size);
+    for (int i = 0, m = 0; i < b->k; i++) {
+      if (m < count_missing && missing[m] == i) {
+        m++;
+        continue;
       }
-      return;
+      size_t slot = (b->start + i) % s->slots;
+      uint8_t coded_len[2] = {s->lens[slot] >> 8, s->lens[slot] & 0xff};
+      uint8_t c = fec_coef(rows[r], i, b->count);
+      gf_mul_add(syndrome, coded_len, c, sizeof(coded_len));
+      gf_mul_add(syndrome + sizeof(coded_len),
+                 (const uint8_t *)s->ring + slot * s->chunk, c, s->lens[slot]);
     }
+  }
 
-    // truncate outfile before server appends to it
-    if (strcmp(buffer, outfile_name) == 0 && file_exists(outfile_path)) {
-      // printf("output file: %s\n", outfile_path); // debug message
-      if (truncate(outfile_path, 0) == -1) {
-        fprintf(stderr, "Error truncating output file\n");
-        exit(1);
+  // invert the coefficients of the missing packets by Gauss-Jordan
+  // elimination, the right half of matrix ends up as the inverse
+  uint8_t matrix[FEC_MAX_PARITY][2 * FEC_MAX_PARITY];
+  int n = count_missing;
+  for (int r = 0; r < n; r++) {
+    for (int c = 0; c < n; c++) {
+      matrix[r][c] = fec_coef(rows[r], missing[c], b->count);
+      matrix[r][n + c] = r == c;
+    }
+  }
+  for (int c = 0; c < n; c++) {
+    int pivot = c;
+    while (matrix[pivot][c] == 0) {
+      pivot++; // there always is one, every square part of Cauchy inverts
+    }
+    for (int i = 0; i < 2 * n; i++) {
+      uint8_t t = matrix[c][i];
+      matrix[c][i] = matrix[pivot][i];
+      matrix[pivot][i] = t;
+    }
+    uint8_t scale = gf_inv(matrix[c][c]);
+    for (int i = 0; i < 2 * n; i++) {
+      matrix[c][i] = gf_mul(matrix[c][i], scale);
+    }
+    for (int r = 0; r < n; r++) {
+      uint8_t factor = matrix[r][c];
+      if (r == c || factor == 0) {
+        continue;
+      }
+      for (int i = 0; i < 2 * n; i++) {
+        matrix[r][i] ^= gf_mul(factor, matrix[c][i]);
+      }
+    }
+  }
+
+  int recovered = 0;
+  uint32_t start = b->start;
+  for (int m = 0; m < n; m++) {
+    memset(packet, 0, row_size);
+    for (int r = 0; r < n; r++) {
+      gf_mul_add(packet, syndromes + r * row_size, matrix[m][n + r], row_size);
+    }
+    size_t len = packet[0] << 8 | packet[1];
+    if (len > s->chunk) {
+      break; // parity of a different transfer or corrupted
+    }
+    uint32_t seq = start + missing[m];
+    printf("%s, %d, %s, %d, RECOVER, %u\n", timestamp(),
+           ntohs(client_addr->sin_port), inet_ntoa(client_addr->sin_addr),
+           ntohs(client_addr->sin_port), seq);
+    recovered++;
+    store_packet(s, opts, client_addr, seq, FLAG_DATA, (char *)packet + 2, len);
+    if (s->have == NULL) {
+      break; // that completed the transfer
+    }
+  }
+  if (s->have != NULL) {
+    b->start = 0;
+  }
+  free(syndromes);
+  free(packet);
+  return recovered;
+}
+
+// keep a parity packet of the block starting at seq start and try to
+// recover the block with it, returns how many packets were recovered
+int fec_parity(session *s, server_opts *opts, struct sockaddr_in *client_addr,
+               uint32_t start, const char *payload, size_t len) {
+  fec_header fh;
+  size_t row_size = 2 + s->chunk;
+  if (len != sizeof(fh) + row_size || start == 0) {
+    return 0;
+  }
+  memcpy(&fh, payload, sizeof(fh));
+  if (fh.block_size < 2 || fh.block_size > FEC_MAX_BLOCK || fh.k < 1 ||
+      fh.k > fh.block_size || fh.count < 1 || fh.count > FEC_MAX_PARITY ||
+      fh.index >= fh.count || start + fh.k <= s->expected) {
+    return 0; // malformed, or for packets already in order
+  }
+
+  if (s->fec == NULL) {
+    s->fec = calloc(FEC_BLOCKS, sizeof(fec_block));
+    s->fec_rows = malloc(FEC_BLOCKS * FEC_MAX_PARITY * row_size);
+    if (s->fec == NULL || s->fec_rows == NULL) {
+      fprintf(stderr, "Error allocating FEC buffers\n");
+      exit(1);
+    }
+    for (int i = 0; i < FEC_BLOCKS; i++) {
+      s->fec[i].rows = s->fec_rows + i * FEC_MAX_PARITY * row_size;
+    }
+  }
+  s->fec_block_size = fh.block_size;
+
+  fec_block *b = &s->fec[(start - 1) / fh.block_size % FEC_BLOCKS];
+  if (b->start != start || b->count != fh.count) {
+    b->start = start;
+    b->k = fh.k;
+    b->count = fh.count;
+    memset(b->received, 0, sizeof(b->received));
+  }
+  memcpy(b->rows + fh.index * row_size, payload + sizeof(fh), row_size);
+  b->received[fh.index] = 1;
+  return fec_recover(s, opts, client_addr, b);
+}
+
+// after a DATA packet, see if its block can now be recovered with the
+// parity that came before it
+int fec_data(session *s, server_opts *opts, struct sockaddr_in *client_addr,
+             uint32_t seq) {
+  if (s->have == NULL || s->fec == NULL) {
+    return 0;
+  }
+  uint32_t block = (seq - 1) / s->fec_block_size;
+  fec_block *b = &s->fec[block % FEC_BLOCKS];
+  if (b->start != block * s->fec_block_size + 1) {
+    return 0;
+  }
+  return fec_recover(s, opts, client_addr, b);
+}
+
+session **session_bucket(worker *w, struct sockaddr_in *peer, uint32_t id) {
+  uint32_t hash = (peer->sin_addr.s_addr ^ ((uint32_t)peer->sin_port << 16) ^
+                   id) *
+                  2654435761u;
+  return &w->sessions[hash % SESSION_BUCKETS];
+}
+
+session *find_session(worker *w, struct sockaddr_in *peer, uint32_t id) {
+  for (session *s = *session_bucket(w, peer, id); s != NULL; s = s->next) {
+    if (s->id == id && s->peer.sin_addr.s_addr == peer->sin_addr.s_addr &&
+        s->peer.sin_port == peer->sin_port) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+session *new_session(worker *w, struct sockaddr_in *peer, uint32_t id) {
+  if (w->count_sessions >= MAX_SESSIONS) {
+    return NULL;
+  }
+  session *s = calloc(1, sizeof(session));
+  if (s == NULL) {
+    return NULL;
+  }
+  s->peer = *peer;
+  s->id = id;
+  s->fd = -1;
+  session **bucket = session_bucket(w, peer, id);
+  s->next = *bucket;
+  *bucket = s;
+  w->count_sessions++;
+  return s;
+}
+
+// drop sessions that have been quiet too long, finished ones are kept
+// until then only to acknowledge retransmissions of their last packets
+void reap_sessions(worker *w, time_t now) {
+  for (int i = 0; i < SESSION_BUCKETS; i++) {
+    session **link = &w->sessions[i];
+    while (*link != NULL) {
+      session *s = *link;
+      if (now - s->last_seen < SESSION_IDLE_SECONDS) {
+        link = &s->next;
+        continue;
+      }
+      if (s->active && !s->complete) {
+        flush_session(s, w->opts);
+        printf("%s, %d, %s, %d, TIMEOUT, %s\n", timestamp(),
+               ntohs(s->peer.sin_port), inet_ntoa(s->peer.sin_addr),
+               ntohs(s->peer.sin_port), s->outfile_path);
       }
+      end_session(s);
+      *link = s->next;
+      free(s);
+      w->count_sessions--;
     }
+  }
+}
 
-    // write buffered data to outfile path (but not first packet)
-    if (strcmp(buffer, outfile_name) != 0 && strstr(buffer, "ACK") == NULL) {
-      // printf("buffer: %s\n", buffer); // debug message
-      // printf("outfile path: %s\n", outfile_path); // debug message
-      FILE *outfile = fopen(outfile_path, "ab"); // append bytes mode
-      if (outfile == NULL) {
-        fprintf(stderr, "Error opening output file\n");
-        return;
+// acknowledge everything below expected, and the runs of packets buffered
+// past it
+void send_ack(worker *w, session *s) {
+  packet_header header;
+  ack_payload payload;
+  int count = 0;
+  payload.rwnd = 0; // finished
+  if (s->have != NULL) {
+    for (uint32_t seq = s->expected + 1;
+         seq <= s->highest && count < MAX_SACK_BLOCKS; seq++) {
+      if (!s->have[seq % s->slots] || s->have[(seq - 1) % s->slots]) {
+        continue; // not the start of a run
       }
-      fwrite(buffer, 1, bytes_received, outfile);
-      fclose(outfile);
+      uint32_t end = seq;
+      while (end <= s->highest && s->have[end % s->slots]) {
+        end++;
+      }
+      payload.blocks[2 * count] = htonl(seq);
+      payload.blocks[2 * count + 1] = htonl(end);
+      count++;
+      seq = end;
     }
+    payload.rwnd = htonl(s->flushed + s->slots - s->expected);
   }
 
-  // send ACK to client for the received packet
-  ssize_t bytes_sent = sendto(sockfd, pktsn, sizeof(*pktsn), 0,
-                              (struct sockaddr *)client_addr, addr_len);
+  size_t len = sizeof(payload.rwnd) + 2 * count * sizeof(uint32_t);
+  header.session = htonl(s->id);
+  header.seq = htonl(s->expected);
+  header.flags = htons(FLAG_ACK | (s->mismatch ? FLAG_MISMATCH : 0));
+  header.len = htons(len);
+  header.crc = htonl(packet_crc(&header, &payload, len));
+  char packet[sizeof(header) + sizeof(payload)];
+  memcpy(packet, &header, sizeof(header));
+  memcpy(packet + sizeof(header), &payload, len);
+
+  s->unacked = 0;
+  ssize_t bytes_sent = sendto(w->sockfd, packet, sizeof(header) + len, 0,
+                              (struct sockaddr *)&s->peer, sizeof(s->peer));
   if (bytes_sent == -1) {
     fprintf(stderr, "sendto() failed\n");
     return;
   }
 
   // log ACK packet
-  printf("%s, %d, %s, %d, ACK, %d\n", timestamp(), ntohs(client_addr->sin_port),
-         inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port),
-         *pktsn);
+  printf("%s, %d, %s, %d, ACK, %u\n", timestamp(), ntohs(s->peer.sin_port),
+         inet_ntoa(s->peer.sin_addr), ntohs(s->peer.sin_port), s->expected);
+}
+
+// send the delayed ACKs that are due, and find when the next one is
+void send_due_acks(worker *w, uint64_t now) {
+  w->ack_due_us = 0;
+  for (int i = 0; i < SESSION_BUCKETS; i++) {
+    for (session *s = w->sessions[i]; s != NULL; s = s->next) {
+      if (s->unacked > 0 && s->ack_due_us <= now) {
+        send_ack(w, s);
+      } else if (s->unacked > 0 &&
+                 (w->ack_due_us == 0 || s->ack_due_us < w->ack_due_us)) {
+        w->ack_due_us = s->ack_due_us;
+      }
+    }
+  }
+}
+
+// echo an MTU probe in a bare header, the client only needs to know that
+// it arrived
+void send_probe_ack(worker *w, struct sockaddr_in *client_addr,
+                    packet_header *probe) {
+  packet_header header = *probe;
+  header.flags = htons(FLAG_PROBE | FLAG_ACK);
+  header.len = 0;
+  header.crc = htonl(packet_crc(&header, NULL, 0));
+  if (sendto(w->sockfd, &header, sizeof(header), 0,
+             (struct sockaddr *)client_addr, sizeof(*client_addr)) == -1) {
+    fprintf(stderr, "sendto() failed\n");
+  }
+}
+
+void process_packet(worker *w, struct sockaddr_in *client_addr, char *buffer,
+                    ssize_t bytes_received) {
+  packet_header header;
+  if (bytes_received < (ssize_t)sizeof(header)) {
+    return;
+  }
+  memcpy(&header, buffer, sizeof(header));
+  uint32_t id = ntohl(header.session);
+  uint32_t seq = ntohl(header.seq);
+  uint16_t flags = ntohs(header.flags);
+  size_t len = ntohs(header.len);
+  char *payload = buffer + sizeof(header);
+  if (len > bytes_received - sizeof(header)) {
+    return; // truncated
+  }
+  server_opts *opts = w->opts;
+
+  // log received packet, MTU probes apart from the transfer
+  printf("%s, %d, %s, %d, %s, %u\n", timestamp(),
+         ntohs(client_addr->sin_port), inet_ntoa(client_addr->sin_addr),
+         ntohs(client_addr->sin_port),
+         (flags & FLAG_PROBE) ? "PROBE" : "DATA", seq);
+
+  // a corrupt packet is dropped like a lost one, the client resends it
+  if (ntohl(header.crc) != packet_crc(&header, payload, len)) {
+    printf("%s, %d, %s, %d, CORRUPT, %u\n", timestamp(),
+           ntohs(client_addr->sin_port), inet_ntoa(client_addr->sin_addr),
+           ntohs(client_addr->sin_port), seq);
+    return;
+  }
+
+  // droppc is applied to every packet but the outfile path and MTU probes,
+  // which would otherwise make the path look smaller than it is
+  int should_drop = !(flags & (FLAG_NAME | FLAG_PROBE)) &&
+                    rand_r(&w->seed) % 100 < opts->droppc;
+  if (should_drop) {
+    printf("%s, %d, %s, %d, DROP DATA, %u\n", timestamp(),
+           ntohs(client_addr->sin_port), inet_ntoa(client_addr->sin_addr),
+           ntohs(client_addr->sin_port), seq);
+    return;
+  }
+
+  if (flags & FLAG_PROBE) { // needs no session
+    send_probe_ack(w, client_addr, &header);
+    return;
+  }
+
+  session *s = find_session(w, client_addr, id);
+  if (s == NULL && (flags & FLAG_NAME)) {
+    s = new_session(w, client_addr, id);
+    if (s == NULL) {
+      return; // too many sessions, the client will resend
+    }
+  }
+  if (s == NULL) {
+    return; // the outfile path hasn't arrived yet, the client will resend
+  }
+  s->last_seen = time(NULL);
+  if (s->failed) {
+    return; // the outfile couldn't be written, the transfer is over
+  }
+
+  if (flags & FLAG_NAME) {
+    if (!s->active) {
+      start_session(s, opts, payload, len);
+    }
+    if (!s->active) {
+      return; // malformed, or the outfile can't be opened
+    }
+  } else if (!s->active) {
+    return; // the outfile path hasn't arrived yet, the client will resend
+  } else if (flags & FLAG_PARITY) {
+    // parity isn't acknowledged, but what it recovers is right away
+    if (!s->complete &&
+        fec_parity(s, opts, client_addr, seq, payload, len) > 0 &&
+        !s->failed) {
+      send_ack(w, s);
+    }
+    return;
+  } else if (seq >= s->flushed + s->slots) {
+    return; // too far ahead to buffer, the client will resend
+  } else if (flags & FLAG_FIN) {
+    // the digest may be longer than a chunk with a tiny MTU
+    if (len != sizeof(s->fin_digest)) {
+      return;
+    }
+    memcpy(&s->fin_digest, payload, sizeof(s->fin_digest));
+    s->fin_digest = ntohl(s->fin_digest);
+    len = 0; // not part of the outfile
+  } else if (len > s->chunk) {
+    return;
+  }
+
+  uint32_t expected = s->expected;
+  int recovered = 0;
+  if (!(flags & FLAG_NAME) && seq >= expected && !s->complete) {
+    store_packet(s, opts, client_addr, seq, flags, payload, len);
+    if (flags & FLAG_DATA) {
+      recovered = fec_data(s, opts, client_addr, seq);
+    }
+    if (s->failed) {
+      return;
+    }
+  } // below expected it's a duplicate of a written packet, ACK it again
 
-  (*pktsn)++;
+  // in order packets are acknowledged together, anything the client should
+  // hear about soon (the start and end of the transfer, gaps, duplicates,
+  // packets recovered with FEC) right away
+  int in_order = (flags & FLAG_DATA) && seq == expected && !s->complete &&
+                 s->expected > s->highest && !recovered;
+  if (!in_order || ++s->unacked >= opts->ack_every) {
+    send_ack(w, s);
+  } else if (s->unacked == 1) {
+    s->ack_due_us = now_us() + opts->ack_delay_us;
+    if (w->ack_due_us == 0 || s->ack_due_us < w->ack_due_us) {
+      w->ack_due_us = s->ack_due_us;
+    }
+  }
 }
 
-void start_server(int port, int droppc, char *root_folder) {
+// receive one datagram, or with UDP GRO a run of datagrams from the same
+// client that the kernel coalesced, and process each of them in turn
+void receive_packets(worker *w, struct sockaddr_in *client_addr,
+                     socklen_t addr_len, char *buffer) {
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {buffer, GRO_BUFFER_SIZE};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = client_addr;
+  msg.msg_namelen = addr_len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  // receive packets from client
+  ssize_t bytes_received = recvmsg(w->sockfd, &msg, 0);
+  if (bytes_received == -1) {
+    fprintf(stderr, "recvfrom() failed\n");
+    return;
+  }
+
+  // coalesced datagrams all have the segment size, except maybe the last
+  ssize_t segment_size = bytes_received;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int gso_size;
+      memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+      segment_size = gso_size;
+    }
+  }
+
+  ssize_t offset = 0;
+  do {
+    ssize_t len = bytes_received - offset < segment_size
+                      ? bytes_received - offset
+                      : segment_size;
+    process_packet(w, client_addr, buffer + offset, len);
+    offset += len;
+  } while (offset < bytes_received);
+}
+
+void *worker_loop(void *arg) {
+  worker *w = (worker *)arg;
+  struct sockaddr_in client_addr;
+  socklen_t addr_len = sizeof(client_addr);
+  char *buffer = malloc(GRO_BUFFER_SIZE);
+  if (buffer == NULL) {
+    fprintf(stderr, "Error allocating receive buffer\n");
+    exit(1);
+  }
+
+  // process incoming packets one at a time, send delayed ACKs when they
+  // are due and look for idle sessions every second
+  time_t last_reap = time(NULL);
+  while (1) {
+    struct timespec wait = {1, 0};
+    if (w->ack_due_us != 0) {
+      uint64_t current_us = now_us();
+      uint64_t left_us =
+          w->ack_due_us > current_us ? w->ack_due_us - current_us : 0;
+      wait.tv_sec = left_us / 1000000;
+      wait.tv_nsec = (left_us % 1000000) * 1000;
+    }
+    struct pollfd pfd = {w->sockfd, POLLIN, 0};
+    if (ppoll(&pfd, 1, &wait, NULL) > 0) {
+      receive_packets(w, &client_addr, addr_len, buffer);
+    }
+    if (w->ack_due_us != 0 && now_us() >= w->ack_due_us) {
+      send_due_acks(w, now_us());
+    }
+    time_t now = time(NULL);
+    if (now != last_reap) {
+      reap_sessions(w, now);
+      last_reap = now;
+    }
+  }
+
+  free(buffer);
+  return NULL;
+}
+
+// every worker binds its own socket to the port, the kernel spreads clients
+// across them by hashing the addresses
+int create_socket(int port, int reuseport) {
   // create socket file descriptor
   int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   if (sockfd == -1) {
@@ -140,6 +1000,13 @@ void start_server(int port, int droppc, char *root_folder) {
     exit(1);
   }
 
+  int on = 1;
+  if (reuseport &&
+      setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+    fprintf(stderr, "SO_REUSEPORT not supported\n");
+    exit(1);
+  }
+
   // initialize server address structure
   struct sockaddr_in server_addr;
   memset(&server_addr, 0, sizeof(server_addr));
@@ -155,52 +1022,111 @@ void start_server(int port, int droppc, char *root_folder) {
     exit(1);
   }
 
-  printf("Server listening on port: %d\n", port);
+  // let the kernel coalesce datagrams of a flow (GSO senders on loopback
+  // arrive in one piece), if it can't they just arrive one at a time
+  setsockopt(sockfd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on));
 
-  struct sockaddr_in client_addr;
-  socklen_t addr_len = sizeof(client_addr);
+  return sockfd;
+}
 
-  // process incoming packets one at a time
-  while (1) {
-    process_packet(sockfd, &client_addr, addr_len, droppc, root_folder);
+void start_server(int port, server_opts *opts, int count_workers) {
+  worker *workers = calloc(count_workers, sizeof(worker));
+  if (workers == NULL) {
+    fprintf(stderr, "Error allocating workers\n");
+    exit(1);
+  }
+  for (int i = 0; i < count_workers; i++) {
+    workers[i].sockfd = create_socket(port, count_workers > 1);
+    workers[i].opts = opts;
+    workers[i].seed = rand();
+  }
+
+  printf("Server listening on port: %d\n", port);
+
+  for (int i = 0; i < count_workers; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) !=
+        0) {
+      fprintf(stderr, "Error creating worker thread\n");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < count_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+    close(workers[i].sockfd);
   }
 
-  close(sockfd);
+  free(workers);
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 4) {
+  server_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.ack_every = ACK_EVERY;
+  opts.ack_delay_us = ACK_DELAY_US;
+  int count_workers = 1;
+  int opt;
+
+  // -f to fdatasync the outfile after every so many MiB written, -w to
+  // receive on N SO_REUSEPORT sockets with a thread each, -a to acknowledge
+  // every N in order packets and -d to wait at most so many microseconds
+  // for them
+  while ((opt = getopt(argc, argv, "f:w:a:d:")) != -1) {
+    switch (opt) {
+    case 'a':
+      opts.ack_every = atoi(optarg);
+      break;
+    case 'd':
+      opts.ack_delay_us = atoi(optarg);
+      break;
+    case 'w':
+      count_workers = atoi(optarg);
+      break;
+    case 'f':
+      if (atoi(optarg) < 1) {
+        fprintf(stderr, "fsync interval must be at least 1 MiB\n");
+        exit(1);
+      }
+      opts.sync_bytes = (size_t)atoi(optarg) << 20;
+      break;
+    default:
+      argc = 0; // print usage
+      break;
+    }
+  }
+
+  if (argc - optind != 3) {
     fprintf(stderr,
-            "Usage: %s <Port Number> <Drop Percentage> <Root Folder Path>\n",
+            "Usage: %s <Port Number> <Drop Percentage> <Root Folder Path> "
+            "[-f <MiB>] [-w <Workers>] [-a <Packets>] [-d <Microseconds>]\n",
             argv[0]);
     exit(1);
   }
 
-  int port = atoi(argv[1]);
-  int droppc = atoi(argv[2]);
-  char *root_folder = argv[3];
+  int port = atoi(argv[optind]);
+  opts.droppc = atoi(argv[optind + 1]);
+  opts.root_folder = argv[optind + 2];
 
   validport(port);
-  if (droppc < 0 || droppc > 100) {
+  if (opts.droppc < 0 || opts.droppc > 100) {
     fprintf(stderr, "Drop percentage must be in the range: 0-100.\n");
     exit(1);
   }
+  if (opts.ack_every < 1 || opts.ack_delay_us < 0) {
+    fprintf(stderr, "ACKs must cover at least 1 packet, with a delay of at "
+                    "least 0 us\n");
+    exit(1);
+  }
+  if (count_workers < 1 || count_workers > MAX_WORKERS) {
+    fprintf(stderr, "Number of workers must be within: 1-%d\n", MAX_WORKERS);
+    exit(1);
+  }
 
-  mkdir(root_folder, 0777); // make root directory
-  srand(time(NULL));        // set random seed
-
-  // allocate memory for global vars
-  outfile_path = malloc(BUFFER_SIZE);
-  outfile_name = malloc(BUFFER_SIZE);
-  pktsn = malloc(sizeof(int));
-  *pktsn = 0;
-
-  start_server(port, droppc, root_folder);
+  mkdir(opts.root_folder, 0777); // make root directory
+  srand(time(NULL));             // set random seed
+  gf_init();
+  crc32c_init();
 
-  // free memory for global vars
-  free(outfile_path);
-  free(outfile_name);
-  free(pktsn);
+  start_server(port, &opts, count_workers);
 
   return 0;
 }
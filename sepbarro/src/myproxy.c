@@ -1,17 +1,35 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
-#define BUFFER_SIZE 4096 // KiB
+#define BUFFER_SIZE 4096               // KiB
+#define RELAY_BUFFER_SIZE 65536        // per-direction relay buffer (bytes)
+#define DEFAULT_MEMORY_BUDGET_MIB 64   // global relay buffer budget
+#define DEFAULT_CLIENT_TIMEOUT_SEC 30  // slow client/idle timeout
+#define DEFAULT_PREFETCH_BUDGET_MIB 16 // prefetch cache size
+#define PREFETCH_QUEUE_SIZE 64         // pending prefetch URLs
+#define PREFETCH_MAX_OBJECT 1048576    // largest object worth prefetching
+#define PREFETCH_TTL_SEC 60            // how long a prefetched object is fresh
+#define MAX_TAG_SIZE 1024              // longest HTML tag scanned for links
+#define DEFAULT_ORIGIN_LIMIT 16        // in-flight requests per origin
+#define DEFAULT_QUEUE_TIMEOUT_SEC 10   // longest wait for an origin slot
+#define BREAKER_FAILURES 5             // consecutive failures to open breaker
+#define BREAKER_COOLDOWN_SEC 30        // fast-fail period once breaker opens
 
 pthread_mutex_t forbidden_mutex = PTHREAD_MUTEX_INITIALIZER;
 char *forbidden_file;   // global forbidden site file
@@ -19,6 +37,110 @@ char *access_log_file;  // global access log file
 char **forbidden_sites; // forbidden sites array
 int num_sites = 0;
 
+pthread_mutex_t memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+size_t memory_budget; // max bytes of relay buffers across all connections
+size_t memory_used = 0;
+int client_timeout; // seconds without relay progress before giving up
+
+// one direction of a relayed connection, data waiting in [head, tail)
+typedef struct {
+  char *data;
+  size_t head;
+  size_t tail;
+  int eof; // no more bytes will be read into this buffer
+} relay_buffer;
+
+// prefetched response, served to clients that ask for it later
+typedef struct cache_entry {
+  char *key; // "hostname:port/path"
+  char *data;
+  size_t len;
+  time_t fetched;
+  struct sockaddr_in dest_addr;
+  int hits;
+  struct cache_entry *next;
+} cache_entry;
+
+// pending prefetch request
+typedef struct {
+  char hostname[256];
+  int port;
+  char path[2048];
+} prefetch_request;
+
+// incremental scanner for links in an HTML response streaming through
+typedef struct {
+  const char *hostname;
+  int port;
+  const char *page_path;
+  int state; // SCAN_HEADERS, SCAN_BODY or SCAN_DONE
+  char header[BUFFER_SIZE];
+  size_t header_len;
+  char tag[MAX_TAG_SIZE];
+  size_t tag_len;
+  int in_tag;
+} html_scanner;
+
+enum { SCAN_HEADERS, SCAN_BODY, SCAN_DONE };
+
+// request waiting for an origin slot
+typedef struct origin_waiter {
+  pthread_cond_t cond;
+  int granted; // 1 slot handed over, -1 rejected by the circuit breaker
+  struct origin_waiter *next;
+} origin_waiter;
+
+// per-origin (hostname:port) concurrency limit, wait queue and breaker
+typedef struct origin {
+  char key[300];
+  int in_flight;
+  origin_waiter *queue_head; // FIFO of requests waiting for a slot
+  origin_waiter *queue_tail;
+  int queue_depth;
+  int failures;      // consecutive failed requests
+  time_t open_until; // breaker fast-fails requests until this time
+  int probing;       // half-open, one request is testing the origin
+  // statistics
+  unsigned long requests;
+  unsigned long waited;
+  unsigned long timeouts;
+  unsigned long rejected;
+  unsigned long total_wait_ms;
+  unsigned long max_wait_ms;
+  int max_queue_depth;
+  struct origin *next;
+} origin;
+
+enum { ORIGIN_OK, ORIGIN_BREAKER_OPEN, ORIGIN_QUEUE_TIMEOUT };
+enum { ORIGIN_FAILURE = -1, ORIGIN_NEUTRAL = 0, ORIGIN_SUCCESS = 1 };
+
+int prefetch_workers = 0; // 0 disables link prefetching
+size_t prefetch_budget;   // max bytes held in the prefetch cache
+
+pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+cache_entry *cache_head = NULL; // oldest entry first
+cache_entry *cache_tail = NULL;
+size_t cache_bytes = 0;
+
+pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+prefetch_request prefetch_queue[PREFETCH_QUEUE_SIZE];
+int prefetch_queue_head = 0;
+int prefetch_queue_len = 0;
+
+// prefetch statistics (protected by prefetch_mutex)
+unsigned long prefetch_queued = 0;
+unsigned long prefetch_dropped = 0;
+unsigned long prefetch_fetched = 0;
+unsigned long prefetch_fetched_bytes = 0;
+unsigned long prefetch_objects_hit = 0;
+unsigned long prefetch_hits = 0;
+
+pthread_mutex_t origin_mutex = PTHREAD_MUTEX_INITIALIZER;
+origin *origins = NULL;
+int origin_limit;  // max in-flight requests per origin
+int queue_timeout; // seconds a request may wait for an origin slot
+
 void validport(int port) {
   if (0 <= port && port <= 1023) {
     fprintf(stderr, "Port number cannot be well-known: 0-1023\n");
@@ -150,7 +272,7 @@ void send_response(int client_sock, const char *status, const char *headers,
   char response[BUFFER_SIZE];
   snprintf(response, sizeof(response), "%s\r\n%s\r\n%s\r\n\r\n", status,
            headers, body);
-  send(client_sock, response, strlen(response), 0);
+  send(client_sock, response, strlen(response), MSG_NOSIGNAL);
   return;
 }
 
@@ -185,16 +307,1085 @@ void log_request(const struct sockaddr_in *dest_addr, const char *method,
   return;
 }
 
+int reserve_relay_memory(size_t size) {
+  int reserved = 0;
+  pthread_mutex_lock(&memory_mutex);
+  if (memory_used + size <= memory_budget) {
+    memory_used += size;
+    reserved = 1;
+  }
+  pthread_mutex_unlock(&memory_mutex);
+  return reserved;
+}
+
+void release_relay_memory(size_t size) {
+  pthread_mutex_lock(&memory_mutex);
+  memory_used -= size;
+  pthread_mutex_unlock(&memory_mutex);
+  return;
+}
+
+int set_nonblocking(int sockfd) {
+  int flags = fcntl(sockfd, F_GETFL, 0);
+  if (flags == -1) {
+    return -1;
+  }
+  return fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+}
+
+ssize_t read_request(int client_sock, char *request, size_t size) {
+  size_t total = 0;
+
+  // keep reading until the end of the request headers (or buffer is full)
+  while (total < size - 1) {
+    ssize_t n = recv(client_sock, request + total, size - 1 - total, 0);
+    if (n <= 0) {
+      break;
+    }
+    total += n;
+    request[total] = '\0';
+    if (strstr(request, "\r\n\r\n") != NULL) {
+      break;
+    }
+  }
+  request[total] = '\0';
+
+  return total > 0 ? (ssize_t)total : -1;
+}
+
+int build_upstream_request(const char *request, const char *method,
+                           const char *path, char *upstream, size_t size) {
+  // request line in origin-form (destination server gets the path only)
+  int len = snprintf(upstream, size, "%s %s HTTP/1.1\r\n", method, path);
+  if (len < 0 || (size_t)len >= size) {
+    return -1;
+  }
+
+  const char *line = strstr(request, "\r\n");
+  while (line != NULL) {
+    line += 2;
+    const char *line_end = strstr(line, "\r\n");
+    if (line_end == NULL || line_end == line) { // end of headers
+      break;
+    }
+
+    // drop hop-by-hop headers, the proxy decides connection persistence
+    size_t line_len = line_end - line;
+    if (strncasecmp(line, "Connection:", 11) != 0 &&
+        strncasecmp(line, "Proxy-Connection:", 17) != 0 &&
+        strncasecmp(line, "Keep-Alive:", 11) != 0) {
+      if (len + line_len + 2 >= size) {
+        return -1;
+      }
+      memcpy(upstream + len, line, line_len + 2);
+      len += line_len + 2;
+    }
+    line = line_end;
+  }
+
+  // origin closes after the response, which ends the relay
+  int n = snprintf(upstream + len, size - len, "Connection: close\r\n\r\n");
+  if (n < 0 || (size_t)n >= size - len) {
+    return -1;
+  }
+
+  return len + n;
+}
+
+int relay_fill(int sockfd, relay_buffer *buf) {
+  ssize_t n =
+      recv(sockfd, buf->data + buf->tail, RELAY_BUFFER_SIZE - buf->tail, 0);
+  if (n > 0) {
+    buf->tail += n;
+    return 0;
+  }
+  if (n == 0) {
+    buf->eof = 1;
+    return 0;
+  }
+  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+    return 0;
+  }
+  return -1;
+}
+
+ssize_t relay_drain(int sockfd, relay_buffer *buf) {
+  ssize_t n =
+      send(sockfd, buf->data + buf->head, buf->tail - buf->head, MSG_NOSIGNAL);
+  if (n > 0) {
+    buf->head += n;
+    if (buf->head == buf->tail) { // fully drained, reuse from the start
+      buf->head = 0;
+      buf->tail = 0;
+    }
+    return n;
+  }
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return 0;
+  }
+  return -1;
+}
+
+int connect_origin(const char *hostname, int port,
+                   struct sockaddr_in *dest_addr) {
+  // domain name resolution (getaddrinfo is safe to call from any thread)
+  struct addrinfo hints;
+  struct addrinfo *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(hostname, NULL, &hints, &result) != 0) {
+    return -1;
+  }
+
+  memset(dest_addr, 0, sizeof(*dest_addr));
+  *dest_addr = *((struct sockaddr_in *)result->ai_addr);
+  dest_addr->sin_port = htons(port);
+  freeaddrinfo(result);
+
+  int dest_sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (dest_sock < 0) {
+    return -1;
+  }
+  if (connect(dest_sock, (struct sockaddr *)dest_addr, sizeof(*dest_addr)) <
+      0) {
+    close(dest_sock);
+    return -2;
+  }
+
+  return dest_sock;
+}
+
+void cache_key(char *key, size_t size, const char *hostname, int port,
+               const char *path) {
+  snprintf(key, size, "%s:%d%s", hostname, port, path);
+  return;
+}
+
+void cache_remove(cache_entry *prev, cache_entry *entry) {
+  if (prev == NULL) {
+    cache_head = entry->next;
+  } else {
+    prev->next = entry->next;
+  }
+  if (cache_tail == entry) {
+    cache_tail = prev;
+  }
+  cache_bytes -= entry->len;
+  free(entry->key);
+  free(entry->data);
+  free(entry);
+  return;
+}
+
+// find a fresh entry, returns a copy of its data (caller frees)
+char *cache_lookup(const char *key, size_t *len,
+                   struct sockaddr_in *dest_addr) {
+  char *data = NULL;
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&cache_mutex);
+  cache_entry *prev = NULL;
+  cache_entry *entry = cache_head;
+  while (entry != NULL) {
+    if (strcmp(entry->key, key) == 0) {
+      if (now - entry->fetched > PREFETCH_TTL_SEC) { // stale, drop it
+        cache_remove(prev, entry);
+        break;
+      }
+      data = malloc(entry->len);
+      if (data != NULL) {
+        memcpy(data, entry->data, entry->len);
+        *len = entry->len;
+        *dest_addr = entry->dest_addr;
+        entry->hits += 1;
+        pthread_mutex_lock(&prefetch_mutex);
+        if (entry->hits == 1) {
+          prefetch_objects_hit += 1;
+        }
+        prefetch_hits += 1;
+        pthread_mutex_unlock(&prefetch_mutex);
+      }
+      break;
+    }
+    prev = entry;
+    entry = entry->next;
+  }
+  pthread_mutex_unlock(&cache_mutex);
+
+  return data;
+}
+
+int cache_contains(const char *key) {
+  int found = 0;
+  pthread_mutex_lock(&cache_mutex);
+  for (cache_entry *entry = cache_head; entry != NULL; entry = entry->next) {
+    if (strcmp(entry->key, key) == 0) {
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache_mutex);
+  return found;
+}
+
+// takes ownership of data
+void cache_insert(const char *key, char *data, size_t len,
+                  const struct sockaddr_in *dest_addr) {
+  cache_entry *entry = malloc(sizeof(cache_entry));
+  if (entry == NULL) {
+    free(data);
+    return;
+  }
+  entry->key = strdup(key);
+  entry->data = data;
+  entry->len = len;
+  entry->fetched = time(NULL);
+  entry->dest_addr = *dest_addr;
+  entry->hits = 0;
+  entry->next = NULL;
+
+  pthread_mutex_lock(&cache_mutex);
+  // replace an older copy, then evict oldest entries until it fits
+  cache_entry *prev = NULL;
+  for (cache_entry *old = cache_head; old != NULL;
+       prev = old, old = old->next) {
+    if (strcmp(old->key, key) == 0) {
+      cache_remove(prev, old);
+      break;
+    }
+  }
+  while (cache_head != NULL && cache_bytes + len > prefetch_budget) {
+    cache_remove(NULL, cache_head);
+  }
+
+  if (cache_tail == NULL) {
+    cache_head = entry;
+  } else {
+    cache_tail->next = entry;
+  }
+  cache_tail = entry;
+  cache_bytes += len;
+  pthread_mutex_unlock(&cache_mutex);
+
+  return;
+}
+
+ssize_t serve_prefetched(int client_sock, const char *hostname, int port,
+                         const char *path, struct sockaddr_in *dest_addr) {
+  char key[BUFFER_SIZE];
+  size_t len;
+  cache_key(key, sizeof(key), hostname, port, path);
+
+  char *data = cache_lookup(key, &len, dest_addr);
+  if (data == NULL) {
+    return -1;
+  }
+
+  size_t total = 0;
+  while (total < len) {
+    ssize_t n = send(client_sock, data + total, len - total, MSG_NOSIGNAL);
+    if (n <= 0) {
+      break;
+    }
+    total += n;
+  }
+  free(data);
+
+  return total;
+}
+
+void enqueue_prefetch(const char *hostname, int port, const char *path) {
+  char key[BUFFER_SIZE];
+  cache_key(key, sizeof(key), hostname, port, path);
+  if (cache_contains(key)) {
+    return;
+  }
+
+  pthread_mutex_lock(&prefetch_mutex);
+  // skip links that are already waiting to be fetched
+  for (int i = 0; i < prefetch_queue_len; i += 1) {
+    prefetch_request *pending =
+        &prefetch_queue[(prefetch_queue_head + i) % PREFETCH_QUEUE_SIZE];
+    if (pending->port == port && strcmp(pending->hostname, hostname) == 0 &&
+        strcmp(pending->path, path) == 0) {
+      pthread_mutex_unlock(&prefetch_mutex);
+      return;
+    }
+  }
+
+  if (prefetch_queue_len == PREFETCH_QUEUE_SIZE) { // queue full, drop link
+    prefetch_dropped += 1;
+  } else {
+    prefetch_request *request =
+        &prefetch_queue[(prefetch_queue_head + prefetch_queue_len) %
+                        PREFETCH_QUEUE_SIZE];
+    snprintf(request->hostname, sizeof(request->hostname), "%s", hostname);
+    snprintf(request->path, sizeof(request->path), "%s", path);
+    request->port = port;
+    prefetch_queue_len += 1;
+    prefetch_queued += 1;
+    pthread_cond_signal(&prefetch_cond);
+  }
+  pthread_mutex_unlock(&prefetch_mutex);
+
+  return;
+}
+
+// copy the value of header "name" out of a block of response headers
+int find_header(const char *headers, const char *name, char *value,
+                size_t size) {
+  size_t name_len = strlen(name);
+  const char *line = strstr(headers, "\r\n");
+  while (line != NULL) {
+    line += 2;
+    if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+      const char *start = line + name_len + 1;
+      while (*start == ' ' || *start == '\t') {
+        start += 1;
+      }
+      size_t len = strcspn(start, "\r\n");
+      if (len >= size) {
+        len = size - 1;
+      }
+      memcpy(value, start, len);
+      value[len] = '\0';
+      return 0;
+    }
+    line = strstr(line, "\r\n");
+  }
+  return -1;
+}
+
+// copy the value of attribute "name" out of an HTML tag
+int find_attribute(const char *tag, const char *name, char *value,
+                   size_t size) {
+  size_t name_len = strlen(name);
+  for (const char *p = tag; *p != '\0'; p += 1) {
+    if (!isspace((unsigned char)p[0]) ||
+        strncasecmp(p + 1, name, name_len) != 0) {
+      continue;
+    }
+    const char *q = p + 1 + name_len;
+    while (isspace((unsigned char)*q)) {
+      q += 1;
+    }
+    if (*q != '=') {
+      continue;
+    }
+    q += 1;
+    while (isspace((unsigned char)*q)) {
+      q += 1;
+    }
+
+    size_t len;
+    if (*q == '"' || *q == '\'') { // quoted value
+      char quote = *q;
+      q += 1;
+      const char *end = strchr(q, quote);
+      len = end != NULL ? (size_t)(end - q) : strlen(q);
+    } else {
+      len = strcspn(q, " \t\r\n");
+    }
+    if (len == 0 || len >= size) {
+      return -1;
+    }
+    memcpy(value, q, len);
+    value[len] = '\0';
+    return 0;
+  }
+  return -1;
+}
+
+// turn a link found in a page into a path on the same origin
+int resolve_link(const html_scanner *scanner, char *link, char *path,
+                 size_t size) {
+  link[strcspn(link, "#")] = '\0'; // fragments never reach the server
+
+  const char *authority = NULL;
+  if (strncasecmp(link, "http://", 7) == 0) {
+    authority = link + 7;
+  } else if (strncmp(link, "//", 2) == 0) {
+    authority = link + 2;
+  }
+
+  if (authority != NULL) { // absolute link, must be the same host and port
+    size_t host_len = strcspn(authority, ":/");
+    int port = 80;
+    if (authority[host_len] == ':') {
+      port = atoi(authority + host_len + 1);
+    }
+    if (host_len != strlen(scanner->hostname) ||
+        strncasecmp(authority, scanner->hostname, host_len) != 0 ||
+        port != scanner->port) {
+      return -1;
+    }
+    const char *rest = strchr(authority, '/');
+    snprintf(path, size, "%s", rest != NULL ? rest : "/");
+    return 0;
+  }
+
+  if (link[0] == '/') {
+    snprintf(path, size, "%s", link);
+    return 0;
+  }
+  if (strcspn(link, ":") < strcspn(link, "/?")) { // other scheme (https:, ...)
+    return -1;
+  }
+
+  // relative link, resolve against the directory of the page
+  size_t dir_len = strcspn(scanner->page_path, "?");
+  while (dir_len > 0 && scanner->page_path[dir_len - 1] != '/') {
+    dir_len -= 1;
+  }
+  int n = snprintf(path, size, "%.*s%s", (int)dir_len, scanner->page_path,
+                   link);
+  if (n < 0 || (size_t)n >= size) {
+    return -1;
+  }
+  return 0;
+}
+
+void scan_tag(html_scanner *scanner) {
+  const char *attribute;
+  if (strncasecmp(scanner->tag, "img", 3) == 0 &&
+      isspace((unsigned char)scanner->tag[3])) {
+    attribute = "src";
+  } else if (strncasecmp(scanner->tag, "script", 6) == 0 &&
+             isspace((unsigned char)scanner->tag[6])) {
+    attribute = "src";
+  } else if (strncasecmp(scanner->tag, "link", 4) == 0 &&
+             isspace((unsigned char)scanner->tag[4])) {
+    attribute = "href";
+  } else {
+    return;
+  }
+
+  char link[MAX_TAG_SIZE];
+  char path[2048];
+  if (find_attribute(scanner->tag, attribute, link, sizeof(link)) == 0 &&
+      resolve_link(scanner, link, path, sizeof(path)) == 0) {
+    enqueue_prefetch(scanner->hostname, scanner->port, path);
+  }
+  return;
+}
+
+void scan_html(html_scanner *scanner, const char *data, size_t len) {
+  size_t i = 0;
+
+  if (scanner->state == SCAN_HEADERS) {
+    // collect headers (they may span several reads)
+    size_t room = sizeof(scanner->header) - 1 - scanner->header_len;
+    size_t n = len < room ? len : room;
+    memcpy(scanner->header + scanner->header_len, data, n);
+    scanner->header_len += n;
+    scanner->header[scanner->header_len] = '\0';
+
+    char *end = strstr(scanner->header, "\r\n\r\n");
+    if (end == NULL) {
+      if (n == room) { // headers too large to scan
+        scanner->state = SCAN_DONE;
+      }
+      return;
+    }
+    size_t header_size = end + 4 - scanner->header;
+    i = header_size - (scanner->header_len - n); // body start in this read
+
+    // only uncompressed, successful HTML pages are scanned
+    int status = 0;
+    char value[256];
+    sscanf(scanner->header, "HTTP/%*s %d", &status);
+    if (status != 200 ||
+        find_header(scanner->header, "Content-Type", value, sizeof(value)) ==
+            -1 ||
+        strncasecmp(value, "text/html", 9) != 0 ||
+        (find_header(scanner->header, "Content-Encoding", value,
+                     sizeof(value)) == 0 &&
+         strcasecmp(value, "identity") != 0)) {
+      scanner->state = SCAN_DONE;
+      return;
+    }
+    scanner->state = SCAN_BODY;
+  }
+
+  if (scanner->state != SCAN_BODY) {
+    return;
+  }
+
+  for (; i < len; i += 1) {
+    char c = data[i];
+    if (!scanner->in_tag) {
+      if (c == '<') {
+        scanner->in_tag = 1;
+        scanner->tag_len = 0;
+      }
+    } else if (c == '>') {
+      scanner->tag[scanner->tag_len] = '\0';
+      scan_tag(scanner);
+      scanner->in_tag = 0;
+    } else if (scanner->tag_len < sizeof(scanner->tag) - 1) {
+      scanner->tag[scanner->tag_len] = c;
+      scanner->tag_len += 1;
+    } else { // tag too long to hold a link we care about
+      scanner->in_tag = 0;
+    }
+  }
+  return;
+}
+
+// a response meant for one client (private, no-store or setting a cookie)
+// must not be handed to every client out of the prefetch cache
+int shareable_response(const char *response, size_t len) {
+  const char *end = memmem(response, len, "\r\n\r\n", 4);
+  if (end == NULL || (size_t)(end - response) >= BUFFER_SIZE) {
+    return 0;
+  }
+  char headers[BUFFER_SIZE];
+  memcpy(headers, response, end - response + 2);
+  headers[end - response + 2] = '\0';
+
+  char value[BUFFER_SIZE];
+  if (find_header(headers, "Set-Cookie", value, sizeof(value)) == 0) {
+    return 0;
+  }
+  if (find_header(headers, "Cache-Control", value, sizeof(value)) == 0 &&
+      (strcasestr(value, "no-store") != NULL ||
+       strcasestr(value, "private") != NULL)) {
+    return 0;
+  }
+  // the prefetched copy was fetched without any of the client's headers,
+  // only a variant picked by encoding can stand in for every client
+  if (find_header(headers, "Vary", value, sizeof(value)) == 0 &&
+      strcasecmp(value, "Accept-Encoding") != 0) {
+    return 0;
+  }
+  return 1;
+}
+
+// a request with credentials, a range or conditions needs an answer of its
+// own, not the prefetched copy
+int prefetchable_request(const char *request) {
+  static const char *headers[] = {
+      "Authorization",     "Cookie",   "Range",
+      "If-None-Match",     "If-Match", "If-Modified-Since",
+      "If-Unmodified-Since", "If-Range",
+  };
+  char value[BUFFER_SIZE];
+  for (size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+    if (find_header(request, headers[i], value, sizeof(value)) == 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// fetch a whole object for the prefetch cache, returns its size, -1 if it
+// isn't worth caching or -2 if the origin failed
+ssize_t fetch_object(const prefetch_request *request, char **data,
+                     struct sockaddr_in *dest_addr) {
+  int dest_sock = connect_origin(request->hostname, request->port, dest_addr);
+  if (dest_sock < 0) {
+    return -2;
+  }
+
+  struct timeval timeout = {client_timeout, 0};
+  setsockopt(dest_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  char fetch_request[BUFFER_SIZE];
+  int len;
+  if (request->port == 80) {
+    len = snprintf(fetch_request, sizeof(fetch_request),
+                   "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                   request->path, request->hostname);
+  } else {
+    len = snprintf(
+        fetch_request, sizeof(fetch_request),
+        "GET %s HTTP/1.1\r\nHost: %s:%d\r\nConnection: close\r\n\r\n",
+        request->path, request->hostname, request->port);
+  }
+  if (len < 0 || (size_t)len >= sizeof(fetch_request) ||
+      send(dest_sock, fetch_request, len, MSG_NOSIGNAL) != len) {
+    close(dest_sock);
+    return -2;
+  }
+
+  // objects bigger than the limit are not worth the cache space
+  size_t limit = PREFETCH_MAX_OBJECT < prefetch_budget ? PREFETCH_MAX_OBJECT
+                                                       : prefetch_budget;
+  size_t capacity = BUFFER_SIZE;
+  size_t total = 0;
+  char *buffer = malloc(capacity);
+  while (buffer != NULL) {
+    if (total == capacity) {
+      if (capacity == limit) {
+        total = 0; // too large
+        break;
+      }
+      capacity = capacity * 2 < limit ? capacity * 2 : limit;
+      char *grown = realloc(buffer, capacity);
+      if (grown == NULL) {
+        total = 0;
+        break;
+      }
+      buffer = grown;
+    }
+    ssize_t n = recv(dest_sock, buffer + total, capacity - total, 0);
+    if (n < 0) {
+      free(buffer);
+      close(dest_sock);
+      return -2;
+    }
+    if (n <= 0) {
+      break;
+    }
+    total += n;
+  }
+  close(dest_sock);
+
+  int status = 0;
+  if (total > 12) {
+    sscanf(buffer, "HTTP/%*s %d", &status);
+  }
+  if (status != 200 || !shareable_response(buffer, total)) {
+    free(buffer);
+    return -1;
+  }
+
+  *data = buffer;
+  return total;
+}
+
+long elapsed_ms(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 +
+         (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// find origin state for hostname:port, caller holds origin_mutex
+origin *find_origin(const char *hostname, int port) {
+  char key[300];
+  snprintf(key, sizeof(key), "%s:%d", hostname, port);
+
+  for (origin *o = origins; o != NULL; o = o->next) {
+    if (strcmp(o->key, key) == 0) {
+      return o;
+    }
+  }
+
+  origin *o = calloc(1, sizeof(origin));
+  if (o == NULL) {
+    return NULL;
+  }
+  snprintf(o->key, sizeof(o->key), "%s", key);
+  o->next = origins;
+  origins = o;
+  return o;
+}
+
+// wait (FIFO) for an in-flight slot on the origin, probe is set for the
+// single request let through to test a half-open breaker
+int acquire_origin(const char *hostname, int port, origin **slot,
+                   int *probe) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  *probe = 0;
+  pthread_mutex_lock(&origin_mutex);
+  origin *o = find_origin(hostname, port);
+  if (o == NULL) {
+    pthread_mutex_unlock(&origin_mutex);
+    *slot = NULL;
+    return ORIGIN_OK; // no bookkeeping, let the request through
+  }
+  o->requests += 1;
+
+  // breaker open: fail fast, after the cooldown let a single probe through
+  if (o->open_until != 0) {
+    if (time(NULL) < o->open_until || o->probing) {
+      o->rejected += 1;
+      pthread_mutex_unlock(&origin_mutex);
+      return ORIGIN_BREAKER_OPEN;
+    }
+    o->probing = 1;
+    *probe = 1;
+  }
+
+  if (o->in_flight < origin_limit && o->queue_head == NULL) {
+    o->in_flight += 1;
+    pthread_mutex_unlock(&origin_mutex);
+    *slot = o;
+    return ORIGIN_OK;
+  }
+
+  // join the back of the wait queue
+  origin_waiter waiter;
+  pthread_cond_init(&waiter.cond, NULL);
+  waiter.granted = 0;
+  waiter.next = NULL;
+  if (o->queue_tail == NULL) {
+    o->queue_head = &waiter;
+  } else {
+    o->queue_tail->next = &waiter;
+  }
+  o->queue_tail = &waiter;
+  o->queue_depth += 1;
+  if (o->queue_depth > o->max_queue_depth) {
+    o->max_queue_depth = o->queue_depth;
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += queue_timeout;
+  while (waiter.granted == 0) {
+    if (pthread_cond_timedwait(&waiter.cond, &origin_mutex, &deadline) ==
+            ETIMEDOUT &&
+        waiter.granted == 0) {
+      break;
+    }
+  }
+
+  int result = ORIGIN_OK;
+  if (waiter.granted == 0) { // timed out, leave the queue
+    origin_waiter *prev = NULL;
+    for (origin_waiter *w = o->queue_head; w != NULL; prev = w, w = w->next) {
+      if (w == &waiter) {
+        if (prev == NULL) {
+          o->queue_head = w->next;
+        } else {
+          prev->next = w->next;
+        }
+        if (o->queue_tail == w) {
+          o->queue_tail = prev;
+        }
+        break;
+      }
+    }
+    o->queue_depth -= 1;
+    o->timeouts += 1;
+    result = ORIGIN_QUEUE_TIMEOUT;
+  } else if (waiter.granted == -1) {
+    o->rejected += 1;
+    result = ORIGIN_BREAKER_OPEN;
+  }
+  if (result != ORIGIN_OK) {
+    if (*probe) { // never reached the origin, let another request probe
+      o->probing = 0;
+      *probe = 0;
+    }
+  } else {
+    unsigned long wait_ms = elapsed_ms(&start);
+    o->waited += 1;
+    o->total_wait_ms += wait_ms;
+    if (wait_ms > o->max_wait_ms) {
+      o->max_wait_ms = wait_ms;
+    }
+    *slot = o;
+  }
+  pthread_mutex_unlock(&origin_mutex);
+  pthread_cond_destroy(&waiter.cond);
+
+  return result;
+}
+
+// give the slot back (or to the next waiter) and update the breaker
+void release_origin(origin *o, int probe, int outcome) {
+  if (o == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&origin_mutex);
+  if (outcome == ORIGIN_SUCCESS) {
+    if (o->open_until != 0) {
+      printf("Circuit breaker closed for %s\n", o->key);
+    }
+    o->failures = 0;
+    o->open_until = 0;
+    o->probing = 0;
+  } else if (outcome == ORIGIN_FAILURE) {
+    o->failures += 1;
+    if (probe || o->failures >= BREAKER_FAILURES) {
+      if (o->open_until == 0) {
+        printf("Circuit breaker opened for %s\n", o->key);
+      }
+      o->open_until = time(NULL) + BREAKER_COOLDOWN_SEC;
+      o->probing = 0;
+
+      // everyone waiting would hit the same failing origin
+      while (o->queue_head != NULL) {
+        origin_waiter *w = o->queue_head;
+        o->queue_head = w->next;
+        o->queue_depth -= 1;
+        w->granted = -1;
+        pthread_cond_signal(&w->cond);
+      }
+      o->queue_tail = NULL;
+    }
+  } else if (probe) { // no verdict, let another request probe
+    o->probing = 0;
+  }
+
+  if (o->queue_head != NULL) { // hand the slot to the longest waiter
+    origin_waiter *w = o->queue_head;
+    o->queue_head = w->next;
+    if (o->queue_head == NULL) {
+      o->queue_tail = NULL;
+    }
+    o->queue_depth -= 1;
+    w->granted = 1;
+    pthread_cond_signal(&w->cond);
+  } else {
+    o->in_flight -= 1;
+  }
+  pthread_mutex_unlock(&origin_mutex);
+
+  return;
+}
+
+void *prefetch_worker(void *arg) {
+  (void)arg;
+
+  // prefetching only uses CPU nobody else wants
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+  while (1) {
+    pthread_mutex_lock(&prefetch_mutex);
+    while (prefetch_queue_len == 0) {
+      pthread_cond_wait(&prefetch_cond, &prefetch_mutex);
+    }
+    prefetch_request request = prefetch_queue[prefetch_queue_head];
+    prefetch_queue_head = (prefetch_queue_head + 1) % PREFETCH_QUEUE_SIZE;
+    prefetch_queue_len -= 1;
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    // the forbidden list may have been reloaded since the page was fetched
+    pthread_mutex_lock(&forbidden_mutex);
+    int forbidden = is_forbidden(request.hostname);
+    pthread_mutex_unlock(&forbidden_mutex);
+    if (forbidden) {
+      continue;
+    }
+
+    char key[BUFFER_SIZE];
+    cache_key(key, sizeof(key), request.hostname, request.port, request.path);
+    if (cache_contains(key)) {
+      continue;
+    }
+
+    // prefetches take a slot like any request, and stay away from an
+    // origin whose breaker is open
+    origin *slot = NULL;
+    int probe;
+    if (acquire_origin(request.hostname, request.port, &slot, &probe) !=
+        ORIGIN_OK) {
+      continue;
+    }
+    char *data;
+    struct sockaddr_in dest_addr;
+    ssize_t len = fetch_object(&request, &data, &dest_addr);
+    release_origin(slot, probe,
+                   len == -2   ? ORIGIN_FAILURE
+                   : len == -1 ? ORIGIN_NEUTRAL
+                               : ORIGIN_SUCCESS);
+    if (len < 0) {
+      continue;
+    }
+    cache_insert(key, data, len, &dest_addr);
+
+    pthread_mutex_lock(&prefetch_mutex);
+    prefetch_fetched += 1;
+    prefetch_fetched_bytes += len;
+    pthread_mutex_unlock(&prefetch_mutex);
+  }
+
+  return NULL;
+}
+
+void print_stats() {
+  if (prefetch_workers > 0) {
+    pthread_mutex_lock(&prefetch_mutex);
+    printf("Prefetch: %lu queued, %lu dropped, %lu fetched (%lu bytes), %lu "
+           "prefetched objects hit (%lu hits)\n",
+           prefetch_queued, prefetch_dropped, prefetch_fetched,
+           prefetch_fetched_bytes, prefetch_objects_hit, prefetch_hits);
+    pthread_mutex_unlock(&prefetch_mutex);
+  }
+
+  pthread_mutex_lock(&origin_mutex);
+  time_t now = time(NULL);
+  for (origin *o = origins; o != NULL; o = o->next) {
+    const char *breaker = "closed";
+    if (o->open_until != 0) {
+      breaker = now < o->open_until ? "open" : "half-open";
+    }
+    printf("Origin %s: %d in flight, %d queued (max %d), %lu requests, %lu "
+           "waited (avg %lu ms, max %lu ms), %lu timed out, %lu rejected, "
+           "breaker %s\n",
+           o->key, o->in_flight, o->queue_depth, o->max_queue_depth,
+           o->requests, o->waited,
+           o->waited > 0 ? o->total_wait_ms / o->waited : 0, o->max_wait_ms,
+           o->timeouts, o->rejected, breaker);
+  }
+  pthread_mutex_unlock(&origin_mutex);
+  fflush(stdout);
+  return;
+}
+
+// prints statistics every time the proxy receives SIGUSR1
+void *stats_thread(void *arg) {
+  sigset_t *signals = (sigset_t *)arg;
+  int sig;
+  while (sigwait(signals, &sig) == 0) {
+    print_stats();
+  }
+  return NULL;
+}
+
+// relay until the origin closes, outcome tells the breaker whether the
+// origin answered (a 5xx, a timeout or no response at all is a failure)
+ssize_t relay_connection(int client_sock, int dest_sock, html_scanner *scanner,
+                         int *outcome) {
+  // bounded buffers, client -> destination (up) and destination -> client
+  // (down), memory is constant regardless of the response size
+  relay_buffer up = {malloc(RELAY_BUFFER_SIZE), 0, 0, 0};
+  relay_buffer down = {malloc(RELAY_BUFFER_SIZE), 0, 0, 0};
+  ssize_t bytes_sent = 0;
+  int failed = 0;
+  int origin_failed = 0;     // the origin, not the client, ended the relay
+  char status_line[16];      // first bytes of the response, for its status
+  size_t status_len = 0;
+  *outcome = ORIGIN_NEUTRAL;
+
+  if (up.data == NULL || down.data == NULL ||
+      set_nonblocking(client_sock) == -1 || set_nonblocking(dest_sock) == -1) {
+    free(up.data);
+    free(down.data);
+    return -1;
+  }
+
+  while (!down.eof || down.head < down.tail) {
+    struct pollfd fds[2];
+    fds[0].fd = client_sock;
+    fds[0].events = 0;
+    fds[1].fd = dest_sock;
+    fds[1].events = 0;
+
+    if (!up.eof && up.tail < RELAY_BUFFER_SIZE) {
+      fds[0].events |= POLLIN;
+    }
+    if (down.head < down.tail) {
+      fds[0].events |= POLLOUT; // resume once the client drains
+    }
+    if (!down.eof && down.tail < RELAY_BUFFER_SIZE) {
+      fds[1].events |= POLLIN; // stop reading when the client buffer is full
+    }
+    if (up.head < up.tail) {
+      fds[1].events |= POLLOUT;
+    }
+
+    // ignore sockets with nothing to do so hangups don't spin the loop
+    for (int i = 0; i < 2; i += 1) {
+      if (fds[i].events == 0) {
+        fds[i].fd = -1;
+      }
+    }
+
+    int ready = poll(fds, 2, client_timeout * 1000);
+    if (ready == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      failed = 1;
+      break;
+    }
+    if (ready == 0) {
+      if (down.head < down.tail) {
+        fprintf(stderr, "Client too slow, closing connection\n");
+      } else {
+        fprintf(stderr, "Destination server timed out\n");
+        origin_failed = 1;
+      }
+      failed = 1;
+      break;
+    }
+
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR) &&
+        fds[1].events & POLLIN) {
+      size_t tail = down.tail;
+      if (relay_fill(dest_sock, &down) == -1) {
+        failed = 1;
+        origin_failed = 1;
+        break;
+      }
+      size_t n = down.tail - tail;
+      if (n > sizeof(status_line) - 1 - status_len) {
+        n = sizeof(status_line) - 1 - status_len;
+      }
+      memcpy(status_line + status_len, down.data + tail, n);
+      status_len += n;
+      if (scanner != NULL && down.tail > tail) { // look for links to prefetch
+        scan_html(scanner, down.data + tail, down.tail - tail);
+      }
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR) &&
+        fds[0].events & POLLIN) {
+      if (relay_fill(client_sock, &up) == -1) {
+        up.eof = 1; // client stopped sending, keep sending it the response
+      }
+    }
+    if (fds[0].revents & (POLLOUT | POLLHUP | POLLERR) &&
+        down.head < down.tail) {
+      ssize_t n = relay_drain(client_sock, &down);
+      if (n == -1) {
+        fprintf(stderr, "Client disconnected\n");
+        failed = 1;
+        break;
+      }
+      bytes_sent += n;
+    }
+    if (fds[1].revents & (POLLOUT | POLLERR) && up.head < up.tail) {
+      if (relay_drain(dest_sock, &up) == -1) {
+        failed = 1;
+        origin_failed = 1;
+        break;
+      }
+    }
+  }
+
+  free(up.data);
+  free(down.data);
+
+  int status = 0;
+  status_line[status_len] = '\0';
+  sscanf(status_line, "HTTP/%*s %d", &status);
+  if (origin_failed || status >= 500 || (status == 0 && !failed)) {
+    *outcome = ORIGIN_FAILURE;
+  } else if (status != 0) {
+    *outcome = ORIGIN_SUCCESS;
+  } // the client went away before the origin answered
+
+  if (failed && bytes_sent == 0) {
+    return -1;
+  }
+  return bytes_sent;
+}
+
 void *handle_client(void *arg) {
   int client_sock = *((int *)arg);
   free(arg);
 
   // receive client request
   char request_buffer[BUFFER_SIZE];
-  recv(client_sock, request_buffer, sizeof(request_buffer), 0);
+  if (read_request(client_sock, request_buffer, sizeof(request_buffer)) ==
+      -1) {
+    close(client_sock);
+    return NULL;
+  }
 
   // parse incoming HTTP request
-  char method[10], hostname[2048], uri[2048], ip[INET_ADDRSTRLEN];
+  char method[10] = "", hostname[2048], uri[2048], ip[INET_ADDRSTRLEN];
   int port;
   if (parse_http_request(request_buffer, method, hostname, ip, uri, &port) !=
       0) {
@@ -220,51 +1411,101 @@ void *handle_client(void *arg) {
   }
   pthread_mutex_unlock(&forbidden_mutex);
 
-  // forward request to destination server
-  int dest_sock = socket(AF_INET, SOCK_STREAM, 0);
-  if (dest_sock < 0) {
-    fprintf(stderr, "Socket creation failed\n");
+  // serve objects the prefetcher already fetched
+  if (prefetch_workers > 0 && strcmp(method, "GET") == 0 &&
+      prefetchable_request(request_buffer)) {
+    struct sockaddr_in cached_addr;
+    ssize_t bytes_sent =
+        serve_prefetched(client_sock, hostname, port, uri, &cached_addr);
+    if (bytes_sent >= 0) {
+      log_request(&cached_addr, method, hostname, "HTTP/1.1", 200,
+                  bytes_sent);
+      close(client_sock);
+      return NULL;
+    }
+  }
+
+  // rewrite request for the destination server
+  char upstream_request[BUFFER_SIZE];
+  int upstream_len =
+      build_upstream_request(request_buffer, method, uri, upstream_request,
+                             sizeof(upstream_request));
+  if (upstream_len == -1) {
+    send_response(client_sock, "HTTP/1.1 400 Bad Request", "", "");
+    log_request(NULL, method, hostname, "HTTP/1.1", 400, -1);
+    close(client_sock);
+    return NULL;
+  }
+
+  // wait for a slot on the destination server, fail fast if it is down
+  origin *slot = NULL;
+  int probe;
+  int admission = acquire_origin(hostname, port, &slot, &probe);
+  if (admission == ORIGIN_BREAKER_OPEN) {
     send_response(client_sock, "HTTP/1.1 502 Bad Gateway", "", "");
     log_request(NULL, method, hostname, "HTTP/1.1", 502, -1);
     close(client_sock);
     return NULL;
   }
+  if (admission == ORIGIN_QUEUE_TIMEOUT) {
+    send_response(client_sock, "HTTP/1.1 504 Gateway Timeout", "", "");
+    log_request(NULL, method, hostname, "HTTP/1.1", 504, -1);
+    close(client_sock);
+    return NULL;
+  }
+
+  // relay buffers come out of the global budget, refuse when exhausted
+  if (!reserve_relay_memory(2 * RELAY_BUFFER_SIZE)) {
+    send_response(client_sock, "HTTP/1.1 503 Service Unavailable", "", "");
+    log_request(NULL, method, hostname, "HTTP/1.1", 503, -1);
+    release_origin(slot, probe, ORIGIN_NEUTRAL);
+    close(client_sock);
+    return NULL;
+  }
 
-  // domain name resolution
-  struct hostent *dest_host = gethostbyname(hostname);
-  if (dest_host == NULL) {
+  // forward request to destination server
+  struct sockaddr_in dest_addr;
+  int dest_sock = connect_origin(hostname, port, &dest_addr);
+  if (dest_sock == -1) {
     fprintf(stderr, "Error resolving hostname\n");
     send_response(client_sock, "HTTP/1.1 502 Bad Gateway", "", "");
     log_request(NULL, method, hostname, "HTTP/1.1", 502, -1);
+    release_relay_memory(2 * RELAY_BUFFER_SIZE);
+    release_origin(slot, probe, ORIGIN_FAILURE);
     close(client_sock);
-    close(dest_sock);
     return NULL;
   }
-
-  // initialize client address structure
-  struct sockaddr_in dest_addr;
-  memset(&dest_addr, 0, sizeof(dest_addr));
-  dest_addr.sin_family = AF_INET;
-  dest_addr.sin_addr = *((struct in_addr *)dest_host->h_addr);
-  dest_addr.sin_port = htons(port);
-
-  if (connect(dest_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) <
-      0) {
+  if (dest_sock == -2) {
     fprintf(stderr, "Connection to destination server failed\n");
     send_response(client_sock, "HTTP/1.1 504 Gateway Timeout", "", "");
     log_request(NULL, method, hostname, "HTTP/1.1", 504, -1);
+    release_relay_memory(2 * RELAY_BUFFER_SIZE);
+    release_origin(slot, probe, ORIGIN_FAILURE);
     close(client_sock);
-    close(dest_sock);
     return NULL;
   }
 
   // send request to destination server
-  send(dest_sock, request_buffer, strlen(request_buffer), 0);
+  send(dest_sock, upstream_request, upstream_len, MSG_NOSIGNAL);
+
+  // pages streaming through are scanned for links to prefetch
+  html_scanner *scanner = NULL;
+  if (prefetch_workers > 0 && strcmp(method, "GET") == 0) {
+    scanner = calloc(1, sizeof(html_scanner));
+    if (scanner != NULL) {
+      scanner->hostname = hostname;
+      scanner->port = port;
+      scanner->page_path = uri;
+    }
+  }
 
-  // receive response from destination server
-  char response_buffer[BUFFER_SIZE];
+  // stream response from destination server to client
+  int outcome;
   ssize_t bytes_received =
-      recv(dest_sock, response_buffer, sizeof(response_buffer), 0);
+      relay_connection(client_sock, dest_sock, scanner, &outcome);
+  free(scanner);
+  release_relay_memory(2 * RELAY_BUFFER_SIZE);
+  release_origin(slot, probe, outcome);
   if (bytes_received < 0) {
     fprintf(stderr, "Error receiving response from destination server\n");
     send_response(client_sock, "HTTP/1.1 502 Bad Gateway", "", "");
@@ -274,9 +1515,6 @@ void *handle_client(void *arg) {
     return NULL;
   }
 
-  // send response to client
-  send(client_sock, response_buffer, bytes_received, 0);
-
   // log request
   log_request(&dest_addr, method, hostname, "HTTP/1.1", 200, bytes_received);
 
@@ -287,17 +1525,74 @@ void *handle_client(void *arg) {
 }
 
 int main(int argc, char *argv[]) {
-  if (argc < 4) {
-    fprintf(
-        stderr,
-        "Usage: %s <Port Number> <Forbidden Sites File> <Access Log File>\n",
-        argv[0]);
+  int budget_mib = DEFAULT_MEMORY_BUDGET_MIB;
+  int prefetch_mib = DEFAULT_PREFETCH_BUDGET_MIB;
+  client_timeout = DEFAULT_CLIENT_TIMEOUT_SEC;
+  origin_limit = DEFAULT_ORIGIN_LIMIT;
+  queue_timeout = DEFAULT_QUEUE_TIMEOUT_SEC;
+
+  // optional flags: relay memory budget (MiB), slow client timeout (sec),
+  // prefetch worker count, prefetch cache budget (MiB), in-flight requests
+  // per origin and origin queue timeout (sec)
+  int opt;
+  while ((opt = getopt(argc, argv, "m:t:p:b:c:q:")) != -1) {
+    switch (opt) {
+    case 'c':
+      origin_limit = atoi(optarg);
+      break;
+    case 'q':
+      queue_timeout = atoi(optarg);
+      break;
+    case 'p':
+      prefetch_workers = atoi(optarg);
+      break;
+    case 'b':
+      prefetch_mib = atoi(optarg);
+      break;
+    case 'm':
+      budget_mib = atoi(optarg);
+      break;
+    case 't':
+      client_timeout = atoi(optarg);
+      break;
+    default:
+      argc = 0; // print usage
+      break;
+    }
+  }
+
+  if (argc - optind < 3) {
+    fprintf(stderr,
+            "Usage: %s [-m Memory Budget MiB] [-t Client Timeout] [-p "
+            "Prefetch Workers] [-b Prefetch Budget MiB] [-c Origin Limit] "
+            "[-q Queue Timeout] <Port Number> <Forbidden Sites File> "
+            "<Access Log File>\n",
+            argv[0]);
+    exit(1);
+  }
+  if (budget_mib < 1) {
+    fprintf(stderr, "Memory budget must be at least 1 MiB\n");
     exit(1);
   }
+  if (client_timeout < 1) {
+    fprintf(stderr, "Client timeout must be at least 1 second\n");
+    exit(1);
+  }
+  if (prefetch_workers < 0 || prefetch_mib < 1) {
+    fprintf(stderr, "Prefetch workers must be at least 0 and prefetch budget "
+                    "at least 1 MiB\n");
+    exit(1);
+  }
+  if (origin_limit < 1 || queue_timeout < 1) {
+    fprintf(stderr, "Origin limit and queue timeout must be at least 1\n");
+    exit(1);
+  }
+  memory_budget = (size_t)budget_mib * 1024 * 1024;
+  prefetch_budget = (size_t)prefetch_mib * 1024 * 1024;
 
-  int listen_port = atoi(argv[1]);
-  forbidden_file = argv[2];
-  access_log_file = argv[3];
+  int listen_port = atoi(argv[optind]);
+  forbidden_file = argv[optind + 1];
+  access_log_file = argv[optind + 2];
 
   signal(SIGINT, handle_sigint); // SIGINT handler
 
@@ -305,6 +1600,26 @@ int main(int argc, char *argv[]) {
 
   load_forbidden_sites(); // load forbidden sites (initial load)
 
+  // SIGUSR1 is only handled by the statistics thread
+  static sigset_t stats_signals;
+  sigemptyset(&stats_signals);
+  sigaddset(&stats_signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &stats_signals, NULL);
+  pthread_t stats_tid;
+  if (pthread_create(&stats_tid, NULL, stats_thread, &stats_signals) == 0) {
+    pthread_detach(stats_tid);
+  }
+
+  // low priority pool that warms the cache with links found in pages
+  for (int i = 0; i < prefetch_workers; i += 1) {
+    pthread_t prefetch_tid;
+    if (pthread_create(&prefetch_tid, NULL, prefetch_worker, NULL) != 0) {
+      fprintf(stderr, "Failed to create prefetch thread\n");
+      exit(1);
+    }
+    pthread_detach(prefetch_tid);
+  }
+
   int server_sock = socket(AF_INET, SOCK_STREAM, 0);
   if (server_sock < 0) {
     fprintf(stderr, "Socket creation failed\n");